@@ -0,0 +1,109 @@
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "model_inference.hpp"
+
+namespace captioning
+{
+    struct DecodingBenchmark
+    {
+        using BeamState = ModelInference::BeamState;
+        using ImageBeams = ModelInference::ImageBeams;
+
+        static void select_top_k(std::span<std::pair<int, float>> scored, size_t keep) { ModelInference::select_top_k(scored, keep); }
+
+        static size_t update_beams(ImageBeams &image, std::span<const std::pair<int, float>> top, int beam_width, int ngram_size, int end_id, std::vector<BeamState> &candidates)
+        {
+            return ModelInference::update_beams(image, top, beam_width, ngram_size, end_id, candidates);
+        }
+    };
+
+    namespace
+    {
+        constexpr int start_id = 1;
+        constexpr int end_id = 2;
+
+        // Log-probability-like scores, one per token id
+        std::vector<std::pair<int, float>> random_scores(size_t vocab_size, std::mt19937 &rng)
+        {
+            std::uniform_real_distribution<float> logit(-20.0f, 0.0f);
+            std::vector<std::pair<int, float>> scored(vocab_size);
+            for (size_t id = 0; id < vocab_size; ++id)
+            {
+                scored[id] = {static_cast<int>(id), logit(rng)};
+            }
+            return scored;
+        }
+
+        // The partial sort of one image's step scores. Arguments: vocabulary size, candidates kept.
+        void top_k(benchmark::State &state)
+        {
+            const auto vocab_size = static_cast<size_t>(state.range(0));
+            const auto keep = static_cast<size_t>(state.range(1));
+            std::mt19937 rng(42);
+            const std::vector<std::pair<int, float>> step_scores = random_scores(vocab_size, rng);
+            std::vector<std::pair<int, float>> scored;
+            for (auto _ : state)
+            {
+                // Stands in for score_candidates refilling the buffer every step
+                scored = step_scores;
+                DecodingBenchmark::select_top_k(scored, keep);
+                benchmark::DoNotOptimize(scored.data());
+            }
+            state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(vocab_size));
+            state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(vocab_size * sizeof(std::pair<int, float>)));
+        }
+
+        // Extending and pruning the beams of one image over a whole caption, with no_repeat_ngram_size 3.
+        // Arguments: beam width, caption length. Items are (beam, top candidate) pairs offered, bytes the token sequences
+        // copied into new candidates.
+        void beam_update(benchmark::State &state)
+        {
+            const int beam_width = static_cast<int>(state.range(0));
+            const int length = static_cast<int>(state.range(1));
+            constexpr int ngram_size = 3;
+            constexpr size_t vocab_size = 10000;
+
+            // The top candidates of every step, as beam_search hands them over: best first, beam_width plus one
+            // extra per step to make up for candidates blocked by repeated n-grams. The end token never wins,
+            // so every caption runs the full length.
+            std::mt19937 rng(42);
+            std::vector<std::vector<std::pair<int, float>>> steps;
+            for (int step = 0; step < length; ++step)
+            {
+                std::vector<std::pair<int, float>> scored = random_scores(vocab_size, rng);
+                std::erase_if(scored, [](const auto &candidate)
+                              { return candidate.first == end_id || candidate.first == start_id; });
+                const size_t keep = static_cast<size_t>(beam_width) + static_cast<size_t>(step) + 1;
+                DecodingBenchmark::select_top_k(scored, keep);
+                scored.resize(keep);
+                steps.push_back(std::move(scored));
+            }
+
+            std::vector<DecodingBenchmark::BeamState> candidates;
+            int64_t considered = 0;
+            int64_t copied = 0;
+            for (auto _ : state)
+            {
+                DecodingBenchmark::ImageBeams image;
+                image.beam.push_back(DecodingBenchmark::BeamState{{start_id}, 0.0f, false, {}});
+                for (const auto &top : steps)
+                {
+                    considered += static_cast<int64_t>(image.beam.size() * top.size());
+                    benchmark::DoNotOptimize(DecodingBenchmark::update_beams(image, top, beam_width, ngram_size, end_id, candidates));
+                    // Every candidate is as long as the new beam; candidates that made it into the beam were moved from
+                    copied += static_cast<int64_t>(candidates.size() * image.beam.front().sequence.size() * sizeof(int));
+                }
+                benchmark::DoNotOptimize(image.beam.data());
+            }
+            state.SetItemsProcessed(considered);
+            state.SetBytesProcessed(copied);
+        }
+    }
+
+    BENCHMARK(top_k)->ArgsProduct({{1000, 10000, 32000, 50257}, {5, 25}});
+    BENCHMARK(beam_update)->ArgsProduct({{1, 3, 5, 10}, {20, 40}});
+}
@@ -0,0 +1,113 @@
+#include <benchmark/benchmark.h>
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+#include "image_preprocessor.hpp"
+
+namespace captioning
+{
+    struct PreprocessingBenchmark
+    {
+        static cv::Mat normalize_image(const ImagePreprocessor &preprocessor, const cv::Mat &image) { return preprocessor.normalize_image(image); }
+
+        static void hwc_to_chw(const ImagePreprocessor &preprocessor, const cv::Mat &image, float *chw) { preprocessor.hwc_to_chw(image, chw); }
+    };
+
+    namespace
+    {
+        // Noise rather than a flat colour, so JPEG decoding does real work
+        cv::Mat random_image(int width, int height)
+        {
+            cv::Mat image(height, width, CV_8UC3);
+            cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(255));
+            cv::GaussianBlur(image, image, cv::Size(5, 5), 0);
+            return image;
+        }
+
+        // Arguments: model input side
+        void normalize_image(benchmark::State &state)
+        {
+            const int side = static_cast<int>(state.range(0));
+            ImagePreprocessor preprocessor({1, 3, side, side});
+            const cv::Mat image = random_image(side, side);
+            for (auto _ : state)
+            {
+                cv::Mat normalized = PreprocessingBenchmark::normalize_image(preprocessor, image);
+                benchmark::DoNotOptimize(normalized.data);
+            }
+            state.SetItemsProcessed(state.iterations());
+            state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(image.total() * image.elemSize()));
+        }
+
+        // Arguments: model input side
+        void hwc_to_chw(benchmark::State &state)
+        {
+            const int side = static_cast<int>(state.range(0));
+            ImagePreprocessor preprocessor({1, 3, side, side});
+            cv::Mat image;
+            random_image(side, side).convertTo(image, CV_32FC3, 1.0 / 255.0);
+            std::vector<float> chw(image.total() * 3);
+            for (auto _ : state)
+            {
+                PreprocessingBenchmark::hwc_to_chw(preprocessor, image, chw.data());
+                benchmark::ClobberMemory();
+            }
+            state.SetItemsProcessed(state.iterations());
+            state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(chw.size() * sizeof(float)));
+        }
+
+        // Decode of an in-memory JPEG plus preprocess_batch to a 224x224 input. Arguments: source width, height.
+        // Bytes are decoded source pixels.
+        void preprocess(benchmark::State &state)
+        {
+            const int width = static_cast<int>(state.range(0));
+            const int height = static_cast<int>(state.range(1));
+            ImagePreprocessor preprocessor({1, 3, 224, 224});
+            std::vector<unsigned char> encoded;
+            cv::imencode(".jpg", random_image(width, height), encoded);
+            for (auto _ : state)
+            {
+                auto image = preprocessor.decode(encoded);
+                if (!image)
+                {
+                    state.SkipWithError(image.error().c_str());
+                    break;
+                }
+                auto tensor = preprocessor.preprocess_batch(std::span<const cv::Mat>(&*image, 1));
+                if (!tensor)
+                {
+                    state.SkipWithError(tensor.error().c_str());
+                    break;
+                }
+                benchmark::DoNotOptimize(tensor->GetTensorData<float>());
+            }
+            state.SetItemsProcessed(state.iterations());
+            state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(width) * height * 3);
+        }
+
+        // Already-decoded images at the input size packed into one tensor. Arguments: batch size.
+        void preprocess_batch(benchmark::State &state)
+        {
+            const auto batch_size = static_cast<size_t>(state.range(0));
+            ImagePreprocessor preprocessor({1, 3, 224, 224});
+            const std::vector<cv::Mat> images(batch_size, random_image(224, 224));
+            for (auto _ : state)
+            {
+                auto tensor = preprocessor.preprocess_batch(images);
+                if (!tensor)
+                {
+                    state.SkipWithError(tensor.error().c_str());
+                    break;
+                }
+                benchmark::DoNotOptimize(tensor->GetTensorData<float>());
+            }
+            state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(batch_size));
+            state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(batch_size) * 224 * 224 * 3);
+        }
+    }
+
+    BENCHMARK(normalize_image)->Arg(224)->Arg(384)->Arg(512);
+    BENCHMARK(hwc_to_chw)->Arg(224)->Arg(384)->Arg(512);
+    BENCHMARK(preprocess)->Args({640, 480})->Args({1280, 720})->Args({1920, 1080})->Args({4032, 3024})->Unit(benchmark::kMillisecond);
+    BENCHMARK(preprocess_batch)->RangeMultiplier(4)->Range(1, 16);
+}
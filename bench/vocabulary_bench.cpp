@@ -0,0 +1,147 @@
+#include <benchmark/benchmark.h>
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <map>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "vocabulary.hpp"
+#include "detokenizer.hpp"
+
+namespace captioning
+{
+    namespace
+    {
+        // The special tokens, then word-like tokens of 2 to 12 characters; with continuation markers every other
+        // word is a "##" subword piece, as in a WordPiece vocabulary
+        std::vector<std::string> synthetic_tokens(size_t size, bool subwords)
+        {
+            std::vector<std::string> tokens = {"<pad>", "<start>", "<end>", "<unk>"};
+            std::mt19937 rng(42);
+            std::uniform_int_distribution<size_t> length(2, 12);
+            std::uniform_int_distribution<int> letter('a', 'z');
+            while (tokens.size() < size)
+            {
+                // The index suffix keeps tokens unique
+                std::string token = subwords && tokens.size() % 2 == 0 ? "##" : "";
+                for (size_t i = length(rng); i > 0; --i)
+                {
+                    token.push_back(static_cast<char>(letter(rng)));
+                }
+                tokens.push_back(token + std::to_string(tokens.size()));
+            }
+            return tokens;
+        }
+
+        // Vocabularies are loaded through a JSON file, the way the pipeline loads them, and kept for the whole run
+        const Vocabulary &synthetic_vocabulary(size_t size, bool subwords = false)
+        {
+            static std::map<std::pair<size_t, bool>, Vocabulary> loaded;
+            if (auto it = loaded.find({size, subwords}); it != loaded.end())
+            {
+                return it->second;
+            }
+
+            const std::filesystem::path path = std::filesystem::temp_directory_path() / std::format("captioning_bench_vocab_{}_{}_{}.json", ::getpid(), size, subwords);
+            std::ofstream(path) << nlohmann::json(synthetic_tokens(size, subwords)).dump();
+            auto vocab = Vocabulary::from_file(path);
+            std::filesystem::remove(path);
+            if (!vocab)
+            {
+                throw std::runtime_error(vocab.error());
+            }
+            return loaded.emplace(std::pair{size, subwords}, std::move(*vocab)).first->second;
+        }
+
+        // Hash lookups of every token in random order. Arguments: vocabulary size.
+        void token_to_id(benchmark::State &state)
+        {
+            const Vocabulary &vocab = synthetic_vocabulary(static_cast<size_t>(state.range(0)));
+            std::vector<std::string_view> tokens;
+            int64_t token_bytes = 0;
+            for (size_t id = 0; id < vocab.size(); ++id)
+            {
+                tokens.push_back(vocab.id_to_token(static_cast<int>(id)));
+                token_bytes += static_cast<int64_t>(tokens.back().size());
+            }
+            std::ranges::shuffle(tokens, std::mt19937(42));
+
+            for (auto _ : state)
+            {
+                for (std::string_view token : tokens)
+                {
+                    benchmark::DoNotOptimize(vocab.token_to_id(token));
+                }
+            }
+            state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(tokens.size()));
+            state.SetBytesProcessed(state.iterations() * token_bytes);
+        }
+
+        // Arguments: vocabulary size
+        void id_to_token(benchmark::State &state)
+        {
+            const Vocabulary &vocab = synthetic_vocabulary(static_cast<size_t>(state.range(0)));
+            std::vector<int> ids(vocab.size());
+            std::iota(ids.begin(), ids.end(), 0);
+            std::ranges::shuffle(ids, std::mt19937(42));
+
+            int64_t token_bytes = 0;
+            for (auto _ : state)
+            {
+                for (int id : ids)
+                {
+                    std::string_view token = vocab.id_to_token(id);
+                    benchmark::DoNotOptimize(token.data());
+                    token_bytes += static_cast<int64_t>(token.size());
+                }
+            }
+            state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(ids.size()));
+            state.SetBytesProcessed(token_bytes);
+        }
+
+        // Turning a caption's token ids into text, as decode_caption does for every result, with the caption
+        // buffer reused. Arguments: caption length in tokens, 1 for a WordPiece vocabulary (0 for whole words).
+        void detokenize(benchmark::State &state)
+        {
+            const auto length = static_cast<size_t>(state.range(0));
+            const bool subwords = state.range(1) != 0;
+            const Vocabulary &vocab = synthetic_vocabulary(10000, subwords);
+            auto detokenizer = Detokenizer::create(vocab, subwords ? "wordpiece" : "word");
+            if (!detokenizer)
+            {
+                state.SkipWithError(detokenizer.error().c_str());
+                return;
+            }
+
+            std::mt19937 rng(42);
+            std::uniform_int_distribution<int> word(4, static_cast<int>(vocab.size()) - 1);
+            std::vector<int> ids = {vocab.start_id()};
+            while (ids.size() < length - 1)
+            {
+                ids.push_back(word(rng));
+            }
+            ids.push_back(vocab.end_id());
+
+            std::string caption;
+            for (auto _ : state)
+            {
+                caption.clear();
+                detokenizer->detokenize(ids, caption);
+                benchmark::DoNotOptimize(caption.data());
+            }
+            state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(ids.size()));
+            state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(caption.size()));
+        }
+    }
+
+    BENCHMARK(token_to_id)->Arg(1000)->Arg(10000)->Arg(50000);
+    BENCHMARK(id_to_token)->Arg(1000)->Arg(10000)->Arg(50000);
+    BENCHMARK(detokenize)->ArgsProduct({{8, 16, 32, 64}, {0, 1}});
+}
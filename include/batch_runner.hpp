@@ -0,0 +1,61 @@
+#ifndef BATCH_RUNNER_HPP
+#define BATCH_RUNNER_HPP
+
+#include <ostream>
+#include <span>
+#include <string>
+
+#include "expected.hpp"
+#include "caption_generator.hpp"
+#include "metrics.hpp"
+
+namespace captioning
+{
+    struct BatchRunOptions
+    {
+        int decode_workers = 4;
+        int batch_size = 16;            // most images per generate_batch call
+        bool ordered = true;            // write lines in input order, otherwise as soon as each caption is done
+        std::ostream *progress = nullptr; // receives a progress line every progress_seconds
+        double progress_seconds = 5.0;
+    };
+
+    struct BatchRunSummary
+    {
+        size_t images = 0;
+        size_t failures = 0;
+        double wall_seconds = 0.0;
+        double images_per_second = 0.0;
+        double tokens_per_second = 0.0;
+        // What the run recorded: stage timings, steps and tokens per caption, pruned beams
+        MetricsSnapshot metrics;
+
+        [[nodiscard]] std::string to_string() const noexcept;
+    };
+
+    // Captions a list of images through a three-stage pipeline: decode workers load and resize images in parallel,
+    // one inference thread captions whatever is decoded in batches, and the calling thread writes one JSON object
+    // per image to out ({"index", "image", "caption"} or {"index", "image", "error"}).
+    class BatchRunner
+    {
+    public:
+        static tl::expected<BatchRunSummary, std::string> run(const CaptionGenerator &generator, std::span<const std::string> image_paths, const BatchRunOptions &options, std::ostream &out) noexcept;
+
+    private:
+        struct DecodedImage
+        {
+            size_t index;
+            tl::expected<cv::Mat, std::string> image;
+        };
+
+        struct CaptionRecord
+        {
+            size_t index;
+            tl::expected<std::string, std::string> caption;
+        };
+
+        static void write_record(const CaptionRecord &record, std::span<const std::string> image_paths, std::ostream &out);
+    };
+}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+namespace captioning
+{
+    // Multi-producer, multi-consumer FIFO with a fixed capacity. Once closed, pushes fail and pops drain
+    // whatever is left before returning std::nullopt.
+    template <typename T>
+    class BoundedQueue
+    {
+    public:
+        explicit BoundedQueue(size_t capacity) noexcept : capacity_(capacity > 0 ? capacity : 1) {}
+
+        // Blocks while the queue is full; false once the queue is closed
+        bool push(T item)
+        {
+            std::unique_lock lock(mutex_);
+            not_full_.wait(lock, [this]
+                           { return closed_ || items_.size() < capacity_; });
+            if (closed_)
+            {
+                return false;
+            }
+            items_.push_back(std::move(item));
+            lock.unlock();
+            not_empty_.notify_one();
+            return true;
+        }
+
+        // Never blocks; item is only moved from when this returns true
+        bool try_push(T &&item)
+        {
+            std::unique_lock lock(mutex_);
+            if (closed_ || items_.size() >= capacity_)
+            {
+                return false;
+            }
+            items_.push_back(std::move(item));
+            lock.unlock();
+            not_empty_.notify_one();
+            return true;
+        }
+
+        // Blocks until an item is available; std::nullopt once the queue is closed and empty
+        std::optional<T> pop()
+        {
+            std::unique_lock lock(mutex_);
+            not_empty_.wait(lock, [this]
+                            { return closed_ || !items_.empty(); });
+            if (items_.empty())
+            {
+                return std::nullopt;
+            }
+            T item = std::move(items_.front());
+            items_.pop_front();
+            lock.unlock();
+            not_full_.notify_one();
+            return item;
+        }
+
+        // Never blocks; std::nullopt when the queue is empty right now
+        std::optional<T> try_pop()
+        {
+            std::unique_lock lock(mutex_);
+            if (items_.empty())
+            {
+                return std::nullopt;
+            }
+            T item = std::move(items_.front());
+            items_.pop_front();
+            lock.unlock();
+            not_full_.notify_one();
+            return item;
+        }
+
+        void close() noexcept
+        {
+            {
+                std::lock_guard lock(mutex_);
+                closed_ = true;
+            }
+            not_empty_.notify_all();
+            not_full_.notify_all();
+        }
+
+        [[nodiscard]] size_t size() const
+        {
+            std::lock_guard lock(mutex_);
+            return items_.size();
+        }
+
+    private:
+        mutable std::mutex mutex_;
+        std::condition_variable not_empty_;
+        std::condition_variable not_full_;
+        std::deque<T> items_;
+        size_t capacity_;
+        bool closed_ = false;
+    };
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef CANCELLATION_TOKEN_HPP
+#define CANCELLATION_TOKEN_HPP
+
+#include <onnxruntime_cxx_api.h>
+#include <chrono>
+#include <memory>
+#include <optional>
+
+namespace captioning
+{
+    // Stops one caption request: on cancel() or once its deadline passes. Decoding checks the token between steps,
+    // and a Session::Run in flight is aborted through RunOptions::SetTerminate. Copies share the same state, so the
+    // token can be handed to the request and cancelled from another thread.
+    //
+    // A default-constructed token never stops anything and costs nothing to check.
+    class CancellationToken
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        CancellationToken() noexcept = default;
+
+        [[nodiscard]] static CancellationToken create();
+
+        [[nodiscard]] static CancellationToken with_deadline(Clock::time_point deadline);
+
+        [[nodiscard]] static CancellationToken with_timeout(Clock::duration timeout) { return with_deadline(Clock::now() + timeout); }
+
+        void cancel() const noexcept;
+
+        // False for a default-constructed token, which can never stop
+        [[nodiscard]] bool can_stop() const noexcept { return state_ != nullptr; }
+
+        // Cancelled, or past the deadline
+        [[nodiscard]] bool stop_requested() const noexcept;
+
+        [[nodiscard]] bool deadline_exceeded() const noexcept;
+
+        [[nodiscard]] std::optional<Clock::time_point> deadline() const noexcept;
+
+        // Ties a Session::Run about to start to this token until detach(): stopping the token (or reaching the
+        // deadline) meanwhile terminates the run. Returns false, leaving nothing attached, if the token has
+        // already stopped. One run may be attached at a time.
+        [[nodiscard]] bool attach(Ort::RunOptions &run_options) const noexcept;
+
+        void detach() const noexcept;
+
+        struct State;
+
+    private:
+        std::shared_ptr<State> state_;
+
+        explicit CancellationToken(std::shared_ptr<State> state) noexcept : state_(std::move(state)) {}
+    };
+}
+
+#endif
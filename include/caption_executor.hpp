@@ -0,0 +1,53 @@
+#ifndef CAPTION_EXECUTOR_HPP
+#define CAPTION_EXECUTOR_HPP
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "expected.hpp"
+#include "bounded_queue.hpp"
+
+namespace captioning
+{
+    // Two-stage worker pool behind CaptionGenerator's async API. Requests enter a bounded submission queue,
+    // are preprocessed (load/decode, resize, normalize) on preprocessing threads, and then decoded on
+    // inference threads, so a slow image decode never holds up the model and vice versa.
+    class CaptionExecutor
+    {
+    public:
+        // Runs on an inference thread
+        using InferenceTask = std::function<void()>;
+        // Runs on a preprocessing thread; returns the work for an inference thread, or nothing if the request is already done
+        using PreprocessTask = std::function<InferenceTask()>;
+
+        static tl::expected<std::unique_ptr<CaptionExecutor>, std::string> create(int preprocess_threads, int inference_threads, int queue_capacity) noexcept;
+
+        // Finishes everything already queued, then joins the threads
+        ~CaptionExecutor();
+
+        CaptionExecutor(const CaptionExecutor &) = delete;
+        CaptionExecutor &operator=(const CaptionExecutor &) = delete;
+
+        // Never blocks: false (and task untouched) when the submission queue is full or the executor is stopping
+        [[nodiscard]] bool try_submit(PreprocessTask &&task) noexcept;
+
+    private:
+        BoundedQueue<PreprocessTask> submissions_;
+        BoundedQueue<InferenceTask> ready_;
+        std::vector<std::thread> preprocess_threads_;
+        std::vector<std::thread> inference_threads_;
+
+        explicit CaptionExecutor(int queue_capacity) noexcept;
+
+        void preprocess_loop() noexcept;
+
+        void inference_loop() noexcept;
+
+        void shutdown() noexcept;
+    };
+}
+
+#endif
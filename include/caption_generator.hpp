@@ -1,33 +1,226 @@
 #ifndef CAPTION_GENERATOR_HPP
 #define CAPTION_GENERATOR_HPP
 
+#include <atomic>
 #include <string>
+#include <string_view>
 #include <memory>
+#include <span>
+#include <vector>
+#include <variant>
+#include <functional>
+#include <future>
+#include <coroutine>
+#include <mutex>
 
 #include "config.hpp"
 #include "image_preprocessor.hpp"
 #include "vocabulary.hpp"
 #include "model_inference.hpp"
+#include "decoding_constraints.hpp"
+#include "detokenizer.hpp"
+#include "caption_executor.hpp"
+#include "cancellation_token.hpp"
 
 namespace captioning
 {
+    // An encoded image (JPEG, PNG, ...) held in memory
+    using ImageBuffer = std::span<const unsigned char>;
+
+    // Raw 8-bit RGB pixels, row after row with stride bytes per row; decoding is skipped entirely
+    struct RawImage
+    {
+        std::span<const unsigned char> pixels;
+        int width = 0;
+        int height = 0;
+        size_t stride = 0;
+    };
+
+    // An image path, an encoded image owned by the request, or an encoded (ImageBuffer) or raw image in memory the
+    // caller owns. Caller-owned memory is only read while the image is loaded, but must stay valid until the
+    // request completes.
+    using ImageInput = std::variant<std::string, std::vector<unsigned char>, ImageBuffer, RawImage>;
+
+    struct CaptionResult
+    {
+        std::string caption;
+        // The request's deadline passed (or it was cancelled) mid-decode; caption is the best partial hypothesis
+        bool truncated = false;
+        // Runners-up when DecodeOptions::n_best > 1, best first
+        std::vector<std::string> alternatives;
+    };
+
+    using CaptionCallback = std::function<void(tl::expected<std::string, std::string>)>;
+    using CaptionResultCallback = std::function<void(tl::expected<CaptionResult, std::string>)>;
+
+    // One call of a streaming callback: a newly committed token, then exactly one completed or failed event
+    struct CaptionStreamEvent
+    {
+        enum class Type
+        {
+            token,
+            completed,
+            failed
+        };
+
+        Type type;
+        // The committed token (token events only)
+        int token_id = -1;
+        // token: the text this token adds to the caption (empty for special tokens, and held back while a byte-level
+        // token ends mid UTF-8 character); completed: the whole caption; failed: the error.
+        // Only valid during the callback.
+        std::string_view text;
+    };
+
+    using CaptionStreamCallback = std::function<void(const CaptionStreamEvent &)>;
+
+    // What CaptionGenerator::create loads before touching ONNX Runtime: the config, the vocabulary and, in mmap
+    // mode, the mapped model files. A prefork master loads these once; each forked worker builds its generator
+    // from its copy-on-write copy and only creates the session itself.
+    struct GeneratorAssets
+    {
+        Config config;
+        std::unique_ptr<Vocabulary> vocab;
+        std::vector<MappedFile> model_mappings;
+
+        // Starts no threads and creates no ONNX Runtime state, so it is safe before fork()
+        static tl::expected<GeneratorAssets, std::string> load(const Config &config) noexcept;
+    };
+
+    class CaptionGenerator;
+
+    // co_await generator.generate_awaitable(path) suspends the coroutine until the caption is ready; it resumes on an
+    // executor thread. The awaitable must be awaited before the generator is destroyed.
+    class CaptionAwaitable
+    {
+    public:
+        [[nodiscard]] bool await_ready() const noexcept { return false; }
+        // False (resume at once) when the request completed before this returned
+        [[nodiscard]] bool await_suspend(std::coroutine_handle<> handle) noexcept;
+        [[nodiscard]] tl::expected<std::string, std::string> await_resume() noexcept { return std::move(result_); }
+
+    private:
+        friend class CaptionGenerator;
+
+        const CaptionGenerator *generator_;
+        ImageInput image_;
+        tl::expected<std::string, std::string> result_;
+        std::atomic<bool> handed_off_ = false;
+
+        CaptionAwaitable(const CaptionGenerator &generator, ImageInput image) noexcept : generator_(&generator), image_(std::move(image)) {}
+    };
+
+    // Thread-safe: every generate* method is const and may be called concurrently on one instance. The session,
+    // vocabulary and config are shared read-only; per-call state lives on the caller's stack or in per-thread
+    // scratch, so no lock is taken while decoding.
     class CaptionGenerator
     {
     public:
         static tl::expected<CaptionGenerator, std::string> create(const Config &config) noexcept;
 
-        [[nodiscard]] tl::expected<std::string, std::string> generate(const std::string &image_path) noexcept;
+        static tl::expected<CaptionGenerator, std::string> create(GeneratorAssets assets) noexcept;
+
+        [[nodiscard]] tl::expected<std::string, std::string> generate(const std::string &image_path) const noexcept;
+
+        // Decodes with per-request options (checked against the configured limits) on the shared session.
+        // Stops at cancel's deadline or when it is cancelled, also aborting a model step in flight. Stopping before
+        // decoding starts is an error; stopping during decoding returns the best partial caption, marked truncated.
+        [[nodiscard]] tl::expected<CaptionResult, std::string> generate(const std::string &image_path, const DecodeOptions &options, const CancellationToken &cancel = {}) const noexcept;
+
+        // Captions one blank image so the session's first-run setup (allocations, kernel selection) is paid here
+        // rather than by the first request. Empty on success.
+        [[nodiscard]] std::string warm_up() const noexcept;
+
+        // The configured defaults, a starting point for per-request options
+        [[nodiscard]] DecodeOptions decode_options() const noexcept { return pipeline_->config.decode_options(); }
+
+        // Like generate(), but reports each token as soon as beam search commits it (the prefix shared by all beams,
+        // which with beam_width 1 is every token), so the caption can be shown while it is produced. The token texts
+        // concatenate to the returned caption. on_event runs on the calling thread.
+        [[nodiscard]] tl::expected<std::string, std::string> generate_stream(const std::string &image_path, const CaptionStreamCallback &on_event) const noexcept;
+
+        // Captions many images with batched preprocessing and inference (max_batch_size images per model batch).
+        // Results are in input order and an image that fails to load or decode fails alone.
+        [[nodiscard]] std::vector<tl::expected<std::string, std::string>> generate_batch(std::span<const std::string> image_paths) const noexcept;
+        [[nodiscard]] std::vector<tl::expected<std::string, std::string>> generate_batch(std::span<const ImageBuffer> images) const noexcept;
+
+        // The two halves of generate_batch for callers running their own pipeline: load_image decodes an image and
+        // resizes it to the model input (safe to call from many decode threads), generate_batch captions what it loaded.
+        [[nodiscard]] tl::expected<cv::Mat, std::string> load_image(const ImageInput &image) const noexcept;
+        [[nodiscard]] std::vector<tl::expected<std::string, std::string>> generate_batch(std::vector<tl::expected<cv::Mat, std::string>> images) const noexcept;
+
+        // Queues the image on the generator's executor (started on first use) and returns at once. When the
+        // submission queue is full the request fails immediately with an error instead of blocking the caller.
+        [[nodiscard]] std::future<tl::expected<std::string, std::string>> generate_async(ImageInput image) const noexcept;
+
+        // on_complete runs exactly once, on an executor thread (or on the calling thread if the request is rejected)
+        void generate_async(ImageInput image, CaptionCallback on_complete) const noexcept;
+
+        // As above, with decode options and a deadline/cancellation token. Invalid options are rejected immediately
+        // and a request whose token stopped while queued is never run.
+        void generate_async(ImageInput image, const DecodeOptions &options, CancellationToken cancel, CaptionResultCallback on_complete) const noexcept;
+
+        [[nodiscard]] CaptionAwaitable generate_awaitable(ImageInput image) const noexcept { return CaptionAwaitable(*this, std::move(image)); }
+
+        // Writes the caption through out instead of returning a new string, so batch callers can reuse one
+        // buffer per worker (e.g. std::back_inserter on a cleared std::string)
+        template <typename OutputIt>
+        [[nodiscard]] tl::expected<OutputIt, std::string> generate_to(const std::string &image_path, OutputIt out) const noexcept
+        {
+            auto decoded = pipeline_->generate_tokens(image_path, pipeline_->config.decode_options());
+            if (!decoded)
+            {
+                return tl::unexpected(decoded.error());
+            }
+            // The caller's iterator may throw (e.g. bad_alloc from a back_inserter)
+            try
+            {
+                return pipeline_->detokenizer.detokenize_to(decoded->tokens, out);
+            }
+            catch (const std::exception &ex)
+            {
+                return tl::unexpected("Failed to write caption for " + image_path + ": " + ex.what());
+            }
+        }
 
     private:
-        Config config_;
-        std::unique_ptr<ImagePreprocessor> preprocessor_;
-        std::unique_ptr<Vocabulary> vocab_;
-        std::unique_ptr<ModelInference> model_;
+        // Everything needed to caption an image. Kept on the heap so queued async work holds a stable pointer
+        // even if the generator itself is moved.
+        struct Pipeline
+        {
+            Config config;
+            std::unique_ptr<ImagePreprocessor> preprocessor;
+            std::unique_ptr<Vocabulary> vocab;
+            std::unique_ptr<ModelInference> model;
+            DecodingConstraints constraints;
+            Detokenizer detokenizer;
+
+            [[nodiscard]] tl::expected<cv::Mat, std::string> load(const ImageInput &image) const noexcept;
+
+            [[nodiscard]] tl::expected<Ort::Value, std::string> prepare(const ImageInput &image) const noexcept;
+
+            [[nodiscard]] tl::expected<DecodeResult, std::string> infer(Ort::Value &input_tensor, const DecodeOptions &options, const CancellationToken &cancel = {}, const ModelInference::CommitCallback &on_commit = {}) const noexcept;
+
+            [[nodiscard]] tl::expected<DecodeResult, std::string> generate_tokens(const std::string &image_path, const DecodeOptions &options, const CancellationToken &cancel = {}) const noexcept;
+
+            [[nodiscard]] CaptionResult to_caption_result(DecodeResult &decoded) const noexcept;
+
+            [[nodiscard]] std::vector<tl::expected<std::string, std::string>> caption_images(std::vector<tl::expected<cv::Mat, std::string>> images) const noexcept;
+
+            void decode_caption(std::span<const int> token_ids, std::string &caption) const noexcept;
+        };
+
+        std::unique_ptr<const Pipeline> pipeline_;
+        // The executor is started lazily (under executor_once_) by the first async request
+        std::unique_ptr<std::once_flag> executor_once_;
+        mutable std::string executor_error_;
+        // Declared last so its threads are joined before the pipeline they use is destroyed
+        mutable std::unique_ptr<CaptionExecutor> executor_;
 
-        CaptionGenerator(Config config, std::unique_ptr<ImagePreprocessor> preprocessor, std::unique_ptr<Vocabulary> vocab, std::unique_ptr<ModelInference> model) noexcept;
+        explicit CaptionGenerator(std::unique_ptr<const Pipeline> pipeline) noexcept;
 
-        [[nodiscard]] std::string decode_caption(std::span<const int> token_ids) const noexcept;
+        [[nodiscard]] CaptionExecutor *start_executor() const noexcept;
     };
 }
 
-#endif
\ No newline at end of file
+#endif
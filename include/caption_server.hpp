@@ -0,0 +1,49 @@
+#ifndef CAPTION_SERVER_HPP
+#define CAPTION_SERVER_HPP
+
+#include <memory>
+#include <string>
+
+#include "expected.hpp"
+#include "config.hpp"
+#include "reloadable_generator.hpp"
+#include "dynamic_batcher.hpp"
+#include "http_server.hpp"
+
+namespace captioning
+{
+    // The serve command's HTTP API on top of one resident generator:
+    //   POST /caption  body: encoded image bytes -> {"caption": "..."} or {"error": "..."}
+    //   GET  /health   -> {"status": "ok"}
+    //   POST /reload   -> reloads the generator from its config file (when enabled)
+    //   GET  /metrics  -> per-stage timings and counters in the Prometheus text format
+    // Connection threads decode the uploaded images in parallel; a DynamicBatcher groups them into model batches.
+    // The server's own settings (address, threads, batching) are taken from config once, at start.
+    class CaptionServer
+    {
+    public:
+        static tl::expected<std::unique_ptr<CaptionServer>, std::string> start(ReloadableGenerator &generators, const Config &config, const HttpServerOptions &http_options, bool reload_endpoint) noexcept;
+
+        // Finishes requests in flight, then stops
+        void stop() noexcept { http_->stop(); }
+
+        [[nodiscard]] int port() const noexcept { return http_->port(); }
+
+    private:
+        ReloadableGenerator &generators_;
+        bool reload_endpoint_;
+        std::unique_ptr<DynamicBatcher> batcher_;
+        // Declared last so connections stop before the batcher they submit to
+        std::unique_ptr<HttpServer> http_;
+
+        CaptionServer(ReloadableGenerator &generators, std::unique_ptr<DynamicBatcher> batcher, bool reload_endpoint) noexcept;
+
+        [[nodiscard]] HttpResponse handle(const HttpRequest &request) const;
+
+        [[nodiscard]] HttpResponse caption(const HttpRequest &request) const;
+
+        [[nodiscard]] HttpResponse reload() const;
+    };
+}
+
+#endif
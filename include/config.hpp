@@ -3,6 +3,8 @@
 
 #include <string>
 #include <vector>
+#include <map>
+#include <optional>
 #include <filesystem>
 #include <nlohmann/json.hpp>
 #include <iomanip>
@@ -13,26 +15,122 @@
 namespace captioning
 {
 
+    struct ModelVariant
+    {
+        std::string path;
+        std::string precision = "fp32";          // "fp32", "int8" or "uint8"
+        std::vector<std::string> external_data; // external initializer files, relative to the model directory
+
+        [[nodiscard]] bool is_quantized() const noexcept { return precision != "fp32"; }
+        [[nodiscard]] bool has_known_precision() const noexcept { return precision == "fp32" || precision == "int8" || precision == "uint8"; }
+    };
+
+    struct OutputProjectionSettings
+    {
+        std::string weights_path;
+        std::string hidden_output;  // decoder output carrying the hidden state
+        int shortlist_size = 256;   // top tokens of the first step kept as candidates
+        int frequent_tokens = 0;    // leading vocabulary entries (most frequent words) always kept
+    };
+
+    // Decoding settings of one request. Config::decode_options() gives the configured defaults and
+    // Config::check_decode_options() the configured limits.
+    struct DecodeOptions
+    {
+        int beam_width = 5;
+        int max_length = 20;
+        // GNMT length penalty alpha: hypotheses are ranked by score / ((5 + length) / 6)^alpha, 0 ranks by log-probability
+        float length_penalty = 0.0f;
+        // Hypotheses returned, best first; at most beam_width
+        int n_best = 1;
+    };
+
     class Config
     {
     public:
         static tl::expected<Config, std::string> from_file(const std::filesystem::path &config_path) noexcept;
 
-        [[nodiscard]] std::string model_path() const noexcept { return model_path_; }
+        // Returns a copy of this config with another entry of "model_variants" selected ("default" selects model_path).
+        [[nodiscard]] tl::expected<Config, std::string> with_model_variant(const std::string &variant) const noexcept;
+
+        [[nodiscard]] std::string model_path() const noexcept { return selected_variant().path; }
+        [[nodiscard]] std::string model_variant() const noexcept { return model_variant_.empty() ? "default" : model_variant_; }
+        [[nodiscard]] std::string model_precision() const noexcept { return selected_variant().precision; }
+        [[nodiscard]] bool model_quantized() const noexcept { return selected_variant().is_quantized(); }
+        [[nodiscard]] const std::map<std::string, ModelVariant> &model_variants() const noexcept { return model_variants_; }
+        [[nodiscard]] std::vector<std::string> model_external_data() const noexcept { return selected_variant().external_data; }
+        [[nodiscard]] std::string model_load_mode() const noexcept { return model_load_mode_; }
+        [[nodiscard]] bool share_prepacked_weights() const noexcept { return share_prepacked_weights_; }
+        [[nodiscard]] bool use_shared_allocator() const noexcept { return use_shared_allocator_; }
+        [[nodiscard]] const std::optional<OutputProjectionSettings> &output_projection() const noexcept { return output_projection_; }
         [[nodiscard]] std::string vocab_path() const noexcept { return vocab_path_; }
+        [[nodiscard]] std::string tokenizer() const noexcept { return tokenizer_; }
         [[nodiscard]] std::vector<int64_t> input_shape() const noexcept { return input_shape_; }
         [[nodiscard]] int max_caption_length() const noexcept { return max_caption_length_; }
         [[nodiscard]] int beam_width() const noexcept { return beam_width_; }
+        [[nodiscard]] int max_beam_width() const noexcept { return max_beam_width_; }
+        [[nodiscard]] int max_decode_length() const noexcept { return max_decode_length_; }
+        [[nodiscard]] float length_penalty() const noexcept { return length_penalty_; }
+        [[nodiscard]] DecodeOptions decode_options() const noexcept { return DecodeOptions{beam_width_, max_caption_length_, length_penalty_, 1}; }
+        // Empty when options are within the configured limits, otherwise what is wrong with them
+        [[nodiscard]] std::string check_decode_options(const DecodeOptions &options) const noexcept;
+        [[nodiscard]] int max_batch_size() const noexcept { return max_batch_size_; }
+        [[nodiscard]] int async_preprocess_threads() const noexcept { return async_preprocess_threads_; }
+        [[nodiscard]] int async_inference_threads() const noexcept { return async_inference_threads_; }
+        [[nodiscard]] int async_queue_capacity() const noexcept { return async_queue_capacity_; }
+        [[nodiscard]] std::string server_host() const noexcept { return server_host_; }
+        [[nodiscard]] int server_port() const noexcept { return server_port_; }
+        [[nodiscard]] int server_threads() const noexcept { return server_threads_; }
+        [[nodiscard]] size_t server_max_body_bytes() const noexcept { return server_max_body_bytes_; }
+        [[nodiscard]] bool server_reload_endpoint() const noexcept { return server_reload_endpoint_; }
+        [[nodiscard]] float batch_window_ms() const noexcept { return batch_window_ms_; }
+        [[nodiscard]] std::string sidecar_socket() const noexcept { return sidecar_socket_; }
+        [[nodiscard]] int daemon_workers() const noexcept { return daemon_workers_; }
+        [[nodiscard]] bool daemon_pin_workers() const noexcept { return daemon_pin_workers_; }
+        [[nodiscard]] std::string trace_output() const noexcept { return trace_output_; }
+        [[nodiscard]] bool trace_onnxruntime() const noexcept { return trace_onnxruntime_; }
+        [[nodiscard]] const std::vector<std::string> &banned_tokens() const noexcept { return banned_tokens_; }
+        [[nodiscard]] int no_repeat_ngram_size() const noexcept { return no_repeat_ngram_size_; }
 
     private:
         std::string model_path_;
         std::string vocab_path_;
+        std::string tokenizer_ = "word";
         std::vector<int64_t> input_shape_;
         int max_caption_length_ = 20;
         int beam_width_ = 5;
+        int max_beam_width_ = 5;
+        int max_decode_length_ = 20;
+        float length_penalty_ = 0.0f;
+        int max_batch_size_ = 16;
+        int async_preprocess_threads_ = 2;
+        int async_inference_threads_ = 1;
+        int async_queue_capacity_ = 64;
+        std::string server_host_ = "127.0.0.1";
+        int server_port_ = 8080;
+        int server_threads_ = 16;
+        size_t server_max_body_bytes_ = 16 * 1024 * 1024;
+        bool server_reload_endpoint_ = false;
+        float batch_window_ms_ = 5.0f;
+        std::string sidecar_socket_ = "/tmp/image_captioning.sock";
+        int daemon_workers_ = 0;
+        bool daemon_pin_workers_ = true;
+        std::string trace_output_;
+        bool trace_onnxruntime_ = false;
+        std::vector<std::string> banned_tokens_;
+        int no_repeat_ngram_size_ = 0;
+        std::map<std::string, ModelVariant> model_variants_;
+        std::string model_variant_;
+        ModelVariant default_variant_;
+        std::string model_load_mode_ = "file";
+        bool share_prepacked_weights_ = true;
+        bool use_shared_allocator_ = true;
+        std::optional<OutputProjectionSettings> output_projection_;
 
         Config() = default;
 
+        [[nodiscard]] const ModelVariant &selected_variant() const noexcept;
+
         [[nodiscard]] std::string validate() const noexcept;
     };
 }
@@ -0,0 +1,69 @@
+#ifndef DECODING_CONSTRAINTS_HPP
+#define DECODING_CONSTRAINTS_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <span>
+
+#include "expected.hpp"
+#include "config.hpp"
+#include "vocabulary.hpp"
+
+namespace captioning
+{
+    // Vocabulary-sized bitset of tokens that may never be emitted
+    class TokenMask
+    {
+    public:
+        TokenMask() = default;
+        explicit TokenMask(size_t vocab_size) noexcept;
+
+        void ban(int id) noexcept;
+
+        [[nodiscard]] bool is_banned(int id) const noexcept
+        {
+            return id >= 0 && static_cast<size_t>(id) < size_ && (words_[id >> 6] >> (id & 63)) & 1u;
+        }
+
+        // Sets the score of every banned token to -inf
+        void apply(std::span<float> scores) const noexcept;
+
+    private:
+        std::vector<uint64_t> words_;
+        size_t size_ = 0;
+    };
+
+    // Hashes of the n-grams a beam has produced so far. Captions are short, so a flat vector beats a hash set.
+    class NGramHistory
+    {
+    public:
+        // Would appending token to sequence repeat an n-gram already in it?
+        [[nodiscard]] bool repeats(std::span<const int> sequence, int token, int n) const noexcept;
+
+        // Records the n-gram ending at the last token of sequence
+        void record(std::span<const int> sequence, int n);
+
+    private:
+        std::vector<uint64_t> hashes_;
+
+        [[nodiscard]] static uint64_t hash(std::span<const int> prefix, int token) noexcept;
+    };
+
+    class DecodingConstraints
+    {
+    public:
+        static tl::expected<DecodingConstraints, std::string> create(const Config &config, const Vocabulary &vocab) noexcept;
+
+        [[nodiscard]] const TokenMask &banned_tokens() const noexcept { return banned_tokens_; }
+        [[nodiscard]] int no_repeat_ngram_size() const noexcept { return no_repeat_ngram_size_; }
+
+    private:
+        TokenMask banned_tokens_;
+        int no_repeat_ngram_size_ = 0;
+
+        DecodingConstraints(TokenMask banned_tokens, int no_repeat_ngram_size) noexcept;
+    };
+}
+
+#endif
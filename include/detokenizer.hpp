@@ -0,0 +1,111 @@
+#ifndef DETOKENIZER_HPP
+#define DETOKENIZER_HPP
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <span>
+#include <algorithm>
+
+#include "expected.hpp"
+#include "vocabulary.hpp"
+
+namespace captioning
+{
+    // Turns token ids back into text for whole-word and subword vocabularies:
+    //
+    //   "word"           tokens are words, joined with spaces
+    //   "wordpiece"      "##" marks a token continuing the previous word (BERT)
+    //   "bpe"            "@@" marks a token continued by the next one (subword-nmt)
+    //   "sentencepiece"  U+2581 marks a token starting a new word
+    //   "byte_bpe"       GPT-2 byte-level BPE; tokens are bytes mapped to printable code points, U+0120 is a space
+    //
+    // The surface text of every token is resolved once at construction, so appending a token is a single
+    // copy into the caller's buffer.
+    class Detokenizer
+    {
+    public:
+        // Carries the word-boundary state between calls when detokenizing incrementally
+        struct Stream
+        {
+            bool started = false;
+            bool glue_next = false;
+        };
+
+        // The tokenizer names above; Config validates against this same list
+        static constexpr std::array<std::string_view, 5> tokenizers = {"word", "wordpiece", "bpe", "sentencepiece", "byte_bpe"};
+
+        static tl::expected<Detokenizer, std::string> create(const Vocabulary &vocab, const std::string &tokenizer) noexcept;
+
+        // Empty if tokenizer is one of tokenizers
+        [[nodiscard]] static std::string check_tokenizer(std::string_view tokenizer) noexcept;
+
+        // Appends the text of one token; special tokens (<start>, <end>, <pad>, <unk>) append nothing
+        void append(int id, Stream &stream, std::string &out) const noexcept;
+
+        // Appends the text of a whole sequence, growing out at most once
+        void detokenize(std::span<const int> ids, std::string &out) const noexcept;
+
+        // Writes the text of a whole sequence through an output iterator, e.g. into a caller-owned buffer
+        template <typename OutputIt>
+        OutputIt detokenize_to(std::span<const int> ids, OutputIt out) const
+        {
+            Stream stream;
+            for (int id : ids)
+            {
+                const Piece *piece = find(id);
+                if (!piece)
+                {
+                    continue;
+                }
+                if (separates(*piece, stream))
+                {
+                    *out++ = ' ';
+                }
+                out = std::copy_n(surfaces_.data() + piece->offset, piece->length, out);
+                advance(*piece, stream);
+            }
+            return out;
+        }
+
+        // Exact number of bytes detokenize() appends for ids
+        [[nodiscard]] size_t length(std::span<const int> ids) const noexcept;
+
+    private:
+        struct Piece
+        {
+            uint32_t offset = 0;
+            uint32_t length = 0;
+            bool space_before = false;
+            bool glue_next = false;
+            bool skip = true;
+        };
+
+        std::string surfaces_;
+        std::vector<Piece> pieces_;
+
+        Detokenizer(std::string surfaces, std::vector<Piece> pieces) noexcept;
+
+        [[nodiscard]] const Piece *find(int id) const noexcept
+        {
+            return id >= 0 && static_cast<size_t>(id) < pieces_.size() && !pieces_[id].skip ? &pieces_[id] : nullptr;
+        }
+
+        [[nodiscard]] static bool separates(const Piece &piece, const Stream &stream) noexcept
+        {
+            return stream.started && piece.space_before && !stream.glue_next;
+        }
+
+        static void advance(const Piece &piece, Stream &stream) noexcept
+        {
+            stream.started = true;
+            stream.glue_next = piece.glue_next;
+        }
+
+        [[nodiscard]] static std::string decode_byte_level(std::string_view token);
+    };
+}
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef DYNAMIC_BATCHER_HPP
+#define DYNAMIC_BATCHER_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "expected.hpp"
+#include "reloadable_generator.hpp"
+
+namespace captioning
+{
+    // Groups images submitted concurrently (e.g. by server connection threads) into model batches. A batch is run
+    // once it has max_batch_size images or once the window has passed since its first image arrived, whichever
+    // comes first, so a lone request waits at most the window and a busy server fills whole batches.
+    class DynamicBatcher
+    {
+    public:
+        using CaptionFuture = std::future<tl::expected<std::string, std::string>>;
+
+        static tl::expected<std::unique_ptr<DynamicBatcher>, std::string> create(const ReloadableGenerator &generators, int max_batch_size, std::chrono::microseconds window) noexcept;
+
+        // Captions everything already submitted, then joins the batching thread
+        ~DynamicBatcher();
+
+        DynamicBatcher(const DynamicBatcher &) = delete;
+        DynamicBatcher &operator=(const DynamicBatcher &) = delete;
+
+        // image must already be loaded and resized (CaptionGenerator::load_image). Never blocks; the future becomes
+        // ready when the batch holding the image has run.
+        [[nodiscard]] CaptionFuture submit(cv::Mat image) noexcept;
+
+    private:
+        struct Request
+        {
+            cv::Mat image;
+            std::promise<tl::expected<std::string, std::string>> caption;
+            std::chrono::steady_clock::time_point arrival;
+        };
+
+        // Each batch runs on whichever generator is current when it starts
+        const ReloadableGenerator &generators_;
+        size_t max_batch_size_;
+        std::chrono::microseconds window_;
+        std::mutex mutex_;
+        std::condition_variable pending_changed_;
+        std::deque<Request> pending_;
+        bool stopping_ = false;
+        std::thread batch_thread_;
+
+        DynamicBatcher(const ReloadableGenerator &generators, int max_batch_size, std::chrono::microseconds window) noexcept;
+
+        void batch_loop() noexcept;
+
+        void run_batch(std::vector<Request> &batch) noexcept;
+    };
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef HTTP_SERVER_HPP
+#define HTTP_SERVER_HPP
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "expected.hpp"
+#include "bounded_queue.hpp"
+
+namespace captioning
+{
+    struct HttpRequest
+    {
+        std::string method;
+        std::string path;  // target without the query string
+        std::string query; // after '?', undecoded
+        std::map<std::string, std::string> headers; // names lowercased
+        std::string body;
+        bool keep_alive = true; // from the HTTP version and Connection header
+    };
+
+    struct HttpResponse
+    {
+        int status = 200;
+        std::string content_type = "application/json";
+        std::string body;
+        std::vector<std::pair<std::string, std::string>> headers;
+    };
+
+    struct HttpServerOptions
+    {
+        std::string host = "127.0.0.1";
+        int port = 8080;          // 0 picks a free port, see HttpServer::port()
+        int threads = 16;         // connections served at once
+        size_t max_body_bytes = 16 * 1024 * 1024;
+        int io_timeout_seconds = 10; // idle keep-alive connections are closed after this
+        // An already listening socket (from open_listener) to accept on instead of opening host:port, e.g. one
+        // inherited from a prefork master; the server takes ownership of it
+        int listen_fd = -1;
+    };
+
+    // Minimal HTTP/1.1 server for the local caption service: Content-Length bodies (no chunked uploads),
+    // keep-alive, and "Expect: 100-continue". Each connection is served by one worker thread, which calls the
+    // handler for every request on it; the handler may block.
+    class HttpServer
+    {
+    public:
+        using Handler = std::function<HttpResponse(const HttpRequest &)>;
+
+        static tl::expected<std::unique_ptr<HttpServer>, std::string> start(const HttpServerOptions &options, Handler handler) noexcept;
+
+        ~HttpServer();
+
+        HttpServer(const HttpServer &) = delete;
+        HttpServer &operator=(const HttpServer &) = delete;
+
+        // Stops accepting, closes idle connections and waits for requests in flight to finish
+        void stop() noexcept;
+
+        [[nodiscard]] int port() const noexcept { return port_; }
+
+        [[nodiscard]] static std::string_view status_reason(int status) noexcept;
+
+        // A non-blocking listening TCP socket on host:port, so several processes can poll and accept on it
+        static tl::expected<int, std::string> open_listener(const std::string &host, int port) noexcept;
+
+    private:
+        enum class ReadStatus
+        {
+            ok,
+            closed,
+            bad_request,
+            too_large,
+            length_required
+        };
+
+        HttpServerOptions options_;
+        Handler handler_;
+        int listen_fd_ = -1;
+        int port_ = 0;
+        std::atomic<bool> stopping_ = false;
+        BoundedQueue<int> connections_;
+        std::mutex active_mutex_;
+        std::set<int> active_fds_;
+        std::thread accept_thread_;
+        std::vector<std::thread> workers_;
+
+        HttpServer(const HttpServerOptions &options, Handler handler) noexcept;
+
+        void accept_loop() noexcept;
+
+        void worker_loop() noexcept;
+
+        void serve_connection(int fd) noexcept;
+
+        ReadStatus read_request(int fd, std::string &buffer, HttpRequest &request) const;
+
+        static bool write_response(int fd, const HttpResponse &response, bool keep_alive) noexcept;
+
+        static bool write_all(int fd, std::string_view data) noexcept;
+    };
+}
+
+#endif
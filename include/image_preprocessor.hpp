@@ -19,12 +19,31 @@ namespace captioning
 
         [[nodiscard]] tl::expected<Ort::Value, std::string> preprocess(const std::string &image_path) const noexcept;
 
+        [[nodiscard]] tl::expected<cv::Mat, std::string> load(const std::string &image_path) const noexcept;
+
+        // Decodes an encoded image (JPEG, PNG, ...) held in memory
+        [[nodiscard]] tl::expected<cv::Mat, std::string> decode(std::span<const unsigned char> encoded) const noexcept;
+
+        // Converts raw 8-bit RGB pixels (stride bytes per row) to a BGR image at the model input size, with no decode.
+        // Only reads pixels, which may be foreign memory such as a shared-memory frame; the result is a copy.
+        [[nodiscard]] tl::expected<cv::Mat, std::string> load_rgb(std::span<const unsigned char> pixels, int width, int height, size_t stride) const noexcept;
+
+        // Resizes a loaded image to the model input size. Images already at that size skip the resize in
+        // preprocess_batch, so decode workers can take this work off the inference thread. An image already at the
+        // input size is returned as is.
+        [[nodiscard]] cv::Mat resize_to_input(const cv::Mat &image) const noexcept;
+
+        // Packs loaded images into one [N, C, H, W] tensor, N = images.size()
+        [[nodiscard]] tl::expected<Ort::Value, std::string> preprocess_batch(std::span<const cv::Mat> images) const noexcept;
+
     private:
+        friend struct PreprocessingBenchmark;
+
         std::vector<int64_t> input_shape_;
 
         [[nodiscard]] cv::Mat normalize_image(const cv::Mat &image) const noexcept;
 
-        [[nodiscard]] std::vector<float> hwc_to_chw(const cv::Mat &image) const noexcept;
+        void hwc_to_chw(const cv::Mat &image, float *chw) const noexcept;
     };
 }
 
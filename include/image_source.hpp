@@ -0,0 +1,27 @@
+#ifndef IMAGE_SOURCE_HPP
+#define IMAGE_SOURCE_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <filesystem>
+
+#include "expected.hpp"
+
+namespace captioning
+{
+    class ImageSource
+    {
+    public:
+        // Expands a directory (non-recursive, by image extension), a glob pattern such as "images/*.jpg", or a manifest
+        // file (one path per line) into image paths. A path that exists is never taken as a pattern, even if it has glob
+        // characters.
+        static tl::expected<std::vector<std::string>, std::string> collect(const std::filesystem::path &source) noexcept;
+
+        [[nodiscard]] static bool is_image_file(const std::filesystem::path &path) noexcept;
+
+        [[nodiscard]] static bool is_glob(std::string_view source) noexcept;
+    };
+}
+
+#endif
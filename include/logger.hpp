@@ -1,21 +1,124 @@
 #ifndef LOGGER_HPP
 #define LOGGER_HPP
 
+// SPDLOG_ACTIVE_LEVEL (set by the build) decides which SPDLOG_LOGGER_DEBUG/TRACE statements are compiled in at all;
+// release builds strip them, arguments included
 #include <spdlog/spdlog.h>
-#include <memory>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
 
 namespace captioning
 {
     class Logger
     {
     public:
-        static void init(const std::string &log_file = "captioning.log") noexcept;
+        enum class Mode
+        {
+            synchronous,
+            asynchronous
+        };
 
-        [[nodiscard]] static std::shared_ptr<spdlog::logger> get_logger() noexcept;
+        // Messages waiting for the background writer; when the queue is full the oldest one is dropped
+        static constexpr size_t async_queue_size = 8192;
+
+        // Per-site limits for messages logged once per request (see CAPTIONING_LOG_RATE_LIMITED/SAMPLED)
+        static constexpr unsigned request_errors_per_second = 10;
+        static constexpr uint64_t request_log_sample = 100;
+
+        // In asynchronous mode a logging thread only formats the message and queues it; one background thread
+        // writes to the console and the rotating file, so a slow terminal or disk never stalls a request
+        static void init(const std::string &log_file = "captioning.log", Mode mode = Mode::asynchronous) noexcept;
+
+        // Rebuilds the logger on the same sinks. Only call while no other thread logs. A process must not fork
+        // while it has the background writer (the child would get its queue but not its thread), so a prefork
+        // master logs synchronously and its workers switch to asynchronous after the fork.
+        static void set_mode(Mode mode) noexcept;
+
+        // Moves file logging to a file of this process's own, named with its pid before the extension
+        // (captioning.log becomes captioning.1234.log), keeping the mode. For forked children that keep logging
+        // alongside their parent: rotating one file from several processes garbles it. Only call while no other
+        // thread logs.
+        static void use_process_file() noexcept;
+
+        // Writes out everything still queued; call before _exit, which skips the destructors that would
+        static void shutdown() noexcept;
+
+        // Valid for the life of the process, also across set_mode
+        [[nodiscard]] static spdlog::logger *get_logger() noexcept;
 
     private:
         static std::shared_ptr<spdlog::logger> logger_;
     };
+
+    // Lets one call in every `one_in` through, starting with the first
+    class LogSampler
+    {
+    public:
+        [[nodiscard]] bool sample(uint64_t one_in) noexcept
+        {
+            return calls_.fetch_add(1, std::memory_order_relaxed) % one_in == 0;
+        }
+
+    private:
+        std::atomic<uint64_t> calls_{0};
+    };
+
+    // Lets up to per_second calls through in each second and counts the rest, so the next message can report
+    // how many were dropped. Lock-free and approximate: a few extra may pass as a second rolls over.
+    class LogRateLimiter
+    {
+    public:
+        [[nodiscard]] bool allow(unsigned per_second, uint64_t &suppressed) noexcept
+        {
+            const int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+            int64_t window = window_.load(std::memory_order_relaxed);
+            if (window != now && window_.compare_exchange_strong(window, now, std::memory_order_relaxed))
+            {
+                passed_.store(0, std::memory_order_relaxed);
+            }
+            if (passed_.fetch_add(1, std::memory_order_relaxed) < per_second)
+            {
+                suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+                return true;
+            }
+            suppressed_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+    private:
+        std::atomic<int64_t> window_{-1};
+        std::atomic<unsigned> passed_{0};
+        std::atomic<uint64_t> suppressed_{0};
+    };
 }
 
+// For messages on the request path: each call site gets its own limiter or sampler, and a disabled level costs
+// one comparison
+#define CAPTIONING_LOG_RATE_LIMITED(logger, level, per_second, ...)                                      \
+    do                                                                                                    \
+    {                                                                                                     \
+        static ::captioning::LogRateLimiter captioning_log_limiter_;                                      \
+        uint64_t captioning_log_suppressed_ = 0;                                                          \
+        if ((logger)->should_log(level) && captioning_log_limiter_.allow(per_second, captioning_log_suppressed_)) \
+        {                                                                                                 \
+            if (captioning_log_suppressed_ > 0)                                                           \
+            {                                                                                             \
+                (logger)->log(level, "{} similar message(s) suppressed", captioning_log_suppressed_);    \
+            }                                                                                             \
+            (logger)->log(level, __VA_ARGS__);                                                            \
+        }                                                                                                 \
+    } while (false)
+
+#define CAPTIONING_LOG_SAMPLED(logger, level, one_in, ...)                                 \
+    do                                                                                      \
+    {                                                                                       \
+        static ::captioning::LogSampler captioning_log_sampler_;                            \
+        if ((logger)->should_log(level) && captioning_log_sampler_.sample(one_in))          \
+        {                                                                                   \
+            (logger)->log(level, __VA_ARGS__);                                              \
+        }                                                                                   \
+    } while (false)
+
 #endif
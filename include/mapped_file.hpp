@@ -0,0 +1,44 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <string>
+#include <filesystem>
+#include <span>
+#include <cstddef>
+
+#include "expected.hpp"
+
+namespace captioning
+{
+    // Read-only, shared memory mapping of a whole file. Pages come from the page cache, so every
+    // process mapping the same file shares one physical copy.
+    class MappedFile
+    {
+    public:
+        static tl::expected<MappedFile, std::string> open(const std::filesystem::path &path) noexcept;
+
+        // Maps whatever fd refers to (e.g. a memfd received from another process) in full; fd stays owned by the caller
+        static tl::expected<MappedFile, std::string> from_fd(int fd) noexcept;
+
+        MappedFile(MappedFile &&other) noexcept;
+        MappedFile &operator=(MappedFile &&other) noexcept;
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+        ~MappedFile();
+
+        [[nodiscard]] const char *data() const noexcept { return static_cast<const char *>(data_); }
+        [[nodiscard]] size_t size() const noexcept { return size_; }
+        [[nodiscard]] std::span<const std::byte> bytes() const noexcept { return {static_cast<const std::byte *>(data_), size_}; }
+
+        // Asks the kernel to start reading the whole file in, so the first session run doesn't fault it in page by page.
+        void prefetch() const noexcept;
+
+    private:
+        void *data_ = nullptr;
+        size_t size_ = 0;
+
+        MappedFile(void *data, size_t size) noexcept;
+    };
+}
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "tracing.hpp"
+
+namespace captioning
+{
+    // Timed stages of captioning, in pipeline order
+    enum class Stage
+    {
+        image_decode,      // imread, imdecode or raw frame conversion
+        resize,
+        normalize,         // BGR to RGB and scaling to [0, 1]
+        hwc_to_chw,
+        session_step,      // one Session::Run of the decoding loop, for the whole batch
+        candidate_scoring, // output projection, log-softmax and the banned-token mask, per image and step
+        top_k,
+        beam_update,       // extending beams with the top candidates and pruning back to the beam width
+        detokenize,
+        count
+    };
+
+    enum class Counter
+    {
+        images,           // images packed into model input
+        captions,         // images decoded to a caption
+        decode_failures,  // images that decoded to nothing or whose session run failed
+        truncated,        // captions cut short by a deadline or cancellation
+        decode_steps,     // session runs
+        generated_tokens, // tokens of the returned captions, start token excluded
+        beams_pruned,     // beam candidates dropped to keep the beam width
+        count
+    };
+
+    // Per-caption values that are not durations
+    enum class Distribution
+    {
+        steps_per_caption,
+        tokens_per_caption,
+        count
+    };
+
+    // Log-linear buckets in the manner of HdrHistogram: exact below 8, then 8 buckets per power of two, so a value
+    // is known to within 12.5% over the whole uint64_t range
+    struct HistogramBuckets
+    {
+        static constexpr int sub_bucket_bits = 3;
+        static constexpr size_t sub_buckets = size_t{1} << sub_bucket_bits;
+        static constexpr size_t bucket_count = (64 - sub_bucket_bits + 1) * sub_buckets;
+
+        [[nodiscard]] static size_t index(uint64_t value) noexcept;
+
+        // The smallest and largest value counted in bucket
+        [[nodiscard]] static uint64_t lower_bound(size_t bucket) noexcept;
+        [[nodiscard]] static uint64_t upper_bound(size_t bucket) noexcept;
+    };
+
+    // Merged view of one histogram across threads
+    struct HistogramSnapshot
+    {
+        std::array<uint64_t, HistogramBuckets::bucket_count> buckets{};
+        uint64_t count = 0;
+        uint64_t sum = 0;
+
+        [[nodiscard]] double mean() const noexcept { return count > 0 ? static_cast<double>(sum) / static_cast<double>(count) : 0.0; }
+
+        // Midpoint of the bucket holding the q-th quantile (0 <= q <= 1); 0 when empty
+        [[nodiscard]] double quantile(double q) const noexcept;
+    };
+
+    struct MetricsSnapshot
+    {
+        std::array<uint64_t, static_cast<size_t>(Counter::count)> counters{};
+        // Durations in nanoseconds
+        std::array<HistogramSnapshot, static_cast<size_t>(Stage::count)> stages{};
+        std::array<HistogramSnapshot, static_cast<size_t>(Distribution::count)> distributions{};
+        // Index of the daemon worker that took the snapshot, -1 outside the daemon
+        int worker = -1;
+
+        [[nodiscard]] uint64_t counter(Counter counter) const noexcept { return counters[static_cast<size_t>(counter)]; }
+        [[nodiscard]] const HistogramSnapshot &stage(Stage stage) const noexcept { return stages[static_cast<size_t>(stage)]; }
+        [[nodiscard]] const HistogramSnapshot &distribution(Distribution distribution) const noexcept { return distributions[static_cast<size_t>(distribution)]; }
+
+        // What was recorded after earlier was taken
+        [[nodiscard]] MetricsSnapshot since(const MetricsSnapshot &earlier) const noexcept;
+
+        // Prometheus text exposition format (version 0.0.4): counters, and stage durations and distributions as summaries.
+        // Every series of a daemon worker's snapshot carries a worker label.
+        [[nodiscard]] std::string to_prometheus() const;
+
+        // A table of stage timings plus token throughput over wall_seconds, for the end of a batch run
+        [[nodiscard]] std::string to_table(double wall_seconds) const;
+    };
+
+    // Process-wide registry. Every thread records into its own block of counters and histograms with plain relaxed
+    // stores (each block has a single writer), so recording takes no lock and shares no cache line with other
+    // threads; snapshot() adds the blocks up. A block freed by an exiting thread is reused by the next new one.
+    class Metrics
+    {
+    public:
+        static void add(Counter counter, uint64_t amount = 1) noexcept;
+
+        static void record(Stage stage, std::chrono::nanoseconds elapsed) noexcept;
+
+        static void record(Distribution distribution, uint64_t value) noexcept;
+
+        [[nodiscard]] static MetricsSnapshot snapshot() noexcept;
+
+        // Marks this process as daemon worker `worker`: each worker keeps its own metrics, and its snapshots say whose
+        // they are
+        static void set_worker(int worker) noexcept;
+
+        [[nodiscard]] static std::string_view name(Stage stage) noexcept;
+        [[nodiscard]] static std::string_view name(Counter counter) noexcept;
+        [[nodiscard]] static std::string_view name(Distribution distribution) noexcept;
+    };
+
+    // Records the time from construction to stop() or destruction against a stage, and as a span when tracing
+    class StageTimer
+    {
+    public:
+        explicit StageTimer(Stage stage) noexcept : stage_(stage), start_(std::chrono::steady_clock::now()) {}
+
+        ~StageTimer() { stop(); }
+
+        StageTimer(const StageTimer &) = delete;
+        StageTimer &operator=(const StageTimer &) = delete;
+
+        void stop() noexcept
+        {
+            if (!stopped_)
+            {
+                const auto end = std::chrono::steady_clock::now();
+                Metrics::record(stage_, end - start_);
+                if (Tracing::enabled())
+                {
+                    Tracing::record("stage", Metrics::name(stage_), start_, end);
+                }
+                stopped_ = true;
+            }
+        }
+
+    private:
+        Stage stage_;
+        std::chrono::steady_clock::time_point start_;
+        bool stopped_ = false;
+    };
+}
+
+#endif
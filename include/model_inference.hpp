@@ -7,30 +7,90 @@
 #include <memory>
 #include <ranges>
 #include <span>
+#include <optional>
+#include <functional>
 
 #include "expected.hpp"
+#include "config.hpp"
+#include "mapped_file.hpp"
 #include "vocabulary.hpp"
+#include "decoding_constraints.hpp"
+#include "output_projection.hpp"
+#include "cancellation_token.hpp"
+#include "tracing.hpp"
 
 namespace captioning
 {
+    struct DecodeResult
+    {
+        std::vector<int> tokens;
+        // Decoding was stopped by a cancellation token before every beam finished; tokens is the best partial hypothesis,
+        // or empty if the stop came before the first step
+        bool truncated = false;
+        // Runners-up when DecodeOptions::n_best > 1, best first
+        std::vector<std::vector<int>> alternatives;
+    };
+
+    // Immutable once created: run() and run_batch() are const and may be called concurrently from any number
+    // of threads (ONNX Runtime sessions are safe to Run concurrently); per-call state lives in per-thread scratch.
     class ModelInference
     {
     public:
-        static tl::expected<ModelInference, std::string> create(const std::string &model_path, std::vector<int64_t> input_shape) noexcept;
+        // Called during decoding with tokens of an image's output that can no longer change: the prefix shared by every
+        // live and finished beam. Across calls the tokens of one image are contiguous, starting with the start token,
+        // and always a prefix of the final result.
+        using CommitCallback = std::function<void(size_t image, std::span<const int> tokens)>;
+
+        // In mmap mode, mappings may come from map_model_files (e.g. made once before forking workers); when empty
+        // the model is mapped here. Ignored in file mode.
+        static tl::expected<ModelInference, std::string> create(const Config &config, std::vector<MappedFile> mappings = {}) noexcept;
+
+        // Maps the model and its external data files read-only and starts reading them in. Touches no
+        // ONNX Runtime state, so it is safe before fork().
+        static tl::expected<std::vector<MappedFile>, std::string> map_model_files(const Config &config) noexcept;
+
+        // options must be within the configured limits (Config::check_decode_options).
+        // cancel is checked between steps and terminates a step in flight; decoding then stops with the best hypothesis so far,
+        // or fails with the stop reason if no step had completed
+        [[nodiscard]] tl::expected<DecodeResult, std::string> run(Ort::Value &input_tensor, const DecodeOptions &options, const Vocabulary &vocab, const DecodingConstraints &constraints, const CancellationToken &cancel = {}, const CommitCallback &on_commit = {}) const noexcept;
 
-        [[nodiscard]] tl::expected<std::vector<int>, std::string> run(Ort::Value &input_tensor, int max_length, int beam_width, const Vocabulary &vocab) noexcept;
+        // Decodes every image of an [N, C, H, W] tensor with one session run per step for the whole batch.
+        // Results are in batch order; an image without a caption fails on its own.
+        [[nodiscard]] std::vector<tl::expected<DecodeResult, std::string>> run_batch(Ort::Value &batch_tensor, const DecodeOptions &options, const Vocabulary &vocab, const DecodingConstraints &constraints, const CancellationToken &cancel = {}, const CommitCallback &on_commit = {}) const noexcept;
+
+        // False when the model's batch dimension is fixed to 1
+        [[nodiscard]] bool supports_batching() const noexcept { return supports_batching_; }
+
+        // Checks that everything indexed by token id (the output projection) matches the vocabulary
+        [[nodiscard]] std::string check_vocabulary(const Vocabulary &vocab) const noexcept;
 
     private:
+        friend struct DecodingBenchmark;
+        friend struct DecodingTest;
+
+        // Backing memory of an mmap-loaded model; declared first so it outlives session_
+        std::vector<MappedFile> mappings_;
+        // Prepacked GEMM weights of session_ (share_prepacked_weights); owned here rather than process-wide so a
+        // reload frees the retired model's weights along with its session
+        std::unique_ptr<Ort::PrepackedWeightsContainer> prepacked_weights_;
         std::unique_ptr<Ort::Session> session_;
+        // Set when the session profiles for the trace; hands over its profile before session_ goes
+        ProfiledSession profiled_session_;
         std::string input_name_;
         std::string output_name_;
         std::vector<int64_t> input_shape_;
+        // Shortlist decoding: output_name_ is then the decoder hidden state and scores come from projection_
+        std::optional<OutputProjection> projection_;
+        std::vector<int> frequent_ids_;
+        int shortlist_size_ = 0;
+        bool supports_batching_ = false;
 
         struct BeamState
         {
             std::vector<int> sequence;
             float score;
             bool finished;
+            NGramHistory ngrams;
 
             bool operator<(const BeamState &other) const
             {
@@ -40,13 +100,60 @@ namespace captioning
             auto operator<=>(const BeamState &) const = default;
         };
 
-        ModelInference(std::unique_ptr<Ort::Session> session, std::string input_name, std::string output_name, std::vector<int64_t> input_shape) noexcept;
+        ModelInference(std::unique_ptr<Ort::PrepackedWeightsContainer> prepacked_weights, std::unique_ptr<Ort::Session> session, std::string input_name, std::string output_name, std::vector<int64_t> input_shape, std::vector<MappedFile> mappings) noexcept;
+
+        static void use_mapped_model(const Config &config, const std::vector<MappedFile> &mappings, Ort::SessionOptions &session_options);
+
+        [[nodiscard]] static std::string verify_signature(const Ort::Session &session, const Config &config) noexcept;
+
+        [[nodiscard]] static std::string attach_projection(const Ort::Session &session, const OutputProjectionSettings &settings, std::optional<OutputProjection> &projection) noexcept;
+
+        // Beams of one image in a batched search; shortlist is empty until shortlist decoding has seen the first step
+        struct ImageBeams
+        {
+            std::vector<BeamState> beam;
+            std::vector<BeamState> finished;
+            std::vector<int> shortlist;
+            // Tokens already passed to the commit callback
+            size_t committed = 0;
+            // Steps this image was still being decoded in
+            int steps = 0;
+        };
+
+        // Buffers reused across steps and calls on one thread, so the hot loop allocates little and shares nothing
+        struct DecodeScratch
+        {
+            std::vector<float> output;
+            std::vector<float> scores;
+            std::vector<std::pair<int, float>> scored;
+            std::vector<BeamState> candidates;
+        };
+
+        // Beam search and the step functions throw on ONNX Runtime errors; run_batch() turns those into error results.
+        // Returns one result per image, with empty tokens when the image produced no caption.
+        [[nodiscard]] std::vector<DecodeResult> beam_search(Ort::Value &batch_tensor, size_t batch_size, const DecodeOptions &options, const Vocabulary &vocab, const DecodingConstraints &constraints, const CancellationToken &cancel, const CommitCallback &on_commit, DecodeScratch &scratch) const;
+
+        // Sorts the keep best (token id, score) candidates to the front, best first
+        static void select_top_k(std::span<std::pair<int, float>> scored, size_t keep) noexcept;
+
+        // Extends every live beam of image with the best of top, skipping repeated n-grams, and prunes the
+        // candidates back to beam_width; beams that had finished move to image.finished. Returns the number pruned.
+        static size_t update_beams(ImageBeams &image, std::span<const std::pair<int, float>> top, int beam_width, int ngram_size, int end_id, std::vector<BeamState> &candidates);
+
+        // Best options.n_best of the image's finished and live beams, ranked with the length penalty
+        [[nodiscard]] static DecodeResult select_hypotheses(ImageBeams &image, const DecodeOptions &options, bool truncated);
+
+        static void commit_stable_prefix(size_t index, ImageBeams &image, const CommitCallback &on_commit);
+
+        // Fills scratch.scored with masked (token id, score) candidates for one image from its row of the step output
+        void score_candidates(std::span<const float> output_row, ImageBeams &image, const TokenMask &banned_tokens, int end_id, DecodeScratch &scratch) const;
 
-        [[nodiscard]] std::vector<int> beam_search(Ort::Value &input_tensor, int max_length, int beam_width, const Vocabulary &vocab) noexcept;
+        // Fills output with the step output for the whole batch, one row per image. Returns false if cancel stopped
+        // the step (before or during Session::Run), leaving output unspecified.
+        [[nodiscard]] bool run_session_step(Ort::Value &batch_tensor, size_t batch_size, const CancellationToken &cancel, std::vector<float> &output) const;
 
-        // [[nodiscard]] std::vector<float> run_single_step(Ort::Value &input_tensor, std::span<const int> current_sequence) noexcept; // C++ 20
-        // [[nodiscard]] std::vector<float> run_single_step(Ort::Value &input_tensor, const std::vector<int> &current_sequence) noexcept; // C++17 ( for span fallback )
-        [[nodiscard]] std::vector<float> run_single_step(Ort::Value &input_tensor, const std::vector<int> &current_sequence) noexcept;
+        // Top shortlist_size_ tokens of the first step, plus the frequent words and the end token, in id order
+        [[nodiscard]] std::vector<int> build_shortlist(std::span<const float> first_step_scores, int end_id) const;
     };
 }
 
@@ -0,0 +1,53 @@
+#ifndef OUTPUT_PROJECTION_HPP
+#define OUTPUT_PROJECTION_HPP
+
+#include <cstdint>
+#include <string>
+#include <span>
+#include <filesystem>
+
+#include "expected.hpp"
+#include "mapped_file.hpp"
+
+namespace captioning
+{
+    // Decoder output projection (hidden state -> vocabulary scores) evaluated in-process, so it can be
+    // restricted to a shortlist of candidate tokens. Weights come from a memory-mapped sidecar file:
+    //
+    //   char[4]  magic "CPRJ"
+    //   uint32   version (1)
+    //   uint32   vocab_size
+    //   uint32   hidden_size
+    //   float32  weights[vocab_size][hidden_size]
+    //   float32  bias[vocab_size]
+    //
+    // all little-endian.
+    class OutputProjection
+    {
+    public:
+        static tl::expected<OutputProjection, std::string> load(const std::filesystem::path &weights_path) noexcept;
+
+        [[nodiscard]] size_t vocab_size() const noexcept { return vocab_size_; }
+        [[nodiscard]] size_t hidden_size() const noexcept { return hidden_size_; }
+
+        // scores[i] = weights[token_ids[i]] . hidden + bias[token_ids[i]]
+        void project(std::span<const float> hidden, std::span<const int> token_ids, std::span<float> scores) const noexcept;
+
+        // Full projection over the whole vocabulary; scores must hold vocab_size() values
+        void project_all(std::span<const float> hidden, std::span<float> scores) const noexcept;
+
+        // Name of the dot-product kernel picked for this CPU ("avx512", "avx2" or "scalar")
+        [[nodiscard]] static const char *kernel_name() noexcept;
+
+    private:
+        MappedFile file_;
+        const float *weights_ = nullptr;
+        const float *bias_ = nullptr;
+        size_t vocab_size_ = 0;
+        size_t hidden_size_ = 0;
+
+        OutputProjection(MappedFile file, size_t vocab_size, size_t hidden_size) noexcept;
+    };
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef PREFORK_DAEMON_HPP
+#define PREFORK_DAEMON_HPP
+
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+#include "config.hpp"
+#include "caption_generator.hpp"
+#include "http_server.hpp"
+
+namespace captioning
+{
+    struct DaemonOptions
+    {
+        std::filesystem::path config_path; // re-read on SIGHUP
+        int workers = 1;
+        bool pin_workers = true;   // worker i runs on the i-th CPU the daemon may use (modulo their count)
+        bool sidecar = false;      // workers run the sidecar protocol instead of the HTTP server
+        HttpServerOptions http;    // listen_fd is filled in by the master
+        std::string socket_path;
+        size_t max_image_bytes = 16 * 1024 * 1024;
+    };
+
+    // Master/worker process model for the long-running modes. The master loads the config, vocabulary and (in mmap
+    // mode) the model files, opens the listening socket, then forks the workers. Workers inherit the loaded state
+    // copy-on-write, create their own ONNX Runtime session (ORT state does not survive fork, so the master never
+    // touches it and never starts a thread) and all accept on the shared socket. A crashed worker is replaced,
+    // so one bad request costs one process rather than the service.
+    // On SIGHUP the master re-reads the config file and loads the new assets, and a short-lived probe process checks
+    // that they build and warm up a generator. Only then does the master adopt them and replace the workers one at
+    // a time: each old worker finishes its requests in flight and exits, and a worker forked from the new assets
+    // takes its place. Every worker thus serves exactly what the probe checked.
+    class PreforkDaemon
+    {
+    public:
+        // Runs the master until SIGINT or SIGTERM (which it passes on to the workers) and returns the exit code.
+        // Workers never return from here; they exit once their server has stopped.
+        static int run(const Config &config, const DaemonOptions &options) noexcept;
+
+    private:
+        // A worker exiting with this code failed to start; restarting it would only fail again
+        static constexpr int startup_failure_exit_code = 3;
+        static constexpr auto min_restart_interval = std::chrono::seconds(1);
+
+        struct WorkerSlot
+        {
+            pid_t pid = -1;
+            std::chrono::steady_clock::time_point started;
+            std::chrono::steady_clock::time_point restart_at;
+            bool stale = false;    // running assets older than the master's
+            bool retiring = false; // sent SIGTERM to be replaced
+        };
+
+        // Returns the child's pid (or -1) in the master; the child runs the worker and exits
+        static pid_t spawn_worker(GeneratorAssets &assets, const DaemonOptions &options, int listen_fd, int index) noexcept;
+
+        static int run_worker(GeneratorAssets assets, const DaemonOptions &options, int listen_fd, int index, pid_t master) noexcept;
+
+        // The new assets if a probe process built and warmed up a generator from them; the master keeps serving the
+        // old ones otherwise
+        static tl::expected<GeneratorAssets, std::string> probe_reload(const DaemonOptions &options) noexcept;
+
+#ifdef __linux__
+        static void pin_to_cpu(int index) noexcept;
+#endif
+    };
+}
+
+#endif
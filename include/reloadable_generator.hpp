@@ -0,0 +1,49 @@
+#ifndef RELOADABLE_GENERATOR_HPP
+#define RELOADABLE_GENERATOR_HPP
+
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "expected.hpp"
+#include "caption_generator.hpp"
+
+namespace captioning
+{
+    // The generator behind a long-running server, replaceable without stopping it. Each request takes current()
+    // and keeps that generator for its whole run; reload() builds and warms up a new generator from the config
+    // file in the background of the serving threads and swaps it in for later requests. The previous generator is
+    // destroyed when its last request lets go of it (its async executor first finishes the requests it queued).
+    class ReloadableGenerator
+    {
+    public:
+        // Loads config_path and creates, warms up and serves its generator
+        static tl::expected<std::unique_ptr<ReloadableGenerator>, std::string> create(const std::filesystem::path &config_path) noexcept;
+
+        // Serves generator (e.g. one built from a prefork master's assets) until the first reload of config_path
+        static tl::expected<std::unique_ptr<ReloadableGenerator>, std::string> create(const std::filesystem::path &config_path, CaptionGenerator generator) noexcept;
+
+        [[nodiscard]] std::shared_ptr<const CaptionGenerator> current() const noexcept;
+
+        // Re-reads the config file and swaps in a generator built from it. Empty on success; otherwise the config,
+        // model signature or warm-up was rejected and the current generator keeps serving. One reload runs at a time.
+        [[nodiscard]] std::string reload() noexcept;
+
+    private:
+        std::filesystem::path config_path_;
+        // Held only to copy or swap the pointer; std::atomic<std::shared_ptr> is missing from libc++
+        mutable std::mutex current_mutex_;
+        std::shared_ptr<const CaptionGenerator> current_;
+        std::mutex reload_mutex_;
+        unsigned generation_ = 0;
+
+        ReloadableGenerator(std::filesystem::path config_path, std::shared_ptr<const CaptionGenerator> generator) noexcept;
+
+        [[nodiscard]] static tl::expected<std::shared_ptr<const CaptionGenerator>, std::string> build(const std::filesystem::path &config_path, unsigned generation) noexcept;
+
+        [[nodiscard]] static std::shared_ptr<const CaptionGenerator> share(CaptionGenerator generator, unsigned generation);
+    };
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef REORDER_BUFFER_HPP
+#define REORDER_BUFFER_HPP
+
+#include <cstddef>
+#include <map>
+#include <utility>
+
+namespace captioning
+{
+    // Puts items that complete out of order back into index order: an item is held until every item before it
+    // has been released. Indices start at 0 and each is pushed once. Not thread-safe.
+    template <typename T>
+    class ReorderBuffer
+    {
+    public:
+        // Calls release(item) for the item and then for every held item that is now next, in index order.
+        // Returns how many items were released.
+        template <typename Release>
+        size_t push(size_t index, T item, Release &&release)
+        {
+            pending_.emplace(index, std::move(item));
+            size_t released = 0;
+            for (auto it = pending_.begin(); it != pending_.end() && it->first == next_; it = pending_.erase(it), ++next_)
+            {
+                release(it->second);
+                ++released;
+            }
+            return released;
+        }
+
+        // Items held back, waiting for one before them
+        [[nodiscard]] size_t held() const noexcept { return pending_.size(); }
+
+        // Index of the next item to release
+        [[nodiscard]] size_t next() const noexcept { return next_; }
+
+    private:
+        std::map<size_t, T> pending_;
+        size_t next_ = 0;
+    };
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef SESSION_RESOURCES_HPP
+#define SESSION_RESOURCES_HPP
+
+#include <onnxruntime_cxx_api.h>
+#include <memory>
+#include <mutex>
+
+namespace captioning
+{
+    // Process-wide ONNX Runtime state shared by every ModelInference: the environment and an arena CPU
+    // allocator registered with the environment, so sessions keep one arena instead of one per session.
+    //
+    // All accessors may throw Ort::Exception on first use.
+    class SessionResources
+    {
+    public:
+        [[nodiscard]] static Ort::Env &env();
+
+        // Registers the shared allocator once; sessions opt in with the "session.use_env_allocators" entry.
+        static void register_shared_allocator();
+
+    private:
+        static std::once_flag env_once_;
+        static std::once_flag allocator_once_;
+        static std::unique_ptr<Ort::Env> env_;
+    };
+}
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef SIDECAR_SERVER_HPP
+#define SIDECAR_SERVER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "expected.hpp"
+#include "reloadable_generator.hpp"
+#include "mapped_file.hpp"
+
+namespace captioning
+{
+    // Captioning for processes on the same host over a Unix domain socket. Every message is a frame: a uint32
+    // length of the rest of the frame, then the frame itself, all integers little-endian.
+    //
+    // Request:  uint64 request id, uint8 payload type, uint8 reserved, uint16 beam width, uint16 max length,
+    //           uint16 n-best, float32 length penalty, uint32 timeout in ms, then the payload (see PayloadType).
+    //           Zero decode fields (negative length penalty) select the configured defaults; timeout 0 means none.
+    // Response: uint64 request id, uint8 status (0: ok, 1: error), uint8 flags (bit 0: truncated), uint16 count,
+    //           then count strings, each a uint32 length and UTF-8 bytes: the caption and its alternatives, or the error.
+    //
+    // A frame length the server cannot accept is answered with an error carrying protocol_error_id, after which the
+    // server reads no more from the connection and closes it once the requests in flight have been answered. Clients
+    // must not use that id for their own requests.
+    //
+    // Requests on one connection run concurrently and their responses come back as they finish, matched by id.
+    class SidecarServer
+    {
+    public:
+        static constexpr size_t request_header_size = 24;
+        static constexpr size_t response_header_size = 12;
+        static constexpr uint64_t protocol_error_id = UINT64_MAX;
+
+        // Images can also be handed over in shared memory: the client attaches a sealed memfd once, writes images
+        // into it (typically as a ring of slots) and sends only where each one is. A slot may be reused as soon as
+        // the response for the request reading it has arrived.
+        enum class PayloadType : uint8_t
+        {
+            image = 0,         // the encoded image bytes
+            attach_region = 1, // uint32 region id; the memfd travels as SCM_RIGHTS with the frame
+            region_image = 2,  // uint32 region id, uint64 offset, uint64 size of an encoded image in the region
+            region_rgb = 3,    // uint32 region id, uint64 offset, uint32 width, height, stride (0: width * 3) of raw RGB pixels
+            detach_region = 4, // uint32 region id
+            metrics = 5        // no payload; answered with the Prometheus metrics text as the one string
+        };
+
+        struct RequestHeader
+        {
+            uint64_t request_id = 0;
+            uint8_t payload_type = 0;
+            uint16_t beam_width = 0;
+            uint16_t max_length = 0;
+            uint16_t n_best = 0;
+            float length_penalty = -1.0f;
+            uint32_t timeout_ms = 0;
+        };
+
+        // With listen_fd (from open_listener, e.g. inherited from a prefork master) the server accepts on and owns
+        // that socket, but leaves removing the socket file to whoever opened it
+        static tl::expected<std::unique_ptr<SidecarServer>, std::string> start(const ReloadableGenerator &generators, const std::string &socket_path, size_t max_image_bytes, int listen_fd = -1) noexcept;
+
+        // A non-blocking listening socket at socket_path, replacing a stale socket left there
+        static tl::expected<int, std::string> open_listener(const std::string &socket_path) noexcept;
+
+        ~SidecarServer();
+
+        SidecarServer(const SidecarServer &) = delete;
+        SidecarServer &operator=(const SidecarServer &) = delete;
+
+        // Stops accepting and reading; responses to requests already running are still sent
+        void stop() noexcept;
+
+        [[nodiscard]] static RequestHeader parse_request_header(const unsigned char *header) noexcept;
+
+        [[nodiscard]] static std::string encode_response(uint64_t request_id, const tl::expected<CaptionResult, std::string> &result);
+
+    private:
+        // Shared by the connection's reader thread and the callbacks of its requests in flight; the socket is
+        // closed when the last of them lets go
+        struct Connection
+        {
+            int fd;
+            std::mutex write_mutex;
+            bool broken = false;
+            std::atomic<bool> reader_done = false;
+            // Attached shared-memory regions, only touched by the reader thread; requests hold their region until done
+            std::map<uint32_t, std::shared_ptr<const MappedFile>> regions;
+
+            explicit Connection(int fd) noexcept : fd(fd) {}
+            ~Connection();
+        };
+
+        struct Reader
+        {
+            std::thread thread;
+            std::shared_ptr<Connection> connection;
+        };
+
+        const ReloadableGenerator &generators_;
+        std::string socket_path_;
+        size_t max_image_bytes_;
+        int listen_fd_ = -1;
+        bool owns_socket_path_ = false;
+        std::atomic<bool> stopping_ = false;
+        std::mutex readers_mutex_;
+        std::vector<Reader> readers_;
+        std::thread accept_thread_;
+
+        SidecarServer(const ReloadableGenerator &generators, const std::string &socket_path, size_t max_image_bytes) noexcept;
+
+        void accept_loop() noexcept;
+
+        void read_loop(std::shared_ptr<Connection> connection) noexcept;
+
+        // passed_fd is the descriptor sent with the frame, if any; it stays owned by the caller
+        void submit(const std::shared_ptr<Connection> &connection, const RequestHeader &header, std::vector<unsigned char> payload, int passed_fd) noexcept;
+
+#ifdef __linux__
+        // Empty on success
+        [[nodiscard]] static std::string attach_region(Connection &connection, std::span<const unsigned char> payload, int passed_fd) noexcept;
+#endif
+
+        static void respond(Connection &connection, uint64_t request_id, const tl::expected<CaptionResult, std::string> &result) noexcept;
+
+        void reap_readers(bool all) noexcept;
+    };
+}
+
+#endif
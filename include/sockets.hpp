@@ -0,0 +1,32 @@
+#ifndef SOCKETS_HPP
+#define SOCKETS_HPP
+
+#include <cstddef>
+#include <sys/types.h>
+
+namespace captioning
+{
+    // Portable stand-ins for Linux's SOCK_CLOEXEC/SOCK_NONBLOCK socket types, accept4 and MSG_NOSIGNAL. Flags are
+    // set with fcntl right after the descriptor is created; nothing forks while other threads open sockets, so no
+    // child can inherit a descriptor in between. All return -1 and set errno on failure.
+    class Sockets
+    {
+    public:
+        // A close-on-exec socket, non-blocking if asked, that never raises SIGPIPE
+        [[nodiscard]] static int open(int domain, int type, int protocol, bool nonblocking) noexcept;
+
+        // A close-on-exec, blocking connection that never raises SIGPIPE. BSD accepted sockets inherit the
+        // listener's O_NONBLOCK and Linux ones don't, so it is cleared either way.
+        [[nodiscard]] static int accept(int listen_fd) noexcept;
+
+        // send() that reports a closed peer as EPIPE instead of raising SIGPIPE
+        [[nodiscard]] static ssize_t send(int fd, const void *data, size_t size) noexcept;
+
+        [[nodiscard]] static bool set_close_on_exec(int fd) noexcept;
+
+    private:
+        [[nodiscard]] static bool configure(int fd, bool nonblocking) noexcept;
+    };
+}
+
+#endif
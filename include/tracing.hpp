@@ -0,0 +1,119 @@
+#ifndef TRACING_HPP
+#define TRACING_HPP
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace Ort
+{
+    struct Session;
+}
+
+namespace captioning
+{
+    // Optional timeline of the pipeline in the Chrome Trace Event format (chrome://tracing, ui.perfetto.dev).
+    // Each thread appends its spans to its own buffer without locking; write() drains every buffer and adds the
+    // ONNX Runtime profiles of the traced sessions, shifted onto the same clock, so operator timings line up with
+    // the pipeline stages around them. A buffer released by an exiting thread is reused by the next new one, so
+    // threads started by every reload don't each keep a buffer for good.
+    class Tracing
+    {
+    public:
+        // Spans a thread records beyond this before the next write() are dropped (and counted in the trace)
+        static constexpr size_t max_events_per_thread = 256 * 1024;
+
+        // Starts recording into output_path, where {pid} stands for the process id. Later calls are ignored,
+        // so the first generator created decides. With onnxruntime_profiling, sessions created from now on profile.
+        static void enable(const std::string &output_path, bool onnxruntime_profiling) noexcept;
+
+        [[nodiscard]] static bool enabled() noexcept { return enabled_.load(std::memory_order_acquire); }
+
+        // Where ONNX Runtime should write a session's profile, or empty when sessions don't profile
+        [[nodiscard]] static std::string onnxruntime_profile_prefix() noexcept;
+
+        // name and category must be string literals (or otherwise live as long as the process)
+        static void record(std::string_view category, std::string_view name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) noexcept;
+
+        // Sessions created with profiling enabled. ONNX Runtime writes a session's profile only when profiling
+        // ends and cannot restart it, so the first write() ends profiling for every watched session for good, and
+        // so does releasing it. Sessions created later (e.g. by a reload) profile until the write after them.
+        static void watch_session(Ort::Session &session) noexcept;
+        static void release_session(Ort::Session &session) noexcept;
+
+        // Writes what was recorded since the previous write and frees it, replacing the output file. Empty on success.
+        [[nodiscard]] static std::string write() noexcept;
+
+    private:
+        static std::atomic<bool> enabled_;
+    };
+
+    // A span from construction to destruction, recorded only if tracing was on when it began
+    class TraceSpan
+    {
+    public:
+        TraceSpan(std::string_view category, std::string_view name) noexcept
+            : category_(category), name_(name), active_(Tracing::enabled())
+        {
+            if (active_)
+            {
+                start_ = std::chrono::steady_clock::now();
+            }
+        }
+
+        ~TraceSpan()
+        {
+            if (active_)
+            {
+                Tracing::record(category_, name_, start_, std::chrono::steady_clock::now());
+            }
+        }
+
+        TraceSpan(const TraceSpan &) = delete;
+        TraceSpan &operator=(const TraceSpan &) = delete;
+
+    private:
+        std::string_view category_;
+        std::string_view name_;
+        bool active_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    // Keeps a profiling session watched while it lives; declare it after the session it refers to
+    class ProfiledSession
+    {
+    public:
+        ProfiledSession() noexcept = default;
+
+        explicit ProfiledSession(Ort::Session &session) noexcept : session_(&session) { Tracing::watch_session(session); }
+
+        ProfiledSession(ProfiledSession &&other) noexcept : session_(std::exchange(other.session_, nullptr)) {}
+
+        ProfiledSession &operator=(ProfiledSession &&other) noexcept
+        {
+            if (this != &other)
+            {
+                release();
+                session_ = std::exchange(other.session_, nullptr);
+            }
+            return *this;
+        }
+
+        ~ProfiledSession() { release(); }
+
+    private:
+        Ort::Session *session_ = nullptr;
+
+        void release() noexcept
+        {
+            if (session_)
+            {
+                Tracing::release_session(*std::exchange(session_, nullptr));
+            }
+        }
+    };
+}
+
+#endif
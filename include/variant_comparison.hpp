@@ -0,0 +1,57 @@
+#ifndef VARIANT_COMPARISON_HPP
+#define VARIANT_COMPARISON_HPP
+
+#include <string>
+#include <vector>
+#include <span>
+
+#include "expected.hpp"
+#include "config.hpp"
+
+namespace captioning
+{
+    struct VariantStats
+    {
+        std::string variant;
+        std::string precision;
+        size_t images = 0;
+        size_t failures = 0;
+        double wall_seconds = 0.0;
+        double images_per_second = 0.0;
+        double mean_ms = 0.0;
+        double p50_ms = 0.0;
+        double p90_ms = 0.0;
+        double p99_ms = 0.0;
+    };
+
+    struct ComparisonReport
+    {
+        VariantStats baseline;
+        VariantStats candidate;
+        size_t compared = 0;       // images captioned successfully by both variants
+        size_t exact_matches = 0;  // identical captions
+        double mean_word_f1 = 0.0; // bag-of-words F1 between the two captions, averaged over compared images
+
+        [[nodiscard]] std::string to_string() const noexcept;
+    };
+
+    // Runs two model variants of the same config over one image set and compares speed and caption agreement.
+    class VariantComparison
+    {
+    public:
+        static tl::expected<ComparisonReport, std::string> run(const Config &config, const std::string &baseline_variant, const std::string &candidate_variant, std::span<const std::string> image_paths) noexcept;
+
+    private:
+        struct VariantRun
+        {
+            VariantStats stats;
+            std::vector<tl::expected<std::string, std::string>> captions;
+        };
+
+        static tl::expected<VariantRun, std::string> run_variant(const Config &config, const std::string &variant, std::span<const std::string> image_paths) noexcept;
+
+        [[nodiscard]] static double word_f1(const std::string &a, const std::string &b) noexcept;
+    };
+}
+
+#endif
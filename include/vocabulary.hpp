@@ -1,39 +1,99 @@
 #ifndef VOCABULARY_HPP
 #define VOCABULARY_HPP
 
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <unordered_map>
+#include <span>
+#include <optional>
 #include <filesystem>
 
 #include "expected.hpp"
+#include "mapped_file.hpp"
 
 namespace captioning
 {
-
+    // Token table backed by one contiguous image: token bytes, an offsets array and a minimal perfect hash
+    // (CHD: per-bucket displacement seeds) from token to id. The binary vocabulary format is that image on
+    // disk and is memory-mapped without parsing; JSON vocabularies are converted into the same image on load.
+    //
+    //   char[4]  magic "CVOC"
+    //   uint32   version (1)
+    //   uint32   token_count
+    //   uint32   bucket_count
+    //   uint32   blob_size
+    //   uint32   reserved (0)
+    //   uint32   offsets[token_count + 1]   token i is blob[offsets[i], offsets[i + 1])
+    //   int32    seeds[bucket_count]        >= 0: displacement seed, < 0: -(slot + 1) of a single-key bucket
+    //   uint32   slots[token_count]         token id stored in each hash slot, 0xFFFFFFFF if unused
+    //   char     blob[blob_size]
+    //
+    // all little-endian. The arrays are used in place, so big-endian hosts are not supported.
     class Vocabulary
     {
     public:
+        // Loads a binary (by magic) or JSON vocabulary
         static tl::expected<Vocabulary, std::string> from_file(const std::filesystem::path &vocab_path) noexcept;
 
-        [[nodiscard]] std::string id_to_token(int id) const noexcept;
+        Vocabulary(Vocabulary &&) noexcept = default;
+        Vocabulary &operator=(Vocabulary &&) noexcept = default;
+        Vocabulary(const Vocabulary &) = delete;
+        Vocabulary &operator=(const Vocabulary &) = delete;
+
+        // Views stay valid for the lifetime of the Vocabulary
+        [[nodiscard]] std::string_view id_to_token(int id) const noexcept;
 
         [[nodiscard]] int token_to_id(std::string_view token) const noexcept;
 
-        [[nodiscard]] size_t size() const noexcept { return id_to_token_.size(); }
+        [[nodiscard]] bool contains(std::string_view token) const noexcept;
+
+        [[nodiscard]] size_t size() const noexcept { return offsets_.empty() ? 0 : offsets_.size() - 1; }
+
+        [[nodiscard]] std::string_view get_start_token() const noexcept { return "<start>"; }
+
+        [[nodiscard]] std::string_view get_end_token() const noexcept { return "<end>"; }
+
+        [[nodiscard]] std::string_view get_pad_token() const noexcept { return "<pad>"; }
+
+        [[nodiscard]] std::string_view get_unk_token() const noexcept { return "<unk>"; }
 
-        [[nodiscard]] std::string get_start_token() const noexcept { return "<start>"; }
+        // Special token ids, resolved once at load; pad and unk are -1 when the vocabulary lacks them
+        [[nodiscard]] int start_id() const noexcept { return start_id_; }
 
-        [[nodiscard]] std::string get_end_token() const noexcept { return "<end>"; }
+        [[nodiscard]] int end_id() const noexcept { return end_id_; }
+
+        [[nodiscard]] int pad_id() const noexcept { return pad_id_; }
+
+        [[nodiscard]] int unk_id() const noexcept { return unk_id_; }
+
+        // Writes the binary format, e.g. to convert a JSON vocabulary once ahead of deployment
+        [[nodiscard]] std::string write_binary(const std::filesystem::path &binary_path) const noexcept;
 
     private:
-        std::vector<std::string> id_to_token_;
-        std::unordered_map<std::string, int, std::hash<std::string_view>> token_to_id_;
+        std::optional<MappedFile> mapping_; // binary vocabulary file
+        std::vector<char> image_;           // JSON vocabulary converted in memory
+        std::string_view blob_;
+        std::span<const uint32_t> offsets_;
+        std::span<const int32_t> seeds_;
+        std::span<const uint32_t> slots_;
+        int start_id_ = -1;
+        int end_id_ = -1;
+        int pad_id_ = -1;
+        int unk_id_ = -1;
 
         Vocabulary() = default;
 
         [[nodiscard]] std::string load_from_file(const std::filesystem::path &vocab_path) noexcept;
+
+        [[nodiscard]] std::string attach(std::span<const char> image) noexcept;
+
+        [[nodiscard]] std::string resolve_special_tokens() noexcept;
+
+        [[nodiscard]] int lookup(std::string_view token) const noexcept;
+
+        [[nodiscard]] static tl::expected<std::vector<char>, std::string> build_image(const std::vector<std::string> &tokens) noexcept;
     };
 }
 
-#endif
\ No newline at end of file
+#endif
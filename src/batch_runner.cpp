@@ -0,0 +1,170 @@
+#include <atomic>
+#include <chrono>
+#include <format>
+#include <thread>
+#include <nlohmann/json.hpp>
+
+#include "batch_runner.hpp"
+#include "bounded_queue.hpp"
+#include "logger.hpp"
+#include "reorder_buffer.hpp"
+
+namespace captioning
+{
+    std::string BatchRunSummary::to_string() const noexcept
+    {
+        return std::format("captioned {} image(s), {} failure(s) in {:.1f} s ({:.2f} img/s, {:.1f} tokens/s)", images - failures, failures, wall_seconds, images_per_second, tokens_per_second);
+    }
+
+    tl::expected<BatchRunSummary, std::string> BatchRunner::run(const CaptionGenerator &generator, std::span<const std::string> image_paths, const BatchRunOptions &options, std::ostream &out) noexcept
+    {
+        auto logger = Logger::get_logger();
+        using Clock = std::chrono::steady_clock;
+
+        if (options.decode_workers <= 0 || options.batch_size <= 0)
+        {
+            return tl::unexpected("Batch run needs at least one decode worker and a positive batch size");
+        }
+
+        const auto start = Clock::now();
+        const MetricsSnapshot metrics_at_start = Metrics::snapshot();
+        const size_t queue_capacity = static_cast<size_t>(options.batch_size) * 4;
+        BoundedQueue<DecodedImage> decoded(queue_capacity);
+        BoundedQueue<CaptionRecord> records(queue_capacity);
+        std::atomic<size_t> next_image = 0;
+        std::atomic<int> decoders_running = options.decode_workers;
+
+        BatchRunSummary summary;
+        summary.images = image_paths.size();
+        try
+        {
+            std::vector<std::jthread> decoders;
+            std::jthread inference;
+            try
+            {
+                for (int i = 0; i < options.decode_workers; ++i)
+                {
+                    decoders.emplace_back([&]
+                                          {
+                                              for (size_t index = next_image++; index < image_paths.size(); index = next_image++)
+                                              {
+                                                  if (!decoded.push(DecodedImage{index, generator.load_image(image_paths[index])}))
+                                                  {
+                                                      break;
+                                                  }
+                                              }
+                                              if (--decoders_running == 0)
+                                              {
+                                                  decoded.close();
+                                              } });
+                }
+
+                inference = std::jthread([&]
+                                         {
+                                             std::vector<DecodedImage> batch;
+                                             std::vector<tl::expected<cv::Mat, std::string>> images;
+                                             while (auto first = decoded.pop())
+                                             {
+                                                 // Take whatever else is already decoded rather than waiting for a full batch
+                                                 batch.push_back(std::move(*first));
+                                                 while (batch.size() < static_cast<size_t>(options.batch_size))
+                                                 {
+                                                     auto more = decoded.try_pop();
+                                                     if (!more)
+                                                     {
+                                                         break;
+                                                     }
+                                                     batch.push_back(std::move(*more));
+                                                 }
+
+                                                 for (auto &item : batch)
+                                                 {
+                                                     images.push_back(std::move(item.image));
+                                                 }
+                                                 auto captions = generator.generate_batch(std::move(images));
+                                                 for (size_t i = 0; i < batch.size(); ++i)
+                                                 {
+                                                     records.push(CaptionRecord{batch[i].index, std::move(captions[i])});
+                                                 }
+                                                 batch.clear();
+                                                 images.clear();
+                                             }
+                                             records.close(); });
+            }
+            catch (const std::system_error &)
+            {
+                // Unblock whatever did start so the jthreads can join
+                decoded.close();
+                records.close();
+                throw;
+            }
+
+            // Completed records, held back until everything before them is written
+            ReorderBuffer<CaptionRecord> pending;
+            size_t written = 0;
+            auto last_progress = start;
+            while (auto record = records.pop())
+            {
+                if (!record->caption)
+                {
+                    ++summary.failures;
+                }
+                if (!options.ordered)
+                {
+                    write_record(*record, image_paths, out);
+                    ++written;
+                }
+                else
+                {
+                    const size_t index = record->index;
+                    written += pending.push(index, std::move(*record), [&](const CaptionRecord &next)
+                                            { write_record(next, image_paths, out); });
+                }
+
+                const auto now = Clock::now();
+                if (options.progress && options.progress_seconds > 0.0 && std::chrono::duration<double>(now - last_progress).count() >= options.progress_seconds)
+                {
+                    double elapsed = std::chrono::duration<double>(now - start).count();
+                    *options.progress << std::format("{}/{} images ({:.1f}%), {:.2f} img/s", written, image_paths.size(),
+                                                     100.0 * static_cast<double>(written) / static_cast<double>(image_paths.size()), static_cast<double>(written) / elapsed)
+                                      << std::endl;
+                    last_progress = now;
+                }
+            }
+        }
+        catch (const std::exception &ex)
+        {
+            logger->error("Batch run failed: {}", ex.what());
+            return tl::unexpected("Batch run failed: " + std::string(ex.what()));
+        }
+
+        out.flush();
+        if (!out)
+        {
+            logger->error("Failed to write batch results");
+            return tl::unexpected("Failed to write batch results");
+        }
+
+        summary.wall_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        summary.images_per_second = summary.wall_seconds > 0.0 ? static_cast<double>(summary.images) / summary.wall_seconds : 0.0;
+        summary.metrics = Metrics::snapshot().since(metrics_at_start);
+        summary.tokens_per_second = summary.wall_seconds > 0.0 ? static_cast<double>(summary.metrics.counter(Counter::generated_tokens)) / summary.wall_seconds : 0.0;
+        logger->info("Batch run finished: {}", summary.to_string());
+        return summary;
+    }
+
+    void BatchRunner::write_record(const CaptionRecord &record, std::span<const std::string> image_paths, std::ostream &out)
+    {
+        nlohmann::json line{{"index", record.index}, {"image", image_paths[record.index]}};
+        if (record.caption)
+        {
+            line["caption"] = *record.caption;
+        }
+        else
+        {
+            line["error"] = record.caption.error();
+        }
+        // Paths and byte-level captions are not guaranteed to be valid UTF-8
+        out << line.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace) << '\n';
+    }
+}
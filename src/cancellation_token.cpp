@@ -0,0 +1,196 @@
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "cancellation_token.hpp"
+#include "logger.hpp"
+
+namespace captioning
+{
+    struct CancellationToken::State
+    {
+        std::atomic<bool> cancelled = false;
+        std::optional<Clock::time_point> deadline;
+        std::mutex mutex;
+        Ort::RunOptions *active_run = nullptr;
+        uint64_t timer_id = 0;
+
+        void terminate_active_run() noexcept
+        {
+            std::lock_guard lock(mutex);
+            if (active_run)
+            {
+                active_run->SetTerminate();
+            }
+        }
+    };
+
+    namespace
+    {
+        // One thread for the whole process that terminates attached runs when their deadline passes. Timers only
+        // exist while a run is attached, so the set stays as small as the number of requests in flight.
+        class DeadlineWatchdog
+        {
+        public:
+            static DeadlineWatchdog &instance()
+            {
+                static DeadlineWatchdog watchdog;
+                return watchdog;
+            }
+
+            uint64_t schedule(CancellationToken::Clock::time_point deadline, std::weak_ptr<CancellationToken::State> state)
+            {
+                std::lock_guard lock(mutex_);
+                uint64_t id = ++next_id_;
+                bool earliest = timers_.empty() || deadline < timers_.begin()->first.first;
+                timers_.emplace(std::make_pair(deadline, id), std::move(state));
+                if (earliest)
+                {
+                    wake_.notify_one();
+                }
+                return id;
+            }
+
+            void unschedule(CancellationToken::Clock::time_point deadline, uint64_t id)
+            {
+                std::lock_guard lock(mutex_);
+                timers_.erase(std::make_pair(deadline, id));
+            }
+
+            ~DeadlineWatchdog()
+            {
+                {
+                    std::lock_guard lock(mutex_);
+                    stopping_ = true;
+                }
+                wake_.notify_one();
+                thread_.join();
+            }
+
+        private:
+            using Key = std::pair<CancellationToken::Clock::time_point, uint64_t>;
+
+            std::mutex mutex_;
+            std::condition_variable wake_;
+            std::map<Key, std::weak_ptr<CancellationToken::State>> timers_;
+            uint64_t next_id_ = 0;
+            bool stopping_ = false;
+            std::thread thread_;
+
+            DeadlineWatchdog() : thread_([this]
+                                         { loop(); }) {}
+
+            void loop()
+            {
+                std::unique_lock lock(mutex_);
+                while (!stopping_)
+                {
+                    if (timers_.empty())
+                    {
+                        wake_.wait(lock);
+                        continue;
+                    }
+                    auto due = timers_.begin()->first.first;
+                    if (CancellationToken::Clock::now() < due)
+                    {
+                        wake_.wait_until(lock, due);
+                        continue;
+                    }
+
+                    auto state = timers_.begin()->second.lock();
+                    timers_.erase(timers_.begin());
+                    if (state)
+                    {
+                        // SetTerminate under the state's lock, not ours, so a detaching run never waits on the watchdog
+                        lock.unlock();
+                        state->terminate_active_run();
+                        lock.lock();
+                    }
+                }
+            }
+        };
+    }
+
+    CancellationToken CancellationToken::create()
+    {
+        return CancellationToken(std::make_shared<State>());
+    }
+
+    CancellationToken CancellationToken::with_deadline(Clock::time_point deadline)
+    {
+        auto state = std::make_shared<State>();
+        state->deadline = deadline;
+        return CancellationToken(std::move(state));
+    }
+
+    void CancellationToken::cancel() const noexcept
+    {
+        if (state_)
+        {
+            state_->cancelled = true;
+            state_->terminate_active_run();
+        }
+    }
+
+    bool CancellationToken::stop_requested() const noexcept
+    {
+        return state_ && (state_->cancelled || deadline_exceeded());
+    }
+
+    bool CancellationToken::deadline_exceeded() const noexcept
+    {
+        return state_ && state_->deadline && Clock::now() >= *state_->deadline;
+    }
+
+    std::optional<CancellationToken::Clock::time_point> CancellationToken::deadline() const noexcept
+    {
+        return state_ ? state_->deadline : std::nullopt;
+    }
+
+    bool CancellationToken::attach(Ort::RunOptions &run_options) const noexcept
+    {
+        if (!state_)
+        {
+            return true;
+        }
+        {
+            // Checked under the lock so a cancel() racing with this either sees the run or is seen here
+            std::lock_guard lock(state_->mutex);
+            if (state_->cancelled || deadline_exceeded())
+            {
+                return false;
+            }
+            state_->active_run = &run_options;
+        }
+        if (state_->deadline)
+        {
+            try
+            {
+                state_->timer_id = DeadlineWatchdog::instance().schedule(*state_->deadline, state_);
+            }
+            catch (const std::exception &ex)
+            {
+                // The deadline is still enforced between decoding steps
+                Logger::get_logger()->warn("Failed to arm deadline timer: {}", ex.what());
+            }
+        }
+        return true;
+    }
+
+    void CancellationToken::detach() const noexcept
+    {
+        if (!state_)
+        {
+            return;
+        }
+        if (state_->timer_id != 0)
+        {
+            DeadlineWatchdog::instance().unschedule(*state_->deadline, state_->timer_id);
+            state_->timer_id = 0;
+        }
+        std::lock_guard lock(state_->mutex);
+        state_->active_run = nullptr;
+    }
+}
@@ -0,0 +1,108 @@
+#include <system_error>
+
+#include "caption_executor.hpp"
+#include "logger.hpp"
+
+namespace captioning
+{
+    tl::expected<std::unique_ptr<CaptionExecutor>, std::string> CaptionExecutor::create(int preprocess_threads, int inference_threads, int queue_capacity) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        std::unique_ptr<CaptionExecutor> executor(new CaptionExecutor(queue_capacity));
+        try
+        {
+            for (int i = 0; i < preprocess_threads; ++i)
+            {
+                executor->preprocess_threads_.emplace_back(&CaptionExecutor::preprocess_loop, executor.get());
+            }
+            for (int i = 0; i < inference_threads; ++i)
+            {
+                executor->inference_threads_.emplace_back(&CaptionExecutor::inference_loop, executor.get());
+            }
+        }
+        catch (const std::system_error &ex)
+        {
+            // The destructor joins whatever did start
+            logger->error("Failed to start caption executor threads: {}", ex.what());
+            return tl::unexpected("Failed to start caption executor threads: " + std::string(ex.what()));
+        }
+
+        logger->info("Caption executor started: {} preprocessing thread(s), {} inference thread(s), queue capacity {}", preprocess_threads, inference_threads, queue_capacity);
+        return executor;
+    }
+
+    CaptionExecutor::CaptionExecutor(int queue_capacity) noexcept
+        : submissions_(static_cast<size_t>(queue_capacity)), ready_(static_cast<size_t>(queue_capacity)) {}
+
+    CaptionExecutor::~CaptionExecutor()
+    {
+        shutdown();
+    }
+
+    bool CaptionExecutor::try_submit(PreprocessTask &&task) noexcept
+    {
+        try
+        {
+            return submissions_.try_push(std::move(task));
+        }
+        catch (const std::exception &ex)
+        {
+            Logger::get_logger()->error("Failed to queue caption request: {}", ex.what());
+            return false;
+        }
+    }
+
+    void CaptionExecutor::preprocess_loop() noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        while (auto task = submissions_.pop())
+        {
+            try
+            {
+                if (InferenceTask next = (*task)())
+                {
+                    // Blocking here is the backpressure: preprocessing never runs more than a queue ahead of inference
+                    ready_.push(std::move(next));
+                }
+            }
+            catch (const std::exception &ex)
+            {
+                logger->error("Caption preprocessing task failed: {}", ex.what());
+            }
+        }
+    }
+
+    void CaptionExecutor::inference_loop() noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        while (auto task = ready_.pop())
+        {
+            try
+            {
+                (*task)();
+            }
+            catch (const std::exception &ex)
+            {
+                logger->error("Caption inference task failed: {}", ex.what());
+            }
+        }
+    }
+
+    void CaptionExecutor::shutdown() noexcept
+    {
+        // Stage by stage, so every preprocessed request still reaches an inference thread
+        submissions_.close();
+        for (auto &thread : preprocess_threads_)
+        {
+            thread.join();
+        }
+        ready_.close();
+        for (auto &thread : inference_threads_)
+        {
+            thread.join();
+        }
+    }
+}
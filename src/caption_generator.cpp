@@ -3,31 +3,114 @@
 #include <format>
 
 #include "logger.hpp"
+#include "metrics.hpp"
+#include "tracing.hpp"
 #include "expected.hpp"
 #include "caption_generator.hpp"
 
 namespace captioning
 {
-    tl::expected<CaptionGenerator, std::string> CaptionGenerator::create(const Config &config) noexcept
+    namespace
     {
-        auto logger = Logger::get_logger();
+        // Length of text without a trailing, still incomplete UTF-8 sequence
+        size_t complete_utf8_length(std::string_view text) noexcept
+        {
+            size_t lead = text.size();
+            for (size_t back = 1; back <= std::min<size_t>(4, text.size()); ++back)
+            {
+                unsigned char byte = static_cast<unsigned char>(text[text.size() - back]);
+                if ((byte & 0xC0) != 0x80)
+                {
+                    lead = text.size() - back;
+                    break;
+                }
+            }
+            if (lead == text.size())
+            {
+                return text.size();
+            }
+            unsigned char byte = static_cast<unsigned char>(text[lead]);
+            size_t width = byte < 0x80 ? 1 : (byte >> 5) == 0x6 ? 2 : (byte >> 4) == 0xE ? 3 : (byte >> 3) == 0x1E ? 4 : 1;
+            return text.size() - lead < width ? lead : text.size();
+        }
+
+        std::string stopped_error(const CancellationToken &cancel)
+        {
+            return cancel.deadline_exceeded() ? "Deadline exceeded" : "Caption request cancelled";
+        }
+    }
 
+    tl::expected<GeneratorAssets, std::string> GeneratorAssets::load(const Config &config) noexcept
+    {
         try
         {
-            std::unique_ptr<captioning::ImagePreprocessor>  preprocessor = std::make_unique<ImagePreprocessor>(config.input_shape());
             tl::expected<captioning::Vocabulary, std::string> vocab = Vocabulary::from_file(config.vocab_path());
             if (!vocab)
             {
                 return tl::unexpected(vocab.error());
             }
-            tl::expected<captioning::ModelInference, std::string> model = ModelInference::create(config.model_path(), config.input_shape());
+            std::vector<MappedFile> model_mappings;
+            if (config.model_load_mode() == "mmap")
+            {
+                auto mapped = ModelInference::map_model_files(config);
+                if (!mapped)
+                {
+                    return tl::unexpected(mapped.error());
+                }
+                model_mappings = std::move(*mapped);
+            }
+            return GeneratorAssets{config, std::make_unique<Vocabulary>(std::move(*vocab)), std::move(model_mappings)};
+        }
+        catch (const std::exception &ex)
+        {
+            Logger::get_logger()->error("Failed to load generator assets: {}", ex.what());
+            return tl::unexpected("Failed to load generator assets: " + std::string(ex.what()));
+        }
+    }
+
+    tl::expected<CaptionGenerator, std::string> CaptionGenerator::create(const Config &config) noexcept
+    {
+        auto assets = GeneratorAssets::load(config);
+        if (!assets)
+        {
+            return tl::unexpected(assets.error());
+        }
+        return create(std::move(*assets));
+    }
+
+    tl::expected<CaptionGenerator, std::string> CaptionGenerator::create(GeneratorAssets assets) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        try
+        {
+            const Config &config = assets.config;
+            // Before the model, whose session profiles only if ONNX Runtime tracing is already on
+            Tracing::enable(config.trace_output(), config.trace_onnxruntime());
+            std::unique_ptr<captioning::ImagePreprocessor>  preprocessor = std::make_unique<ImagePreprocessor>(config.input_shape());
+            tl::expected<captioning::DecodingConstraints, std::string> constraints = DecodingConstraints::create(config, *assets.vocab);
+            if (!constraints)
+            {
+                return tl::unexpected(constraints.error());
+            }
+            tl::expected<captioning::Detokenizer, std::string> detokenizer = Detokenizer::create(*assets.vocab, config.tokenizer());
+            if (!detokenizer)
+            {
+                return tl::unexpected(detokenizer.error());
+            }
+            tl::expected<captioning::ModelInference, std::string> model = ModelInference::create(config, std::move(assets.model_mappings));
             if (!model)
             {
                 return tl::unexpected(model.error());
             }
+            if (auto error = model->check_vocabulary(*assets.vocab); !error.empty())
+            {
+                logger->error("{}", error);
+                return tl::unexpected(error);
+            }
 
             logger->info("CaptionGenerator initialized successfully");
-            return CaptionGenerator(config, std::move(preprocessor), std::make_unique<Vocabulary>(std::move(*vocab)), std::make_unique<ModelInference>(std::move(*model)));
+            return CaptionGenerator(std::make_unique<Pipeline>(Pipeline{config, std::move(preprocessor), std::move(assets.vocab), std::make_unique<ModelInference>(std::move(*model)), std::move(*constraints), std::move(*detokenizer)}));
         }
         catch (const std::exception &ex)
         {
@@ -36,50 +119,470 @@ namespace captioning
         }
     }
 
-    CaptionGenerator::CaptionGenerator(Config config, std::unique_ptr<ImagePreprocessor> preprocessor, std::unique_ptr<Vocabulary> vocab, std::unique_ptr<ModelInference> model) noexcept
-        : config_(std::move(config)), preprocessor_(std::move(preprocessor)), vocab_(std::move(vocab)), model_(std::move(model)) {}
+    CaptionGenerator::CaptionGenerator(std::unique_ptr<const Pipeline> pipeline) noexcept
+        : pipeline_(std::move(pipeline)), executor_once_(std::make_unique<std::once_flag>()) {}
 
-    tl::expected<std::string, std::string> CaptionGenerator::generate(const std::string &image_path) noexcept
+    std::string CaptionGenerator::warm_up() const noexcept
     {
         auto logger = Logger::get_logger();
 
         try
         {
-            auto input_tensor = preprocessor_->preprocess(image_path);
+            const auto shape = pipeline_->config.input_shape();
+            std::vector<tl::expected<cv::Mat, std::string>> images;
+            images.emplace_back(cv::Mat(static_cast<int>(shape[2]), static_cast<int>(shape[3]), CV_8UC3, cv::Scalar::all(0)));
+            auto captions = pipeline_->caption_images(std::move(images));
+            if (!captions.front())
+            {
+                logger->error("Warm-up failed: {}", captions.front().error());
+                return "Warm-up failed: " + captions.front().error();
+            }
+        }
+        catch (const std::exception &ex)
+        {
+            logger->error("Warm-up failed: {}", ex.what());
+            return "Warm-up failed: " + std::string(ex.what());
+        }
+        logger->info("Generator warmed up");
+        return {};
+    }
+
+    tl::expected<std::string, std::string> CaptionGenerator::generate(const std::string &image_path) const noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        auto decoded = pipeline_->generate_tokens(image_path, pipeline_->config.decode_options());
+        if (!decoded)
+        {
+            return tl::unexpected(decoded.error());
+        }
+
+        std::string caption;
+        pipeline_->decode_caption(decoded->tokens, caption);
+        CAPTIONING_LOG_SAMPLED(logger, spdlog::level::info, Logger::request_log_sample, "Generated caption for {}: {}", image_path, caption);
+        return caption;
+    }
+
+    tl::expected<CaptionResult, std::string> CaptionGenerator::generate(const std::string &image_path, const DecodeOptions &options, const CancellationToken &cancel) const noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        if (auto error = pipeline_->config.check_decode_options(options); !error.empty())
+        {
+            CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::warn, Logger::request_errors_per_second, "Rejected decode options for {}: {}", image_path, error);
+            return tl::unexpected("Invalid decode options: " + error);
+        }
+
+        auto decoded = pipeline_->generate_tokens(image_path, options, cancel);
+        if (!decoded)
+        {
+            return tl::unexpected(decoded.error());
+        }
+
+        CaptionResult result = pipeline_->to_caption_result(*decoded);
+        CAPTIONING_LOG_SAMPLED(logger, spdlog::level::info, Logger::request_log_sample, "Generated {}caption for {}: {}", result.truncated ? "truncated " : "", image_path, result.caption);
+        return result;
+    }
+
+    tl::expected<std::string, std::string> CaptionGenerator::generate_stream(const std::string &image_path, const CaptionStreamCallback &on_event) const noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        auto fail = [&](const std::string &error) -> tl::expected<std::string, std::string>
+        {
+            on_event(CaptionStreamEvent{CaptionStreamEvent::Type::failed, -1, error});
+            return tl::unexpected(error);
+        };
+
+        try
+        {
+            auto input_tensor = pipeline_->preprocessor->preprocess(image_path);
             if (!input_tensor)
             {
-                return tl::unexpected(input_tensor.error());
+                return fail(input_tensor.error());
             }
 
-            auto token_ids = model_->run(*input_tensor, config_.max_caption_length(), config_.beam_width(), *vocab_);
-            if (!token_ids)
+            std::string caption;
+            Detokenizer::Stream stream;
+            size_t emitted = 0;
+            size_t committed = 0;
+            auto commit = [&](int token_id)
+            {
+                pipeline_->detokenizer.append(token_id, stream, caption);
+                size_t complete = complete_utf8_length(caption);
+                on_event(CaptionStreamEvent{CaptionStreamEvent::Type::token, token_id, std::string_view(caption).substr(emitted, complete - emitted)});
+                emitted = complete;
+                ++committed;
+            };
+
+            auto decoded = pipeline_->infer(*input_tensor, pipeline_->config.decode_options(), {}, [&](size_t, std::span<const int> tokens)
+                                              {
+                                                  for (int token_id : tokens)
+                                                  {
+                                                      commit(token_id);
+                                                  } });
+            if (!decoded)
             {
-                return tl::unexpected(token_ids.error());
+                return fail(decoded.error());
+            }
+            // Whatever the beams still disagreed on when decoding stopped
+            for (int token_id : std::span<const int>(decoded->tokens).subspan(committed))
+            {
+                commit(token_id);
             }
 
-            std::string caption = decode_caption(*token_ids);
-            logger->info("Generated caption for {}: {}", image_path, caption);
+            on_event(CaptionStreamEvent{CaptionStreamEvent::Type::completed, -1, caption});
+            CAPTIONING_LOG_SAMPLED(logger, spdlog::level::info, Logger::request_log_sample, "Generated caption for {}: {}", image_path, caption);
             return caption;
         }
         catch (const std::exception &ex)
         {
-            logger->error("Failed to generate caption for {}: {}", image_path, ex.what());
+            CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::err, Logger::request_errors_per_second, "Failed to generate caption for {}: {}", image_path, ex.what());
+            return fail("Failed to generate caption for " + image_path + ": " + ex.what());
+        }
+    }
+
+    std::future<tl::expected<std::string, std::string>> CaptionGenerator::generate_async(ImageInput image) const noexcept
+    {
+        auto promise = std::make_shared<std::promise<tl::expected<std::string, std::string>>>();
+        auto future = promise->get_future();
+        generate_async(std::move(image), [promise](tl::expected<std::string, std::string> caption)
+                       { promise->set_value(std::move(caption)); });
+        return future;
+    }
+
+    void CaptionGenerator::generate_async(ImageInput image, CaptionCallback on_complete) const noexcept
+    {
+        generate_async(std::move(image), pipeline_->config.decode_options(), CancellationToken(), [on_complete = std::move(on_complete)](tl::expected<CaptionResult, std::string> result)
+                       {
+                           if (!result)
+                           {
+                               on_complete(tl::unexpected(std::move(result.error())));
+                               return;
+                           }
+                           on_complete(std::move(result->caption)); });
+    }
+
+    void CaptionGenerator::generate_async(ImageInput image, const DecodeOptions &options, CancellationToken cancel, CaptionResultCallback on_complete) const noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        if (auto error = pipeline_->config.check_decode_options(options); !error.empty())
+        {
+            CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::warn, Logger::request_errors_per_second, "Rejected decode options: {}", error);
+            on_complete(tl::unexpected("Invalid decode options: " + error));
+            return;
+        }
+
+        CaptionExecutor *executor = start_executor();
+        if (!executor)
+        {
+            on_complete(tl::unexpected(executor_error_));
+            return;
+        }
+
+        // Only the pipeline pointer is captured, so a moved generator doesn't invalidate queued requests
+        const Pipeline *pipeline = pipeline_.get();
+        CaptionExecutor::PreprocessTask task = [pipeline, image = std::move(image), options, cancel, on_complete]() -> CaptionExecutor::InferenceTask
+        {
+            // A stage that throws (e.g. bad_alloc) still completes the request, unless on_complete itself threw
+            bool completed = false;
+            auto complete = [&](tl::expected<CaptionResult, std::string> result)
+            {
+                completed = true;
+                on_complete(std::move(result));
+            };
+            try
+            {
+                if (cancel.stop_requested())
+                {
+                    complete(tl::unexpected(stopped_error(cancel)));
+                    return {};
+                }
+                auto input_tensor = pipeline->prepare(image);
+                if (!input_tensor)
+                {
+                    complete(tl::unexpected(input_tensor.error()));
+                    return {};
+                }
+                // std::function needs a copyable callable and Ort::Value is move-only
+                auto tensor = std::make_shared<Ort::Value>(std::move(*input_tensor));
+                return [pipeline, tensor, options, cancel, on_complete]
+                {
+                    bool completed = false;
+                    auto complete = [&](tl::expected<CaptionResult, std::string> result)
+                    {
+                        completed = true;
+                        on_complete(std::move(result));
+                    };
+                    try
+                    {
+                        if (cancel.stop_requested())
+                        {
+                            complete(tl::unexpected(stopped_error(cancel)));
+                            return;
+                        }
+                        auto decoded = pipeline->infer(*tensor, options, cancel);
+                        if (!decoded)
+                        {
+                            complete(tl::unexpected(decoded.error()));
+                            return;
+                        }
+                        complete(pipeline->to_caption_result(*decoded));
+                    }
+                    catch (const std::exception &ex)
+                    {
+                        if (completed)
+                        {
+                            throw;
+                        }
+                        on_complete(tl::unexpected("Caption request failed: " + std::string(ex.what())));
+                    }
+                };
+            }
+            catch (const std::exception &ex)
+            {
+                if (completed)
+                {
+                    throw;
+                }
+                on_complete(tl::unexpected("Caption request failed: " + std::string(ex.what())));
+                return {};
+            }
+        };
+
+        if (!executor->try_submit(std::move(task)))
+        {
+            CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::warn, Logger::request_errors_per_second, "Caption queue is full, rejecting request");
+            on_complete(tl::unexpected(std::string("Caption queue is full")));
+        }
+    }
+
+    CaptionExecutor *CaptionGenerator::start_executor() const noexcept
+    {
+        std::call_once(*executor_once_, [this]
+                       {
+                           const Config &config = pipeline_->config;
+                           auto executor = CaptionExecutor::create(config.async_preprocess_threads(), config.async_inference_threads(), config.async_queue_capacity());
+                           if (executor)
+                           {
+                               executor_ = std::move(*executor);
+                           }
+                           else
+                           {
+                               executor_error_ = executor.error();
+                           } });
+        return executor_.get();
+    }
+
+    bool CaptionAwaitable::await_suspend(std::coroutine_handle<> handle) noexcept
+    {
+        // The awaitable lives in the coroutine's frame until it resumes, so this stays valid. Whichever of this function
+        // and the completion reaches handed_off_ second resumes the coroutine: a request completed inline (rejected,
+        // or already done on an executor thread) makes this return false instead of resuming from inside the call.
+        generator_->generate_async(std::move(image_), [this, handle](tl::expected<std::string, std::string> caption)
+                                   {
+                                       result_ = std::move(caption);
+                                       if (handed_off_.exchange(true, std::memory_order_acq_rel))
+                                       {
+                                           handle.resume();
+                                       } });
+        return !handed_off_.exchange(true, std::memory_order_acq_rel);
+    }
+
+    tl::expected<cv::Mat, std::string> CaptionGenerator::Pipeline::load(const ImageInput &image) const noexcept
+    {
+        if (const auto *image_path = std::get_if<std::string>(&image))
+        {
+            return preprocessor->load(*image_path);
+        }
+        if (const auto *encoded = std::get_if<std::vector<unsigned char>>(&image))
+        {
+            return preprocessor->decode(*encoded);
+        }
+        if (const auto *buffer = std::get_if<ImageBuffer>(&image))
+        {
+            return preprocessor->decode(*buffer);
+        }
+        const auto &raw = std::get<RawImage>(image);
+        return preprocessor->load_rgb(raw.pixels, raw.width, raw.height, raw.stride);
+    }
+
+    tl::expected<Ort::Value, std::string> CaptionGenerator::Pipeline::prepare(const ImageInput &image) const noexcept
+    {
+        TraceSpan span("request", "prepare");
+        auto loaded = load(image);
+        if (!loaded)
+        {
+            return tl::unexpected(loaded.error());
+        }
+        return preprocessor->preprocess_batch(std::span<const cv::Mat>(&*loaded, 1));
+    }
+
+    tl::expected<DecodeResult, std::string> CaptionGenerator::Pipeline::infer(Ort::Value &input_tensor, const DecodeOptions &options, const CancellationToken &cancel, const ModelInference::CommitCallback &on_commit) const noexcept
+    {
+        return model->run(input_tensor, options, *vocab, constraints, cancel, on_commit);
+    }
+
+    CaptionResult CaptionGenerator::Pipeline::to_caption_result(DecodeResult &decoded) const noexcept
+    {
+        CaptionResult result;
+        result.truncated = decoded.truncated;
+        decode_caption(decoded.tokens, result.caption);
+        result.alternatives.resize(decoded.alternatives.size());
+        for (size_t i = 0; i < decoded.alternatives.size(); ++i)
+        {
+            decode_caption(decoded.alternatives[i], result.alternatives[i]);
+        }
+        return result;
+    }
+
+    tl::expected<DecodeResult, std::string> CaptionGenerator::Pipeline::generate_tokens(const std::string &image_path, const DecodeOptions &options, const CancellationToken &cancel) const noexcept
+    {
+        auto logger = Logger::get_logger();
+        TraceSpan span("request", "caption");
+
+        try
+        {
+            auto input_tensor = preprocessor->preprocess(image_path);
+            if (!input_tensor)
+            {
+                return tl::unexpected(input_tensor.error());
+            }
+            if (cancel.stop_requested())
+            {
+                CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::warn, Logger::request_errors_per_second, "Caption request for {} stopped before decoding: {}", image_path, stopped_error(cancel));
+                return tl::unexpected(stopped_error(cancel));
+            }
+
+            auto decoded = infer(*input_tensor, options, cancel);
+            if (!decoded)
+            {
+                return tl::unexpected(decoded.error());
+            }
+            return decoded;
+        }
+        catch (const std::exception &ex)
+        {
+            CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::err, Logger::request_errors_per_second, "Failed to generate caption for {}: {}", image_path, ex.what());
             return tl::unexpected("Failed to generate caption for " + image_path + ": " + ex.what());
         }
     }
 
-    std::string CaptionGenerator::decode_caption(std::span<const int> token_ids) const noexcept
+    std::vector<tl::expected<std::string, std::string>> CaptionGenerator::generate_batch(std::span<const std::string> image_paths) const noexcept
     {
-        std::string caption;
-        for (int id : token_ids)
+        std::vector<tl::expected<cv::Mat, std::string>> images;
+        images.reserve(image_paths.size());
+        for (const auto &image_path : image_paths)
+        {
+            images.push_back(pipeline_->preprocessor->load(image_path));
+        }
+        return pipeline_->caption_images(std::move(images));
+    }
+
+    std::vector<tl::expected<std::string, std::string>> CaptionGenerator::generate_batch(std::span<const ImageBuffer> images) const noexcept
+    {
+        std::vector<tl::expected<cv::Mat, std::string>> decoded;
+        decoded.reserve(images.size());
+        for (const auto &image : images)
+        {
+            decoded.push_back(pipeline_->preprocessor->decode(image));
+        }
+        return pipeline_->caption_images(std::move(decoded));
+    }
+
+    tl::expected<cv::Mat, std::string> CaptionGenerator::load_image(const ImageInput &image) const noexcept
+    {
+        auto loaded = pipeline_->load(image);
+        if (!loaded)
+        {
+            return tl::unexpected(loaded.error());
+        }
+        return pipeline_->preprocessor->resize_to_input(*loaded);
+    }
+
+    std::vector<tl::expected<std::string, std::string>> CaptionGenerator::generate_batch(std::vector<tl::expected<cv::Mat, std::string>> images) const noexcept
+    {
+        return pipeline_->caption_images(std::move(images));
+    }
+
+    std::vector<tl::expected<std::string, std::string>> CaptionGenerator::Pipeline::caption_images(std::vector<tl::expected<cv::Mat, std::string>> images) const noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        // Every entry is overwritten below unless something throws part-way
+        std::vector<tl::expected<std::string, std::string>> captions(images.size(), tl::unexpected(std::string("Caption generation did not run")));
+        const size_t batch_limit = model->supports_batching() ? static_cast<size_t>(config.max_batch_size()) : 1;
+        std::vector<cv::Mat> batch;
+        std::vector<size_t> batch_index;
+        size_t generated = 0;
+
+        auto run_batch = [&]
+        {
+            if (batch.empty())
+            {
+                return;
+            }
+            TraceSpan span("batch", "batch");
+            auto batch_tensor = preprocessor->preprocess_batch(batch);
+            if (!batch_tensor)
+            {
+                for (size_t index : batch_index)
+                {
+                    captions[index] = tl::unexpected(batch_tensor.error());
+                }
+            }
+            else
+            {
+                auto token_ids = model->run_batch(*batch_tensor, config.decode_options(), *vocab, constraints);
+                for (size_t i = 0; i < batch_index.size(); ++i)
+                {
+                    if (!token_ids[i])
+                    {
+                        captions[batch_index[i]] = tl::unexpected(token_ids[i].error());
+                        continue;
+                    }
+                    std::string caption;
+                    decode_caption(token_ids[i]->tokens, caption);
+                    captions[batch_index[i]] = std::move(caption);
+                    ++generated;
+                }
+            }
+            batch.clear();
+            batch_index.clear();
+        };
+
+        try
         {
-            std::string token = vocab_->id_to_token(id);
-            if (token == vocab_->get_start_token() || token == vocab_->get_end_token() || token == "<unk>")
+            for (size_t i = 0; i < images.size(); ++i)
             {
-                continue;
+                if (!images[i])
+                {
+                    captions[i] = tl::unexpected(images[i].error());
+                    continue;
+                }
+                batch.push_back(std::move(*images[i]));
+                batch_index.push_back(i);
+                if (batch.size() == batch_limit)
+                {
+                    run_batch();
+                }
             }
-            caption += token + " ";
+            run_batch();
         }
-        return caption;
+        catch (const std::exception &ex)
+        {
+            logger->error("Failed to generate captions: {}", ex.what());
+        }
+
+        CAPTIONING_LOG_SAMPLED(logger, spdlog::level::info, Logger::request_log_sample, "Generated {} of {} caption(s)", generated, images.size());
+        return captions;
+    }
+
+    void CaptionGenerator::Pipeline::decode_caption(std::span<const int> token_ids, std::string &caption) const noexcept
+    {
+        // Special tokens are skipped by id and the exact length is known up front, so this grows caption at most once
+        StageTimer timer(Stage::detokenize);
+        detokenizer.detokenize(token_ids, caption);
     }
 }
\ No newline at end of file
@@ -0,0 +1,119 @@
+#include <chrono>
+#include <nlohmann/json.hpp>
+
+#include "caption_server.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+
+namespace captioning
+{
+    namespace
+    {
+        HttpResponse json_response(int status, const nlohmann::json &body)
+        {
+            return HttpResponse{status, "application/json", body.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace), {}};
+        }
+    }
+
+    tl::expected<std::unique_ptr<CaptionServer>, std::string> CaptionServer::start(ReloadableGenerator &generators, const Config &config, const HttpServerOptions &http_options, bool reload_endpoint) noexcept
+    {
+        auto window = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::duration<float, std::milli>(config.batch_window_ms()));
+        auto batcher = DynamicBatcher::create(generators, config.max_batch_size(), window);
+        if (!batcher)
+        {
+            return tl::unexpected(batcher.error());
+        }
+
+        std::unique_ptr<CaptionServer> server(new CaptionServer(generators, std::move(*batcher), reload_endpoint));
+        auto http = HttpServer::start(http_options, [server = server.get()](const HttpRequest &request)
+                                      { return server->handle(request); });
+        if (!http)
+        {
+            return tl::unexpected(http.error());
+        }
+        server->http_ = std::move(*http);
+        return server;
+    }
+
+    CaptionServer::CaptionServer(ReloadableGenerator &generators, std::unique_ptr<DynamicBatcher> batcher, bool reload_endpoint) noexcept
+        : generators_(generators), reload_endpoint_(reload_endpoint), batcher_(std::move(batcher)) {}
+
+    HttpResponse CaptionServer::handle(const HttpRequest &request) const
+    {
+        if (request.path == "/caption")
+        {
+            if (request.method != "POST")
+            {
+                auto response = json_response(405, {{"error", "Use POST with the image as the request body"}});
+                response.headers.emplace_back("Allow", "POST");
+                return response;
+            }
+            return caption(request);
+        }
+        if (request.path == "/health")
+        {
+            if (request.method != "GET")
+            {
+                auto response = json_response(405, {{"error", "Use GET"}});
+                response.headers.emplace_back("Allow", "GET");
+                return response;
+            }
+            return json_response(200, {{"status", "ok"}});
+        }
+        if (request.path == "/metrics")
+        {
+            if (request.method != "GET")
+            {
+                auto response = json_response(405, {{"error", "Use GET"}});
+                response.headers.emplace_back("Allow", "GET");
+                return response;
+            }
+            return HttpResponse{200, "text/plain; version=0.0.4", Metrics::snapshot().to_prometheus(), {}};
+        }
+        if (request.path == "/reload" && reload_endpoint_)
+        {
+            if (request.method != "POST")
+            {
+                auto response = json_response(405, {{"error", "Use POST"}});
+                response.headers.emplace_back("Allow", "POST");
+                return response;
+            }
+            return reload();
+        }
+        return json_response(404, {{"error", "No such endpoint: " + request.path}});
+    }
+
+    HttpResponse CaptionServer::reload() const
+    {
+        if (auto error = generators_.reload(); !error.empty())
+        {
+            return json_response(409, {{"error", "Reload rejected: " + error}});
+        }
+        return json_response(200, {{"status", "reloaded"}});
+    }
+
+    HttpResponse CaptionServer::caption(const HttpRequest &request) const
+    {
+        auto logger = Logger::get_logger();
+
+        if (request.body.empty())
+        {
+            return json_response(400, {{"error", "The request body must hold the encoded image"}});
+        }
+
+        // Decoding runs here, on the connection's thread, so uploads decode in parallel while the batcher runs the model
+        auto image = generators_.current()->load_image(ImageBuffer(reinterpret_cast<const unsigned char *>(request.body.data()), request.body.size()));
+        if (!image)
+        {
+            return json_response(400, {{"error", image.error()}});
+        }
+
+        auto caption = batcher_->submit(std::move(*image)).get();
+        if (!caption)
+        {
+            CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::warn, Logger::request_errors_per_second, "Caption request failed: {}", caption.error());
+            return json_response(500, {{"error", caption.error()}});
+        }
+        return json_response(200, {{"caption", *caption}});
+    }
+}
@@ -3,6 +3,7 @@
 #include <ranges>
 
 #include "config.hpp"
+#include "detokenizer.hpp"
 #include "logger.hpp"
 #include "expected.hpp"
 
@@ -27,9 +28,62 @@ namespace captioning
             Config config;
             config.model_path_ = config_json.at("model_path").get<std::string>();
             config.vocab_path_ = config_json.at("vocab_path").get<std::string>();
+            config.tokenizer_ = config_json.value("tokenizer", std::string("word"));
             config.input_shape_ = config_json.at("input_shape").get<std::vector<int64_t>>();
             config.max_caption_length_ = config_json.value("max_caption_length", 20);
             config.beam_width_ = config_json.value("beam_width", 5);
+            config.max_beam_width_ = config_json.value("max_beam_width", config.beam_width_);
+            config.max_decode_length_ = config_json.value("max_decode_length", config.max_caption_length_);
+            config.length_penalty_ = config_json.value("length_penalty", 0.0f);
+            config.max_batch_size_ = config_json.value("max_batch_size", 16);
+            config.async_preprocess_threads_ = config_json.value("async_preprocess_threads", 2);
+            config.async_inference_threads_ = config_json.value("async_inference_threads", 1);
+            config.async_queue_capacity_ = config_json.value("async_queue_capacity", 64);
+            config.server_host_ = config_json.value("server_host", config.server_host_);
+            config.server_port_ = config_json.value("server_port", config.server_port_);
+            config.server_threads_ = config_json.value("server_threads", config.server_threads_);
+            config.server_max_body_bytes_ = config_json.value("server_max_body_bytes", config.server_max_body_bytes_);
+            config.server_reload_endpoint_ = config_json.value("server_reload_endpoint", config.server_reload_endpoint_);
+            config.batch_window_ms_ = config_json.value("batch_window_ms", config.batch_window_ms_);
+            config.sidecar_socket_ = config_json.value("sidecar_socket", config.sidecar_socket_);
+            config.daemon_workers_ = config_json.value("daemon_workers", config.daemon_workers_);
+            config.daemon_pin_workers_ = config_json.value("daemon_pin_workers", config.daemon_pin_workers_);
+            config.trace_output_ = config_json.value("trace_output", config.trace_output_);
+            config.trace_onnxruntime_ = config_json.value("trace_onnxruntime", config.trace_onnxruntime_);
+            config.banned_tokens_ = config_json.value("banned_tokens", config.banned_tokens_);
+            config.no_repeat_ngram_size_ = config_json.value("no_repeat_ngram_size", config.no_repeat_ngram_size_);
+            config.default_variant_.path = config.model_path_;
+            config.default_variant_.precision = config_json.value("model_precision", std::string("fp32"));
+            config.default_variant_.external_data = config_json.value("model_external_data", std::vector<std::string>{});
+            config.model_load_mode_ = config_json.value("model_load_mode", std::string("file"));
+            config.share_prepacked_weights_ = config_json.value("share_prepacked_weights", true);
+            config.use_shared_allocator_ = config_json.value("use_shared_allocator", true);
+            config.model_variant_ = config_json.value("model_variant", std::string());
+            if (config.model_variant_ == "default")
+            {
+                config.model_variant_.clear();
+            }
+            if (config_json.contains("output_projection"))
+            {
+                const auto &projection_json = config_json.at("output_projection");
+                OutputProjectionSettings projection;
+                projection.weights_path = projection_json.at("weights_path").get<std::string>();
+                projection.hidden_output = projection_json.at("hidden_output").get<std::string>();
+                projection.shortlist_size = projection_json.value("shortlist_size", 256);
+                projection.frequent_tokens = projection_json.value("frequent_tokens", 0);
+                config.output_projection_ = std::move(projection);
+            }
+            if (config_json.contains("model_variants"))
+            {
+                for (const auto &[name, variant_json] : config_json.at("model_variants").items())
+                {
+                    ModelVariant variant;
+                    variant.path = variant_json.at("path").get<std::string>();
+                    variant.precision = variant_json.value("precision", std::string("fp32"));
+                    variant.external_data = variant_json.value("external_data", std::vector<std::string>{});
+                    config.model_variants_.emplace(name, std::move(variant));
+                }
+            }
 
             if (auto error = config.validate(); !error.empty())
             {
@@ -47,16 +101,67 @@ namespace captioning
         }
     }
 
+    tl::expected<Config, std::string> Config::with_model_variant(const std::string &variant) const noexcept
+    {
+        Config config = *this;
+        config.model_variant_ = variant == "default" ? std::string() : variant;
+        if (auto error = config.validate(); !error.empty())
+        {
+            return tl::unexpected(error);
+        }
+        return config;
+    }
+
+    const ModelVariant &Config::selected_variant() const noexcept
+    {
+        if (auto it = model_variants_.find(model_variant_); it != model_variants_.end())
+        {
+            return it->second;
+        }
+        return default_variant_;
+    }
+
     std::string Config::validate() const noexcept
     {
         if (model_path_.empty())
         {
             return "Model path cannot be empty";
         }
+        if (!model_variant_.empty() && !model_variants_.contains(model_variant_))
+        {
+            return "Unknown model variant: " + model_variant_;
+        }
+        for (const auto &[name, variant] : model_variants_)
+        {
+            if (name == "default")
+            {
+                return "Model variant name 'default' is reserved for model_path";
+            }
+            if (variant.path.empty())
+            {
+                return "Model path for variant " + name + " cannot be empty";
+            }
+            if (!variant.has_known_precision())
+            {
+                return "Precision of model variant " + name + " must be one of fp32, int8, uint8";
+            }
+        }
+        if (!default_variant_.has_known_precision())
+        {
+            return "Model precision must be one of fp32, int8, uint8";
+        }
+        if (model_load_mode_ != "file" && model_load_mode_ != "mmap")
+        {
+            return "Model load mode must be 'file' or 'mmap'";
+        }
         if (vocab_path_.empty())
         {
             return "Vocabulary path cannot be empty";
         }
+        if (auto error = Detokenizer::check_tokenizer(tokenizer_); !error.empty())
+        {
+            return error;
+        }
         if (input_shape_.size() != 4)
         {
             return "Input shape must have 4 dimensions (N, C, H, W)";
@@ -69,6 +174,82 @@ namespace captioning
         {
             return "Beam width must be positive";
         }
+        if (max_beam_width_ < beam_width_ || max_decode_length_ < max_caption_length_)
+        {
+            return "max_beam_width and max_decode_length cannot be below beam_width and max_caption_length";
+        }
+        if (length_penalty_ < 0.0f)
+        {
+            return "Length penalty cannot be negative";
+        }
+        if (max_batch_size_ <= 0)
+        {
+            return "Max batch size must be positive";
+        }
+        if (async_preprocess_threads_ <= 0 || async_inference_threads_ <= 0 || async_queue_capacity_ <= 0)
+        {
+            return "Async thread counts and queue capacity must be positive";
+        }
+        if (server_port_ < 0 || server_port_ > 65535)
+        {
+            return "Server port must be between 0 and 65535";
+        }
+        if (server_threads_ <= 0 || server_max_body_bytes_ == 0)
+        {
+            return "Server thread count and max body size must be positive";
+        }
+        if (!(batch_window_ms_ >= 0.0f))
+        {
+            return "Batch window cannot be negative";
+        }
+        if (sidecar_socket_.empty())
+        {
+            return "Sidecar socket path cannot be empty";
+        }
+        if (daemon_workers_ < 0)
+        {
+            return "Daemon worker count cannot be negative";
+        }
+        if (trace_onnxruntime_ && trace_output_.empty())
+        {
+            return "trace_onnxruntime needs a trace_output path";
+        }
+        if (no_repeat_ngram_size_ < 0)
+        {
+            return "No-repeat n-gram size cannot be negative";
+        }
+        if (output_projection_)
+        {
+            if (output_projection_->weights_path.empty() || output_projection_->hidden_output.empty())
+            {
+                return "Output projection needs weights_path and hidden_output";
+            }
+            if (output_projection_->shortlist_size <= 0 || output_projection_->frequent_tokens < 0)
+            {
+                return "Output projection shortlist_size must be positive and frequent_tokens non-negative";
+            }
+        }
+        return {};
+    }
+
+    std::string Config::check_decode_options(const DecodeOptions &options) const noexcept
+    {
+        if (options.beam_width <= 0 || options.beam_width > max_beam_width_)
+        {
+            return "beam width must be between 1 and " + std::to_string(max_beam_width_);
+        }
+        if (options.max_length <= 0 || options.max_length > max_decode_length_)
+        {
+            return "max length must be between 1 and " + std::to_string(max_decode_length_);
+        }
+        if (!(options.length_penalty >= 0.0f))
+        {
+            return "length penalty cannot be negative";
+        }
+        if (options.n_best <= 0 || options.n_best > options.beam_width)
+        {
+            return "n_best must be between 1 and the beam width";
+        }
         return {};
     }
 }
\ No newline at end of file
@@ -0,0 +1,104 @@
+#include <algorithm>
+#include <limits>
+
+#include "decoding_constraints.hpp"
+#include "logger.hpp"
+#include "expected.hpp"
+
+namespace captioning
+{
+    TokenMask::TokenMask(size_t vocab_size) noexcept : words_((vocab_size + 63) / 64, 0), size_(vocab_size) {}
+
+    void TokenMask::ban(int id) noexcept
+    {
+        if (id >= 0 && static_cast<size_t>(id) < size_)
+        {
+            words_[id >> 6] |= uint64_t{1} << (id & 63);
+        }
+    }
+
+    void TokenMask::apply(std::span<float> scores) const noexcept
+    {
+        constexpr float masked = -std::numeric_limits<float>::infinity();
+        const size_t count = std::min(scores.size(), size_);
+
+        for (size_t word = 0; word * 64 < count; ++word)
+        {
+            const uint64_t bits = words_[word];
+            if (bits == 0)
+            {
+                continue;
+            }
+            // Branchless select over the 64 scores covered by this word; the compiler vectorizes it
+            float *block = scores.data() + word * 64;
+            const size_t block_size = std::min<size_t>(64, count - word * 64);
+            for (size_t i = 0; i < block_size; ++i)
+            {
+                block[i] = ((bits >> i) & 1u) ? masked : block[i];
+            }
+        }
+    }
+
+    bool NGramHistory::repeats(std::span<const int> sequence, int token, int n) const noexcept
+    {
+        if (n <= 0 || sequence.size() < static_cast<size_t>(n - 1) || hashes_.empty())
+        {
+            return false;
+        }
+        uint64_t candidate = hash(sequence.last(n - 1), token);
+        return std::ranges::find(hashes_, candidate) != hashes_.end();
+    }
+
+    void NGramHistory::record(std::span<const int> sequence, int n)
+    {
+        if (n <= 0 || sequence.size() < static_cast<size_t>(n))
+        {
+            return;
+        }
+        auto ngram = sequence.last(n);
+        hashes_.push_back(hash(ngram.first(n - 1), ngram.back()));
+    }
+
+    uint64_t NGramHistory::hash(std::span<const int> prefix, int token) noexcept
+    {
+        // FNV-1a over the token ids
+        uint64_t h = 14695981039346656037ull;
+        auto mix = [&h](int id)
+        {
+            h ^= static_cast<uint32_t>(id);
+            h *= 1099511628211ull;
+        };
+        for (int id : prefix)
+        {
+            mix(id);
+        }
+        mix(token);
+        return h;
+    }
+
+    tl::expected<DecodingConstraints, std::string> DecodingConstraints::create(const Config &config, const Vocabulary &vocab) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        TokenMask mask(vocab.size());
+        for (const auto &token : config.banned_tokens())
+        {
+            if (!vocab.contains(token))
+            {
+                logger->warn("Banned token {} is not in the vocabulary, ignoring it", token);
+                continue;
+            }
+            int id = vocab.token_to_id(token);
+            if (id == vocab.end_id())
+            {
+                return tl::unexpected("The end token cannot be banned");
+            }
+            mask.ban(id);
+        }
+
+        return DecodingConstraints(std::move(mask), config.no_repeat_ngram_size());
+    }
+
+    DecodingConstraints::DecodingConstraints(TokenMask banned_tokens, int no_repeat_ngram_size) noexcept
+        : banned_tokens_(std::move(banned_tokens)), no_repeat_ngram_size_(no_repeat_ngram_size) {}
+}
@@ -0,0 +1,202 @@
+#include <array>
+
+#include "detokenizer.hpp"
+#include "logger.hpp"
+#include "expected.hpp"
+
+namespace captioning
+{
+    namespace
+    {
+        constexpr std::string_view sentencepiece_space = "\xE2\x96\x81"; // U+2581
+
+        // Inverse of GPT-2's bytes_to_unicode(): printable Latin-1 bytes map to themselves, the other 68 byte
+        // values to code points 256.. in byte order
+        std::array<int, 324> make_byte_decoder() noexcept
+        {
+            std::array<int, 324> decoder{};
+            decoder.fill(-1);
+            int next = 256;
+            for (int byte = 0; byte < 256; ++byte)
+            {
+                bool printable = (byte >= 33 && byte <= 126) || (byte >= 161 && byte <= 172) || (byte >= 174 && byte <= 255);
+                decoder[printable ? byte : next++] = byte;
+            }
+            return decoder;
+        }
+
+        void replace_all(std::string &text, std::string_view from, char to)
+        {
+            for (size_t pos = text.find(from); pos != std::string::npos; pos = text.find(from, pos + 1))
+            {
+                text.replace(pos, from.size(), 1, to);
+            }
+        }
+    }
+
+    tl::expected<Detokenizer, std::string> Detokenizer::create(const Vocabulary &vocab, const std::string &tokenizer) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        if (auto error = check_tokenizer(tokenizer); !error.empty())
+        {
+            logger->error("{}", error);
+            return tl::unexpected(error);
+        }
+
+        try
+        {
+            std::string surfaces;
+            std::vector<Piece> pieces(vocab.size());
+            for (size_t id = 0; id < vocab.size(); ++id)
+            {
+                const int token_id = static_cast<int>(id);
+                if (token_id == vocab.start_id() || token_id == vocab.end_id() || token_id == vocab.pad_id() || token_id == vocab.unk_id())
+                {
+                    continue;
+                }
+
+                std::string_view token = vocab.id_to_token(token_id);
+                std::string surface;
+                Piece &piece = pieces[id];
+                piece.skip = false;
+                piece.space_before = true;
+
+                if (tokenizer == "wordpiece" && token.starts_with("##"))
+                {
+                    piece.space_before = false;
+                    token.remove_prefix(2);
+                }
+                else if (tokenizer == "bpe" && token.ends_with("@@"))
+                {
+                    piece.glue_next = true;
+                    token.remove_suffix(2);
+                }
+                surface = token;
+
+                if (tokenizer == "sentencepiece")
+                {
+                    replace_all(surface, sentencepiece_space, ' ');
+                }
+                else if (tokenizer == "byte_bpe")
+                {
+                    surface = decode_byte_level(token);
+                }
+                if (tokenizer == "sentencepiece" || tokenizer == "byte_bpe")
+                {
+                    // The word boundary is part of the token itself
+                    piece.space_before = surface.starts_with(' ');
+                    if (piece.space_before)
+                    {
+                        surface.erase(0, 1);
+                    }
+                }
+
+                piece.offset = static_cast<uint32_t>(surfaces.size());
+                piece.length = static_cast<uint32_t>(surface.size());
+                surfaces += surface;
+            }
+
+            logger->info("Detokenizer ready: {} tokenizer, {} tokens", tokenizer, pieces.size());
+            return Detokenizer(std::move(surfaces), std::move(pieces));
+        }
+        catch (const std::exception &ex)
+        {
+            logger->error("Failed to build detokenizer: {}", ex.what());
+            return tl::unexpected("Failed to build detokenizer: " + std::string(ex.what()));
+        }
+    }
+
+    std::string Detokenizer::check_tokenizer(std::string_view tokenizer) noexcept
+    {
+        if (std::ranges::find(tokenizers, tokenizer) != tokenizers.end())
+        {
+            return {};
+        }
+        std::string error = "Unknown tokenizer type '" + std::string(tokenizer) + "', expected one of";
+        for (std::string_view name : tokenizers)
+        {
+            error += (name == tokenizers.front() ? " " : ", ") + std::string(name);
+        }
+        return error;
+    }
+
+    Detokenizer::Detokenizer(std::string surfaces, std::vector<Piece> pieces) noexcept
+        : surfaces_(std::move(surfaces)), pieces_(std::move(pieces)) {}
+
+    void Detokenizer::append(int id, Stream &stream, std::string &out) const noexcept
+    {
+        const Piece *piece = find(id);
+        if (!piece)
+        {
+            return;
+        }
+        if (separates(*piece, stream))
+        {
+            out += ' ';
+        }
+        out.append(surfaces_, piece->offset, piece->length);
+        advance(*piece, stream);
+    }
+
+    void Detokenizer::detokenize(std::span<const int> ids, std::string &out) const noexcept
+    {
+        out.reserve(out.size() + length(ids));
+        Stream stream;
+        for (int id : ids)
+        {
+            append(id, stream, out);
+        }
+    }
+
+    size_t Detokenizer::length(std::span<const int> ids) const noexcept
+    {
+        size_t total = 0;
+        Stream stream;
+        for (int id : ids)
+        {
+            if (const Piece *piece = find(id))
+            {
+                total += piece->length + (separates(*piece, stream) ? 1 : 0);
+                advance(*piece, stream);
+            }
+        }
+        return total;
+    }
+
+    std::string Detokenizer::decode_byte_level(std::string_view token)
+    {
+        static const std::array<int, 324> decoder = make_byte_decoder();
+
+        std::string bytes;
+        bytes.reserve(token.size());
+        for (size_t i = 0; i < token.size();)
+        {
+            // Byte-level tokens only use code points below 324, i.e. one- and two-byte UTF-8
+            unsigned char lead = static_cast<unsigned char>(token[i]);
+            int code_point = -1;
+            size_t width = 1;
+            if (lead < 0x80)
+            {
+                code_point = lead;
+            }
+            else if ((lead & 0xE0) == 0xC0 && i + 1 < token.size())
+            {
+                code_point = ((lead & 0x1F) << 6) | (static_cast<unsigned char>(token[i + 1]) & 0x3F);
+                width = 2;
+            }
+
+            if (code_point >= 0 && code_point < static_cast<int>(decoder.size()) && decoder[code_point] >= 0)
+            {
+                bytes += static_cast<char>(decoder[code_point]);
+            }
+            else
+            {
+                // Not byte-level text (e.g. an added token): keep it verbatim
+                bytes.append(token.substr(i, width));
+            }
+            i += width;
+        }
+        return bytes;
+    }
+}
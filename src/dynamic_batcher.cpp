@@ -0,0 +1,133 @@
+#include <system_error>
+
+#include "dynamic_batcher.hpp"
+#include "logger.hpp"
+#include "tracing.hpp"
+
+namespace captioning
+{
+    tl::expected<std::unique_ptr<DynamicBatcher>, std::string> DynamicBatcher::create(const ReloadableGenerator &generators, int max_batch_size, std::chrono::microseconds window) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        if (max_batch_size <= 0 || window.count() < 0)
+        {
+            return tl::unexpected("Dynamic batcher needs a positive batch size and a non-negative window");
+        }
+
+        std::unique_ptr<DynamicBatcher> batcher(new DynamicBatcher(generators, max_batch_size, window));
+        try
+        {
+            batcher->batch_thread_ = std::thread(&DynamicBatcher::batch_loop, batcher.get());
+        }
+        catch (const std::system_error &ex)
+        {
+            logger->error("Failed to start dynamic batcher thread: {}", ex.what());
+            return tl::unexpected("Failed to start dynamic batcher thread: " + std::string(ex.what()));
+        }
+
+        logger->info("Dynamic batcher started: up to {} image(s) per batch, {} us window", max_batch_size, window.count());
+        return batcher;
+    }
+
+    DynamicBatcher::DynamicBatcher(const ReloadableGenerator &generators, int max_batch_size, std::chrono::microseconds window) noexcept
+        : generators_(generators), max_batch_size_(static_cast<size_t>(max_batch_size)), window_(window) {}
+
+    DynamicBatcher::~DynamicBatcher()
+    {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        pending_changed_.notify_all();
+        if (batch_thread_.joinable())
+        {
+            batch_thread_.join();
+        }
+    }
+
+    DynamicBatcher::CaptionFuture DynamicBatcher::submit(cv::Mat image) noexcept
+    {
+        std::promise<tl::expected<std::string, std::string>> caption;
+        CaptionFuture future = caption.get_future();
+        try
+        {
+            std::unique_lock lock(mutex_);
+            if (stopping_)
+            {
+                lock.unlock();
+                caption.set_value(tl::unexpected(std::string("Caption server is shutting down")));
+                return future;
+            }
+            pending_.push_back(Request{std::move(image), std::move(caption), std::chrono::steady_clock::now()});
+            lock.unlock();
+            pending_changed_.notify_one();
+        }
+        catch (const std::exception &ex)
+        {
+            // The request's promise is gone, so the future reports a broken promise
+            Logger::get_logger()->error("Failed to queue caption request: {}", ex.what());
+        }
+        return future;
+    }
+
+    void DynamicBatcher::batch_loop() noexcept
+    {
+        std::vector<Request> batch;
+        batch.reserve(max_batch_size_);
+        while (true)
+        {
+            {
+                std::unique_lock lock(mutex_);
+                pending_changed_.wait(lock, [this]
+                                      { return stopping_ || !pending_.empty(); });
+                if (pending_.empty())
+                {
+                    return;
+                }
+
+                // The window starts with the oldest waiting image; when stopping, run what is there at once
+                const auto deadline = pending_.front().arrival + window_;
+                pending_changed_.wait_until(lock, deadline, [this]
+                                            { return stopping_ || pending_.size() >= max_batch_size_; });
+
+                while (!pending_.empty() && batch.size() < max_batch_size_)
+                {
+                    batch.push_back(std::move(pending_.front()));
+                    pending_.pop_front();
+                }
+            }
+
+            run_batch(batch);
+            batch.clear();
+        }
+    }
+
+    void DynamicBatcher::run_batch(std::vector<Request> &batch) noexcept
+    {
+        auto logger = Logger::get_logger();
+        TraceSpan span("batch", "dynamic_batch");
+
+        try
+        {
+            std::vector<tl::expected<cv::Mat, std::string>> images;
+            images.reserve(batch.size());
+            for (auto &request : batch)
+            {
+                images.emplace_back(std::move(request.image));
+            }
+            SPDLOG_LOGGER_DEBUG(logger, "Running a dynamic batch of {} image(s)", batch.size());
+
+            auto captions = generators_.current()->generate_batch(std::move(images));
+            for (size_t i = 0; i < batch.size(); ++i)
+            {
+                batch[i].caption.set_value(std::move(captions[i]));
+            }
+        }
+        catch (const std::exception &ex)
+        {
+            // Requests whose promise was not set yet see a broken promise
+            logger->error("Dynamic batch failed: {}", ex.what());
+        }
+    }
+}
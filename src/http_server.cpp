@@ -0,0 +1,490 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <format>
+#include <system_error>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "http_server.hpp"
+#include "logger.hpp"
+#include "sockets.hpp"
+
+namespace captioning
+{
+    namespace
+    {
+        constexpr size_t max_header_bytes = 16 * 1024;
+        constexpr int accept_poll_ms = 200;
+
+        std::string to_lower(std::string_view text)
+        {
+            std::string lower(text);
+            std::ranges::transform(lower, lower.begin(), [](unsigned char c)
+                                   { return static_cast<char>(std::tolower(c)); });
+            return lower;
+        }
+
+        std::string_view trim(std::string_view text) noexcept
+        {
+            while (!text.empty() && (text.front() == ' ' || text.front() == '\t'))
+            {
+                text.remove_prefix(1);
+            }
+            while (!text.empty() && (text.back() == ' ' || text.back() == '\t'))
+            {
+                text.remove_suffix(1);
+            }
+            return text;
+        }
+
+        HttpResponse error_response(int status)
+        {
+            return HttpResponse{status, "application/json", std::format(R"({{"error":"{}"}})", HttpServer::status_reason(status)), {}};
+        }
+    }
+
+    tl::expected<std::unique_ptr<HttpServer>, std::string> HttpServer::start(const HttpServerOptions &options, Handler handler) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        if (options.threads <= 0 || options.port < 0 || options.port > 65535)
+        {
+            return tl::unexpected("HTTP server needs a positive thread count and a port between 0 and 65535");
+        }
+
+        std::unique_ptr<HttpServer> server(new HttpServer(options, std::move(handler)));
+        if (options.listen_fd >= 0)
+        {
+            server->listen_fd_ = options.listen_fd;
+        }
+        else
+        {
+            auto listener = open_listener(options.host, options.port);
+            if (!listener)
+            {
+                logger->error("{}", listener.error());
+                return tl::unexpected(listener.error());
+            }
+            server->listen_fd_ = *listener;
+        }
+
+        sockaddr_storage bound{};
+        socklen_t bound_length = sizeof(bound);
+        server->port_ = options.port;
+        if (::getsockname(server->listen_fd_, reinterpret_cast<sockaddr *>(&bound), &bound_length) == 0)
+        {
+            if (bound.ss_family == AF_INET)
+            {
+                server->port_ = ntohs(reinterpret_cast<const sockaddr_in *>(&bound)->sin_port);
+            }
+            else if (bound.ss_family == AF_INET6)
+            {
+                server->port_ = ntohs(reinterpret_cast<const sockaddr_in6 *>(&bound)->sin6_port);
+            }
+        }
+
+        try
+        {
+            for (int i = 0; i < options.threads; ++i)
+            {
+                server->workers_.emplace_back(&HttpServer::worker_loop, server.get());
+            }
+            server->accept_thread_ = std::thread(&HttpServer::accept_loop, server.get());
+        }
+        catch (const std::system_error &ex)
+        {
+            // The destructor stops whatever did start
+            logger->error("Failed to start HTTP server threads: {}", ex.what());
+            return tl::unexpected("Failed to start HTTP server threads: " + std::string(ex.what()));
+        }
+
+        logger->info("HTTP server listening on {}:{} with {} connection thread(s)", options.host, server->port_, options.threads);
+        return server;
+    }
+
+    HttpServer::HttpServer(const HttpServerOptions &options, Handler handler) noexcept
+        : options_(options), handler_(std::move(handler)), connections_(static_cast<size_t>(options.threads) * 4) {}
+
+    HttpServer::~HttpServer()
+    {
+        stop();
+    }
+
+    tl::expected<int, std::string> HttpServer::open_listener(const std::string &host, int port) noexcept
+    {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+        addrinfo *addresses = nullptr;
+        std::string service = std::to_string(port);
+        if (int status = ::getaddrinfo(host.empty() ? nullptr : host.c_str(), service.c_str(), &hints, &addresses); status != 0)
+        {
+            return tl::unexpected(std::format("Failed to resolve {}: {}", host, ::gai_strerror(status)));
+        }
+
+        std::string error = "No address to listen on for " + host;
+        int listen_fd = -1;
+        for (addrinfo *address = addresses; address != nullptr; address = address->ai_next)
+        {
+            // Non-blocking: with several acceptors on one socket, the ones losing the race must not block in accept
+            int fd = Sockets::open(address->ai_family, address->ai_socktype, address->ai_protocol, true);
+            if (fd < 0)
+            {
+                error = std::format("Failed to create socket: {}", std::strerror(errno));
+                continue;
+            }
+            int reuse = 1;
+            ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            if (::bind(fd, address->ai_addr, address->ai_addrlen) != 0 || ::listen(fd, SOMAXCONN) != 0)
+            {
+                error = std::format("Failed to listen on {}:{}: {}", host, port, std::strerror(errno));
+                ::close(fd);
+                continue;
+            }
+            listen_fd = fd;
+            break;
+        }
+        ::freeaddrinfo(addresses);
+        if (listen_fd < 0)
+        {
+            return tl::unexpected(error);
+        }
+        return listen_fd;
+    }
+
+    void HttpServer::stop() noexcept
+    {
+        if (stopping_.exchange(true))
+        {
+            return;
+        }
+
+        if (accept_thread_.joinable())
+        {
+            accept_thread_.join();
+        }
+        connections_.close();
+        {
+            // Wakes workers blocked reading from idle keep-alive connections; responses in progress still go out
+            std::lock_guard lock(active_mutex_);
+            for (int fd : active_fds_)
+            {
+                ::shutdown(fd, SHUT_RD);
+            }
+        }
+        for (auto &worker : workers_)
+        {
+            worker.join();
+        }
+        if (listen_fd_ >= 0)
+        {
+            ::close(listen_fd_);
+            listen_fd_ = -1;
+        }
+        Logger::get_logger()->info("HTTP server stopped");
+    }
+
+    void HttpServer::accept_loop() noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        const timeval timeout{options_.io_timeout_seconds, 0};
+        while (!stopping_)
+        {
+            pollfd listener{listen_fd_, POLLIN, 0};
+            int ready = ::poll(&listener, 1, accept_poll_ms);
+            if (ready <= 0)
+            {
+                if (ready < 0 && errno != EINTR)
+                {
+                    logger->error("Polling the HTTP listener failed: {}", std::strerror(errno));
+                }
+                continue;
+            }
+
+            int fd = Sockets::accept(listen_fd_);
+            if (fd < 0)
+            {
+                if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+                {
+                    CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::warn, Logger::request_errors_per_second, "Failed to accept an HTTP connection: {}", std::strerror(errno));
+                }
+                continue;
+            }
+            int no_delay = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+            ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            int queued = fd;
+            if (!connections_.try_push(std::move(queued)))
+            {
+                CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::warn, Logger::request_errors_per_second, "All HTTP connection threads are busy, rejecting a connection");
+                write_response(fd, error_response(503), false);
+                ::close(fd);
+            }
+        }
+    }
+
+    void HttpServer::worker_loop() noexcept
+    {
+        while (auto fd = connections_.pop())
+        {
+            bool serve = false;
+            {
+                std::lock_guard lock(active_mutex_);
+                if (!stopping_)
+                {
+                    active_fds_.insert(*fd);
+                    serve = true;
+                }
+            }
+            if (serve)
+            {
+                serve_connection(*fd);
+                std::lock_guard lock(active_mutex_);
+                active_fds_.erase(*fd);
+            }
+            ::close(*fd);
+        }
+    }
+
+    void HttpServer::serve_connection(int fd) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        // Bytes read past the end of one request belong to the next (pipelining)
+        std::string buffer;
+        while (!stopping_)
+        {
+            HttpRequest request;
+            ReadStatus status;
+            try
+            {
+                status = read_request(fd, buffer, request);
+            }
+            catch (const std::exception &ex)
+            {
+                CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::err, Logger::request_errors_per_second, "Failed to read HTTP request: {}", ex.what());
+                status = ReadStatus::bad_request;
+            }
+
+            if (status == ReadStatus::closed)
+            {
+                return;
+            }
+            if (status != ReadStatus::ok)
+            {
+                int code = status == ReadStatus::too_large ? 413 : status == ReadStatus::length_required ? 411 : 400;
+                write_response(fd, error_response(code), false);
+                return;
+            }
+
+            HttpResponse response;
+            try
+            {
+                response = handler_(request);
+            }
+            catch (const std::exception &ex)
+            {
+                CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::err, Logger::request_errors_per_second, "HTTP handler for {} {} failed: {}", request.method, request.path, ex.what());
+                response = error_response(500);
+            }
+
+            bool keep_alive = request.keep_alive && !stopping_;
+            if (!write_response(fd, response, keep_alive) || !keep_alive)
+            {
+                return;
+            }
+        }
+    }
+
+    HttpServer::ReadStatus HttpServer::read_request(int fd, std::string &buffer, HttpRequest &request) const
+    {
+        auto receive = [&]
+        {
+            char chunk[16 * 1024];
+            while (true)
+            {
+                ssize_t received = ::recv(fd, chunk, sizeof(chunk), 0);
+                if (received < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (received <= 0)
+                {
+                    // Peer closed, idle timeout, or shutdown by stop()
+                    return false;
+                }
+                buffer.append(chunk, static_cast<size_t>(received));
+                return true;
+            }
+        };
+
+        size_t header_end;
+        while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos)
+        {
+            if (buffer.size() > max_header_bytes)
+            {
+                return ReadStatus::bad_request;
+            }
+            if (!receive())
+            {
+                return ReadStatus::closed;
+            }
+        }
+
+        std::string_view head(buffer.data(), header_end);
+        size_t line_end = head.find("\r\n");
+        std::string_view request_line = head.substr(0, line_end);
+        size_t method_end = request_line.find(' ');
+        size_t target_end = method_end == std::string_view::npos ? std::string_view::npos : request_line.find(' ', method_end + 1);
+        if (target_end == std::string_view::npos)
+        {
+            return ReadStatus::bad_request;
+        }
+        std::string_view version = request_line.substr(target_end + 1);
+        if (!version.starts_with("HTTP/1."))
+        {
+            return ReadStatus::bad_request;
+        }
+        request.method = request_line.substr(0, method_end);
+        std::string_view target = request_line.substr(method_end + 1, target_end - method_end - 1);
+        size_t query_start = target.find('?');
+        request.path = target.substr(0, query_start);
+        request.query = query_start == std::string_view::npos ? std::string_view() : target.substr(query_start + 1);
+
+        while (line_end != std::string_view::npos)
+        {
+            size_t next = head.find("\r\n", line_end + 2);
+            std::string_view line = head.substr(line_end + 2, next == std::string_view::npos ? std::string_view::npos : next - line_end - 2);
+            line_end = next;
+            size_t colon = line.find(':');
+            if (colon == std::string_view::npos)
+            {
+                return ReadStatus::bad_request;
+            }
+            request.headers[to_lower(trim(line.substr(0, colon)))] = trim(line.substr(colon + 1));
+        }
+
+        std::string connection = request.headers.contains("connection") ? to_lower(request.headers["connection"]) : std::string();
+        request.keep_alive = version == "HTTP/1.0" ? connection.find("keep-alive") != std::string::npos
+                                                   : connection.find("close") == std::string::npos;
+
+        if (request.headers.contains("transfer-encoding"))
+        {
+            return ReadStatus::length_required;
+        }
+        size_t content_length = 0;
+        if (auto it = request.headers.find("content-length"); it != request.headers.end())
+        {
+            const std::string &value = it->second;
+            auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), content_length);
+            if (error != std::errc() || end != value.data() + value.size())
+            {
+                return ReadStatus::bad_request;
+            }
+        }
+        if (content_length > options_.max_body_bytes)
+        {
+            return ReadStatus::too_large;
+        }
+
+        const size_t body_start = header_end + 4;
+        if (buffer.size() - body_start < content_length && request.headers.contains("expect"))
+        {
+            // curl and most clients wait for this before sending a large body
+            if (to_lower(request.headers["expect"]) != "100-continue" || !write_all(fd, "HTTP/1.1 100 Continue\r\n\r\n"))
+            {
+                return ReadStatus::bad_request;
+            }
+        }
+        buffer.reserve(body_start + content_length);
+        while (buffer.size() - body_start < content_length)
+        {
+            if (!receive())
+            {
+                return ReadStatus::closed;
+            }
+        }
+
+        request.body.assign(buffer, body_start, content_length);
+        buffer.erase(0, body_start + content_length);
+        return ReadStatus::ok;
+    }
+
+    bool HttpServer::write_response(int fd, const HttpResponse &response, bool keep_alive) noexcept
+    {
+        try
+        {
+            std::string message = std::format("HTTP/1.1 {} {}\r\nContent-Type: {}\r\nContent-Length: {}\r\nConnection: {}\r\n",
+                                              response.status, status_reason(response.status), response.content_type, response.body.size(),
+                                              keep_alive ? "keep-alive" : "close");
+            for (const auto &[name, value] : response.headers)
+            {
+                message += std::format("{}: {}\r\n", name, value);
+            }
+            message += "\r\n";
+            message += response.body;
+            return write_all(fd, message);
+        }
+        catch (const std::exception &ex)
+        {
+            Logger::get_logger()->error("Failed to write HTTP response: {}", ex.what());
+            return false;
+        }
+    }
+
+    bool HttpServer::write_all(int fd, std::string_view data) noexcept
+    {
+        while (!data.empty())
+        {
+            ssize_t sent = Sockets::send(fd, data.data(), data.size());
+            if (sent < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (sent <= 0)
+            {
+                return false;
+            }
+            data.remove_prefix(static_cast<size_t>(sent));
+        }
+        return true;
+    }
+
+    std::string_view HttpServer::status_reason(int status) noexcept
+    {
+        switch (status)
+        {
+        case 200:
+            return "OK";
+        case 400:
+            return "Bad Request";
+        case 404:
+            return "Not Found";
+        case 405:
+            return "Method Not Allowed";
+        case 409:
+            return "Conflict";
+        case 411:
+            return "Length Required";
+        case 413:
+            return "Content Too Large";
+        case 500:
+            return "Internal Server Error";
+        case 503:
+            return "Service Unavailable";
+        default:
+            return "Unknown";
+        }
+    }
+}
@@ -1,8 +1,11 @@
 #include <stdexcept>
 #include <ranges>
+#include <format>
 
 #include "expected.hpp"
 #include "logger.hpp"
+#include "metrics.hpp"
+#include "tracing.hpp"
 #include "image_preprocessor.hpp"
 
 namespace captioning
@@ -28,35 +31,172 @@ namespace captioning
     }
 
     tl::expected<Ort::Value, std::string> ImagePreprocessor::preprocess(const std::string &image_path) const noexcept
+    {
+        auto image = load(image_path);
+        if (!image)
+        {
+            return tl::unexpected(image.error());
+        }
+
+        auto input_tensor = preprocess_batch(std::span<const cv::Mat>(&*image, 1));
+        if (!input_tensor)
+        {
+            return tl::unexpected(input_tensor.error());
+        }
+
+        SPDLOG_LOGGER_DEBUG(Logger::get_logger(), "Image preprocessed successfully: {}", image_path);
+        return input_tensor;
+    }
+
+    tl::expected<cv::Mat, std::string> ImagePreprocessor::load(const std::string &image_path) const noexcept
     {
         auto logger = Logger::get_logger();
 
+        StageTimer timer(Stage::image_decode);
         cv::Mat image = cv::imread(image_path);
+        timer.stop();
         if (image.empty())
         {
-            logger->error("Failed to load image: {}", image_path);
+            CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::err, Logger::request_errors_per_second, "Failed to load image: {}", image_path);
             return tl::unexpected("Failed to load image: " + image_path);
         }
+        return image;
+    }
+
+    tl::expected<cv::Mat, std::string> ImagePreprocessor::decode(std::span<const unsigned char> encoded) const noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        cv::Mat image;
+        StageTimer timer(Stage::image_decode);
+        try
+        {
+            // imdecode only reads the buffer; the wrapping Mat doesn't copy it
+            const cv::Mat buffer(1, static_cast<int>(encoded.size()), CV_8UC1, const_cast<unsigned char *>(encoded.data()));
+            image = cv::imdecode(buffer, cv::IMREAD_COLOR);
+            timer.stop();
+        }
+        catch (const cv::Exception &ex)
+        {
+            CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::err, Logger::request_errors_per_second, "Failed to decode image: {}", ex.what());
+            return tl::unexpected("Failed to decode image: " + std::string(ex.what()));
+        }
+        if (image.empty())
+        {
+            CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::err, Logger::request_errors_per_second, "Failed to decode image ({} bytes)", encoded.size());
+            return tl::unexpected("Failed to decode image (" + std::to_string(encoded.size()) + " bytes)");
+        }
+        return image;
+    }
 
-        // Resize image
-        cv::resize(image, image, cv::Size(input_shape_[3], input_shape_[2]));
+    tl::expected<Ort::Value, std::string> ImagePreprocessor::preprocess_batch(std::span<const cv::Mat> images) const noexcept
+    {
+        auto logger = Logger::get_logger();
 
-        // Convert BGR to RGB
-        cv::cvtColor(image, image, cv::COLOR_BGR2RGB);
+        TraceSpan span("preprocess", "preprocess");
+        std::vector<int64_t> batch_shape = input_shape_;
+        batch_shape[0] = static_cast<int64_t>(images.size());
+        const size_t image_size = static_cast<size_t>(input_shape_[1] * input_shape_[2] * input_shape_[3]);
 
-        // Normalize image
-        image = normalize_image(image);
+        try
+        {
+            // The tensor owns its buffer, so it stays valid after this returns and every image is written in place
+            Ort::AllocatorWithDefaultOptions allocator;
+            Ort::Value input_tensor = Ort::Value::CreateTensor<float>(allocator, batch_shape.data(), batch_shape.size());
+            float *input_data = input_tensor.GetTensorMutableData<float>();
 
-        // Convert HWC to CHW
-        std::vector<float> input_data = hwc_to_chw(image);
+            const cv::Size input_size(input_shape_[3], input_shape_[2]);
+            cv::Mat resized;
+            cv::Mat image;
+            for (size_t i = 0; i < images.size(); ++i)
+            {
+                // Resize image (unless a decode worker already did)
+                const cv::Mat *source = &images[i];
+                if (images[i].size() != input_size)
+                {
+                    StageTimer timer(Stage::resize);
+                    cv::resize(images[i], resized, input_size);
+                    source = &resized;
+                }
 
-        // Create ONNX tensor
-        Ort::MemoryInfo memory_info = Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
-        Ort::Value input_tensor = Ort::Value::CreateTensor<float>(
-            memory_info, input_data.data(), input_data.size(), input_shape_.data(), input_shape_.size());
+                StageTimer normalize_timer(Stage::normalize);
+                // Convert BGR to RGB; never in place, source may be the caller's image
+                cv::cvtColor(*source, image, cv::COLOR_BGR2RGB);
 
-        logger->info("Image preprocessed successfully: {}", image_path);
-        return input_tensor;
+                // Normalize image
+                image = normalize_image(image);
+                normalize_timer.stop();
+
+                // Convert HWC to CHW
+                StageTimer transpose_timer(Stage::hwc_to_chw);
+                hwc_to_chw(image, input_data + i * image_size);
+            }
+            Metrics::add(Counter::images, images.size());
+            return input_tensor;
+        }
+        catch (const std::exception &ex)
+        {
+            logger->error("Failed to preprocess batch of {} image(s): {}", images.size(), ex.what());
+            return tl::unexpected("Failed to preprocess images: " + std::string(ex.what()));
+        }
+    }
+
+    tl::expected<cv::Mat, std::string> ImagePreprocessor::load_rgb(std::span<const unsigned char> pixels, int width, int height, size_t stride) const noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        const size_t row_bytes = static_cast<size_t>(width) * 3;
+        if (width <= 0 || height <= 0 || stride < row_bytes || pixels.size() < stride * static_cast<size_t>(height - 1) + row_bytes)
+        {
+            CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::err, Logger::request_errors_per_second, "Invalid raw RGB frame: {}x{}, stride {}, {} bytes", width, height, stride, pixels.size());
+            return tl::unexpected(std::format("Invalid raw RGB frame: {}x{}, stride {}, {} bytes", width, height, stride, pixels.size()));
+        }
+
+        StageTimer timer(Stage::image_decode);
+        try
+        {
+            const cv::Mat frame(height, width, CV_8UC3, const_cast<unsigned char *>(pixels.data()), stride);
+            const cv::Size input_size(input_shape_[3], input_shape_[2]);
+            cv::Mat image;
+            if (frame.size() != input_size)
+            {
+                // Shrink first so the channel swap only touches input-sized pixels
+                cv::resize(frame, image, input_size);
+                cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+            }
+            else
+            {
+                cv::cvtColor(frame, image, cv::COLOR_RGB2BGR);
+            }
+            return image;
+        }
+        catch (const cv::Exception &ex)
+        {
+            CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::err, Logger::request_errors_per_second, "Failed to convert raw RGB frame: {}", ex.what());
+            return tl::unexpected("Failed to convert raw RGB frame: " + std::string(ex.what()));
+        }
+    }
+
+    cv::Mat ImagePreprocessor::resize_to_input(const cv::Mat &image) const noexcept
+    {
+        const cv::Size input_size(input_shape_[3], input_shape_[2]);
+        if (image.size() == input_size)
+        {
+            return image;
+        }
+        cv::Mat resized;
+        StageTimer timer(Stage::resize);
+        try
+        {
+            cv::resize(image, resized, input_size);
+        }
+        catch (const cv::Exception &ex)
+        {
+            // preprocess_batch resizes (and reports) whatever is left at the wrong size
+            CAPTIONING_LOG_RATE_LIMITED(Logger::get_logger(), spdlog::level::warn, Logger::request_errors_per_second, "Failed to resize image: {}", ex.what());
+            return image;
+        }
+        return resized;
     }
 
     cv::Mat ImagePreprocessor::normalize_image(const cv::Mat &image) const noexcept
@@ -66,21 +206,19 @@ namespace captioning
         return normalized_image;
     }
 
-    std::vector<float> ImagePreprocessor::hwc_to_chw(const cv::Mat &image) const noexcept
+    void ImagePreprocessor::hwc_to_chw(const cv::Mat &image, float *chw) const noexcept
     {
-        std::vector<float> input_data(input_shape_[1] * input_shape_[2] * input_shape_[3]);
         for (int c = 0; c < input_shape_[1]; ++c)
         {
             for (int h = 0; h < input_shape_[2]; ++h)
             {
                 for (int w = 0; w < input_shape_[3]; ++w)
                 {
-                    input_data[c * input_shape_[2] * input_shape_[3] + h * input_shape_[3] + w] =
+                    chw[c * input_shape_[2] * input_shape_[3] + h * input_shape_[3] + w] =
                         image.at<cv::Vec3f>(h, w)[c];
                 }
             }
         }
-        return input_data;
     }
 
 }
\ No newline at end of file
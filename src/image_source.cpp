@@ -0,0 +1,102 @@
+#include <fstream>
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <glob.h>
+
+#include "image_source.hpp"
+#include "logger.hpp"
+#include "expected.hpp"
+
+namespace captioning
+{
+    tl::expected<std::vector<std::string>, std::string> ImageSource::collect(const std::filesystem::path &source) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        try
+        {
+            std::vector<std::string> paths;
+            if (is_glob(source.string()) && !std::filesystem::exists(source))
+            {
+                glob_t matches{};
+                int status = ::glob(source.c_str(), 0, nullptr, &matches);
+                if (status == 0)
+                {
+                    for (size_t i = 0; i < matches.gl_pathc; ++i)
+                    {
+                        if (std::filesystem::is_regular_file(matches.gl_pathv[i]))
+                        {
+                            paths.emplace_back(matches.gl_pathv[i]);
+                        }
+                    }
+                }
+                ::globfree(&matches);
+                if (status != 0 && status != GLOB_NOMATCH)
+                {
+                    logger->error("Failed to expand pattern {}", source.string());
+                    return tl::unexpected("Failed to expand pattern " + source.string());
+                }
+                // glob() already sorts its matches
+            }
+            else if (std::filesystem::is_directory(source))
+            {
+                for (const auto &entry : std::filesystem::directory_iterator(source))
+                {
+                    if (entry.is_regular_file() && is_image_file(entry.path()))
+                    {
+                        paths.push_back(entry.path().string());
+                    }
+                }
+                std::ranges::sort(paths);
+            }
+            else
+            {
+                std::ifstream manifest(source);
+                if (!manifest.is_open())
+                {
+                    logger->error("Failed to open image source: {}", source.string());
+                    return tl::unexpected("Failed to open image source: " + source.string());
+                }
+                for (std::string line; std::getline(manifest, line);)
+                {
+                    if (!line.empty() && line.back() == '\r')
+                    {
+                        line.pop_back();
+                    }
+                    if (!line.empty() && line.front() != '#')
+                    {
+                        paths.push_back(std::move(line));
+                    }
+                }
+            }
+
+            if (paths.empty())
+            {
+                logger->error("No images found in {}", source.string());
+                return tl::unexpected("No images found in " + source.string());
+            }
+            return paths;
+        }
+        catch (const std::exception &ex)
+        {
+            logger->error("Failed to list images in {}: {}", source.string(), ex.what());
+            return tl::unexpected("Failed to list images in " + source.string() + ": " + ex.what());
+        }
+    }
+
+    bool ImageSource::is_glob(std::string_view source) noexcept
+    {
+        return source.find_first_of("*?[") != std::string_view::npos;
+    }
+
+    bool ImageSource::is_image_file(const std::filesystem::path &path) noexcept
+    {
+        static constexpr std::array<std::string_view, 6> extensions{".jpg", ".jpeg", ".png", ".bmp", ".webp", ".tiff"};
+
+        std::string extension = path.extension().string();
+        std::ranges::transform(extension, extension.begin(), [](unsigned char c)
+                               { return static_cast<char>(std::tolower(c)); });
+        return std::ranges::find(extensions, extension) != extensions.end();
+    }
+}
@@ -1,6 +1,11 @@
+#include <spdlog/async.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/sinks/rotating_file_sink.h>
+#include <unistd.h>
+#include <filesystem>
 #include <iostream>
+#include <mutex>
+#include <vector>
 
 #include "logger.hpp"
 
@@ -8,33 +13,114 @@ namespace captioning
 {
     std::shared_ptr<spdlog::logger> Logger::logger_ = nullptr;
 
-    void Logger::init(const std::string &log_file) noexcept
+    namespace
+    {
+        std::vector<spdlog::sink_ptr> sinks;
+        std::string file_path;
+        std::shared_ptr<spdlog::details::thread_pool> writer;
+        // Loggers replaced by set_mode; kept so that pointers from get_logger never dangle
+        std::vector<std::shared_ptr<spdlog::logger>> retired;
+
+        spdlog::sink_ptr make_file_sink(const std::string &log_file)
+        {
+            std::shared_ptr<spdlog::sinks::rotating_file_sink_mt> file_sink = std::make_shared<spdlog::sinks::rotating_file_sink_mt>(log_file, 1024 * 1024 * 5, 3);
+            file_sink->set_level(spdlog::level::debug);
+            return file_sink;
+        }
+    }
+
+    void Logger::init(const std::string &log_file, Mode mode) noexcept
     {
         try
         {
             std::shared_ptr<spdlog::sinks::stdout_color_sink_mt> console_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
             console_sink->set_level(spdlog::level::info);
 
-            std::shared_ptr<spdlog::sinks::rotating_file_sink_mt> file_sink = std::make_shared<spdlog::sinks::rotating_file_sink_mt>(log_file, 1024 * 1024 * 5, 3);
-            file_sink->set_level(spdlog::level::debug);
+            sinks = {console_sink, make_file_sink(log_file)};
+            file_path = log_file;
+            set_mode(mode);
+        }
+        catch (const spdlog::spdlog_ex &ex)
+        {
+            std::cerr << "Logger initialization failed: " << ex.what() << std::endl;
+        }
+    }
+
+    void Logger::set_mode(Mode mode) noexcept
+    {
+        try
+        {
+            std::shared_ptr<spdlog::logger> logger;
+            std::shared_ptr<spdlog::details::thread_pool> previous_writer = std::move(writer);
+            if (mode == Mode::asynchronous)
+            {
+                writer = std::make_shared<spdlog::details::thread_pool>(async_queue_size, 1);
+                logger = std::make_shared<spdlog::async_logger>("captioning", sinks.begin(), sinks.end(), writer, spdlog::async_overflow_policy::overrun_oldest);
+            }
+            else
+            {
+                logger = std::make_shared<spdlog::logger>("captioning", sinks.begin(), sinks.end());
+            }
+            logger->set_level(spdlog::level::debug);
+            logger->flush_on(spdlog::level::err);
 
-            logger_ = std::make_shared<spdlog::logger>("captioning", spdlog::sinks_init_list{console_sink, file_sink});
-            logger_->set_level(spdlog::level::debug);
+            if (logger_)
+            {
+                retired.push_back(std::move(logger_));
+            }
+            logger_ = std::move(logger);
             spdlog::set_default_logger(logger_);
+            // The previous writer thread finishes what it had queued before it is joined
+            previous_writer.reset();
         }
-        catch (const spdlog::spdlog_ex &ex)
+        catch (const std::exception &ex)
         {
             std::cerr << "Logger initialization failed: " << ex.what() << std::endl;
         }
     }
 
-    std::shared_ptr<spdlog::logger> Logger::get_logger() noexcept
+    void Logger::use_process_file() noexcept
+    {
+        if (sinks.size() < 2)
+        {
+            return;
+        }
+        try
+        {
+            std::filesystem::path path(file_path);
+            path.replace_filename(path.stem().string() + "." + std::to_string(::getpid()) + path.extension().string());
+            sinks.back() = make_file_sink(path.string());
+            set_mode(writer ? Mode::asynchronous : Mode::synchronous);
+        }
+        catch (const std::exception &ex)
+        {
+            std::cerr << "Failed to open the process log file: " << ex.what() << std::endl;
+        }
+    }
+
+    void Logger::shutdown() noexcept
     {
-        if (!logger_)
+        if (writer)
         {
-            init();
+            set_mode(Mode::synchronous);
         }
-        return logger_;
+        if (logger_)
+        {
+            logger_->flush();
+        }
+    }
+
+    spdlog::logger *Logger::get_logger() noexcept
+    {
+        // Worker threads may be the first to log; only one of them may run the default init
+        static std::once_flag default_init;
+        std::call_once(default_init, []
+                       {
+                           if (!logger_)
+                           {
+                               init();
+                           } });
+        return logger_.get();
     }
 
-}
\ No newline at end of file
+}
@@ -1,16 +1,433 @@
 #include <iostream>
+#include <fstream>
 #include <filesystem>
+#include <charconv>
+#include <csignal>
 #include <format>
+#include <string_view>
+#include <utility>
+#include <thread>
+#include <algorithm>
 
 #include "config.hpp"
+#include "batch_runner.hpp"
+#include "caption_server.hpp"
+#include "sidecar_server.hpp"
+#include "prefork_daemon.hpp"
 #include "caption_generator.hpp"
+#include "reloadable_generator.hpp"
+#include "image_source.hpp"
+#include "variant_comparison.hpp"
+#include "vocabulary.hpp"
 #include "logger.hpp"
+#include "tracing.hpp"
+
+namespace
+{
+    void print_usage(const char *program)
+    {
+        std::cerr << std::format("Usage: {} <config_path> <image_path>", program) << std::endl;
+        std::cerr << std::format("       {} compare <config_path> <image_dir|manifest> <candidate_variant> [baseline_variant]", program) << std::endl;
+        std::cerr << std::format("       {} batch <config_path> <image_dir|glob|manifest> [--output file.jsonl] [--workers N] [--unordered]", program) << std::endl;
+        std::cerr << std::format("       {} serve <config_path> [--host addr] [--port N]", program) << std::endl;
+        std::cerr << std::format("       {} sidecar <config_path> [--socket path]", program) << std::endl;
+        std::cerr << std::format("       {} daemon <config_path> [--workers N] [--sidecar] [--host addr] [--port N] [--socket path]", program) << std::endl;
+        std::cerr << std::format("       {} convert-vocab <vocab.json> <vocab.bin>", program) << std::endl;
+    }
+
+    // Called before any thread starts, so every thread inherits the mask and only serve_until_stopped sees
+    // SIGINT/SIGTERM/SIGHUP/SIGUSR1
+    sigset_t block_control_signals() noexcept
+    {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        sigaddset(&signals, SIGHUP);
+        sigaddset(&signals, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        return signals;
+    }
+
+    void write_trace() noexcept
+    {
+        if (auto error = captioning::Tracing::write(); !error.empty())
+        {
+            std::cerr << std::format("Error: {}", error) << std::endl;
+        }
+    }
+
+    // Reloads the generator on each SIGHUP and writes the trace on each SIGUSR1 until SIGINT or SIGTERM arrives
+    void serve_until_stopped(const sigset_t &signals, captioning::ReloadableGenerator &generators) noexcept
+    {
+        int signal = 0;
+        while (sigwait(&signals, &signal) == 0 && (signal == SIGHUP || signal == SIGUSR1))
+        {
+            if (signal == SIGUSR1)
+            {
+                write_trace();
+            }
+            else if (auto error = generators.reload(); !error.empty())
+            {
+                std::cerr << std::format("Reload rejected, still serving the previous model: {}", error) << std::endl;
+            }
+        }
+        std::cerr << "Shutting down" << std::endl;
+    }
+
+    int run_compare(int argc, char *argv[])
+    {
+        if (argc != 5 && argc != 6)
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        auto config = captioning::Config::from_file(argv[2]);
+        if (!config)
+        {
+            std::cerr << std::format("Error: {}", config.error()) << std::endl;
+            return 1;
+        }
+
+        auto image_paths = captioning::ImageSource::collect(argv[3]);
+        if (!image_paths)
+        {
+            std::cerr << std::format("Error: {}", image_paths.error()) << std::endl;
+            return 1;
+        }
+
+        std::string candidate = argv[4];
+        std::string baseline = argc == 6 ? argv[5] : "default";
+        auto report = captioning::VariantComparison::run(*config, baseline, candidate, *image_paths);
+        if (!report)
+        {
+            std::cerr << std::format("Error: {}", report.error()) << std::endl;
+            return 1;
+        }
+
+        std::cout << report->to_string() << std::endl;
+        return 0;
+    }
+
+    int run_batch(int argc, char *argv[])
+    {
+        if (argc < 4)
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        captioning::BatchRunOptions options;
+        options.decode_workers = static_cast<int>(std::max(1u, std::thread::hardware_concurrency() / 2));
+        options.progress = &std::cerr;
+        std::string output_path;
+        for (int i = 4; i < argc; ++i)
+        {
+            std::string_view arg = argv[i];
+            if (arg == "--unordered")
+            {
+                options.ordered = false;
+            }
+            else if (arg == "--output" && i + 1 < argc)
+            {
+                output_path = argv[++i];
+            }
+            else if (arg == "--workers" && i + 1 < argc)
+            {
+                std::string_view value = argv[++i];
+                auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), options.decode_workers);
+                if (error != std::errc() || end != value.data() + value.size() || options.decode_workers <= 0)
+                {
+                    std::cerr << std::format("Error: invalid worker count {}", value) << std::endl;
+                    return 1;
+                }
+            }
+            else
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+
+        auto config = captioning::Config::from_file(argv[2]);
+        if (!config)
+        {
+            std::cerr << std::format("Error: {}", config.error()) << std::endl;
+            return 1;
+        }
+        options.batch_size = config->max_batch_size();
+
+        auto image_paths = captioning::ImageSource::collect(argv[3]);
+        if (!image_paths)
+        {
+            std::cerr << std::format("Error: {}", image_paths.error()) << std::endl;
+            return 1;
+        }
+
+        auto generator = captioning::CaptionGenerator::create(*config);
+        if (!generator)
+        {
+            std::cerr << std::format("Error: {}", generator.error()) << std::endl;
+            return 1;
+        }
+
+        std::ofstream output_file;
+        if (!output_path.empty())
+        {
+            output_file.open(output_path);
+            if (!output_file.is_open())
+            {
+                std::cerr << std::format("Error: failed to open {}", output_path) << std::endl;
+                return 1;
+            }
+        }
+        std::ostream &out = output_path.empty() ? std::cout : output_file;
+
+        auto summary = captioning::BatchRunner::run(*generator, *image_paths, options, out);
+        if (!summary)
+        {
+            std::cerr << std::format("Error: {}", summary.error()) << std::endl;
+            return 1;
+        }
+
+        std::cerr << summary->to_string() << std::endl;
+        std::cerr << summary->metrics.to_table(summary->wall_seconds) << std::endl;
+        return summary->failures == 0 ? 0 : 2;
+    }
+
+    int run_serve(int argc, char *argv[])
+    {
+        if (argc < 3)
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        auto config = captioning::Config::from_file(argv[2]);
+        if (!config)
+        {
+            std::cerr << std::format("Error: {}", config.error()) << std::endl;
+            return 1;
+        }
+
+        captioning::HttpServerOptions http_options;
+        http_options.host = config->server_host();
+        http_options.port = config->server_port();
+        http_options.threads = config->server_threads();
+        http_options.max_body_bytes = config->server_max_body_bytes();
+        for (int i = 3; i < argc; ++i)
+        {
+            std::string_view arg = argv[i];
+            if (arg == "--host" && i + 1 < argc)
+            {
+                http_options.host = argv[++i];
+            }
+            else if (arg == "--port" && i + 1 < argc)
+            {
+                std::string_view value = argv[++i];
+                auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), http_options.port);
+                if (error != std::errc() || end != value.data() + value.size() || http_options.port < 0 || http_options.port > 65535)
+                {
+                    std::cerr << std::format("Error: invalid port {}", value) << std::endl;
+                    return 1;
+                }
+            }
+            else
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+
+        sigset_t signals = block_control_signals();
+
+        auto generators = captioning::ReloadableGenerator::create(argv[2]);
+        if (!generators)
+        {
+            std::cerr << std::format("Error: {}", generators.error()) << std::endl;
+            return 1;
+        }
+
+        auto server = captioning::CaptionServer::start(**generators, *config, http_options, config->server_reload_endpoint());
+        if (!server)
+        {
+            std::cerr << std::format("Error: {}", server.error()) << std::endl;
+            return 1;
+        }
+        std::cerr << std::format("Serving captions on http://{}:{}/caption", http_options.host, (*server)->port()) << std::endl;
+
+        serve_until_stopped(signals, **generators);
+        (*server)->stop();
+        return 0;
+    }
+
+    int run_sidecar(int argc, char *argv[])
+    {
+        if (argc != 3 && !(argc == 5 && std::string_view(argv[3]) == "--socket"))
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        auto config = captioning::Config::from_file(argv[2]);
+        if (!config)
+        {
+            std::cerr << std::format("Error: {}", config.error()) << std::endl;
+            return 1;
+        }
+        std::string socket_path = argc == 5 ? argv[4] : config->sidecar_socket();
+
+        sigset_t signals = block_control_signals();
+
+        auto generators = captioning::ReloadableGenerator::create(argv[2]);
+        if (!generators)
+        {
+            std::cerr << std::format("Error: {}", generators.error()) << std::endl;
+            return 1;
+        }
+
+        auto sidecar = captioning::SidecarServer::start(**generators, socket_path, config->server_max_body_bytes());
+        if (!sidecar)
+        {
+            std::cerr << std::format("Error: {}", sidecar.error()) << std::endl;
+            return 1;
+        }
+        std::cerr << std::format("Sidecar listening on {}", socket_path) << std::endl;
+
+        serve_until_stopped(signals, **generators);
+        (*sidecar)->stop();
+        return 0;
+    }
+
+    int run_daemon(int argc, char *argv[])
+    {
+        if (argc < 3)
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        auto config = captioning::Config::from_file(argv[2]);
+        if (!config)
+        {
+            std::cerr << std::format("Error: {}", config.error()) << std::endl;
+            return 1;
+        }
+
+        captioning::DaemonOptions options;
+        options.config_path = argv[2];
+        options.workers = config->daemon_workers() > 0 ? config->daemon_workers() : static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        options.pin_workers = config->daemon_pin_workers();
+        options.http.host = config->server_host();
+        options.http.port = config->server_port();
+        options.http.threads = config->server_threads();
+        options.http.max_body_bytes = config->server_max_body_bytes();
+        options.socket_path = config->sidecar_socket();
+        options.max_image_bytes = config->server_max_body_bytes();
+        for (int i = 3; i < argc; ++i)
+        {
+            std::string_view arg = argv[i];
+            if (arg == "--sidecar")
+            {
+                options.sidecar = true;
+                continue;
+            }
+            if (i + 1 >= argc)
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+            std::string_view value = argv[++i];
+            if (arg == "--host")
+            {
+                options.http.host = value;
+            }
+            else if (arg == "--socket")
+            {
+                options.socket_path = value;
+            }
+            else if (arg == "--workers" || arg == "--port")
+            {
+                int &number = arg == "--workers" ? options.workers : options.http.port;
+                auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), number);
+                if (error != std::errc() || end != value.data() + value.size() || number < 0 || (arg == "--workers" && number == 0) || number > 65535)
+                {
+                    std::cerr << std::format("Error: invalid {} {}", arg.substr(2), value) << std::endl;
+                    return 1;
+                }
+            }
+            else
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+
+        return captioning::PreforkDaemon::run(*config, options);
+    }
+
+    int run_convert_vocab(int argc, char *argv[])
+    {
+        if (argc != 4)
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        auto vocab = captioning::Vocabulary::from_file(argv[2]);
+        if (!vocab)
+        {
+            std::cerr << std::format("Error: {}", vocab.error()) << std::endl;
+            return 1;
+        }
+        if (auto error = vocab->write_binary(argv[3]); !error.empty())
+        {
+            std::cerr << std::format("Error: {}", error) << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+}
 
 int main(int argc, char *argv[])
 {
+    using Command = int (*)(int, char *[]);
+    static constexpr std::pair<std::string_view, Command> commands[] = {
+        {"compare", run_compare},
+        {"batch", run_batch},
+        {"serve", run_serve},
+        {"sidecar", run_sidecar},
+        {"daemon", run_daemon},
+        {"convert-vocab", run_convert_vocab},
+    };
+
+    for (const auto &[name, command] : commands)
+    {
+        if (argc < 2 || name != argv[1])
+        {
+            continue;
+        }
+        try
+        {
+            captioning::Logger::init("captioning.log");
+            const int exit_code = command(argc, argv);
+            if (captioning::Tracing::enabled())
+            {
+                write_trace();
+            }
+            return exit_code;
+        }
+        catch (const std::exception &ex)
+        {
+            std::cerr << std::format("Error: {}", ex.what()) << std::endl;
+            return 1;
+        }
+    }
+
     if (argc != 3)
     {
-        std::cerr << std::format("Usage: {} <config_path> <image_path>", argv[0]) << std::endl;
+        print_usage(argv[0]);
         return 1;
     }
 
@@ -46,6 +463,10 @@ int main(int argc, char *argv[])
         }
 
         std::cout << std::format("Generated Caption: {}", *caption) << std::endl;
+        if (captioning::Tracing::enabled())
+        {
+            write_trace();
+        }
     }
     catch (const std::exception &ex)
     {
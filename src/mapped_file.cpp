@@ -0,0 +1,90 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include "mapped_file.hpp"
+#include "logger.hpp"
+#include "expected.hpp"
+
+namespace captioning
+{
+    tl::expected<MappedFile, std::string> MappedFile::open(const std::filesystem::path &path) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            logger->error("Failed to open {} for mapping: {}", path.string(), std::strerror(errno));
+            return tl::unexpected("Failed to open " + path.string() + ": " + std::strerror(errno));
+        }
+
+        auto mapped = from_fd(fd);
+        // The mapping keeps its own reference to the file
+        ::close(fd);
+        if (!mapped)
+        {
+            logger->error("Failed to map {}: {}", path.string(), mapped.error());
+            return tl::unexpected("Failed to map " + path.string() + ": " + mapped.error());
+        }
+
+        SPDLOG_LOGGER_DEBUG(logger, "Mapped {} ({} bytes)", path.string(), mapped->size());
+        return mapped;
+    }
+
+    tl::expected<MappedFile, std::string> MappedFile::from_fd(int fd) noexcept
+    {
+        struct stat file_stat{};
+        if (::fstat(fd, &file_stat) != 0 || file_stat.st_size <= 0)
+        {
+            return tl::unexpected(std::string("empty or unreadable file"));
+        }
+
+        size_t size = static_cast<size_t>(file_stat.st_size);
+        void *data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            return tl::unexpected(std::string(std::strerror(errno)));
+        }
+        return MappedFile(data, size);
+    }
+
+    MappedFile::MappedFile(void *data, size_t size) noexcept : data_(data), size_(size) {}
+
+    MappedFile::MappedFile(MappedFile &&other) noexcept
+        : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+
+    MappedFile &MappedFile::operator=(MappedFile &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (data_)
+            {
+                ::munmap(data_, size_);
+            }
+            data_ = std::exchange(other.data_, nullptr);
+            size_ = std::exchange(other.size_, 0);
+        }
+        return *this;
+    }
+
+    MappedFile::~MappedFile()
+    {
+        if (data_)
+        {
+            ::munmap(data_, size_);
+        }
+    }
+
+    void MappedFile::prefetch() const noexcept
+    {
+        if (data_)
+        {
+            ::madvise(data_, size_, MADV_WILLNEED);
+        }
+    }
+}
@@ -0,0 +1,388 @@
+#include <bit>
+#include <cmath>
+#include <deque>
+#include <format>
+#include <iterator>
+#include <mutex>
+
+#include "metrics.hpp"
+
+namespace captioning
+{
+    namespace
+    {
+        constexpr size_t counter_count = static_cast<size_t>(Counter::count);
+        constexpr size_t stage_count = static_cast<size_t>(Stage::count);
+        constexpr size_t distribution_count = static_cast<size_t>(Distribution::count);
+        constexpr double quantiles[] = {0.5, 0.9, 0.99};
+
+        // Only its owning thread writes, so increments are a relaxed load and store rather than a locked add
+        void bump(std::atomic<uint64_t> &value, uint64_t amount) noexcept
+        {
+            value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        }
+
+        struct ThreadHistogram
+        {
+            std::array<std::atomic<uint64_t>, HistogramBuckets::bucket_count> buckets{};
+            std::atomic<uint64_t> count = 0;
+            std::atomic<uint64_t> sum = 0;
+
+            void record(uint64_t value) noexcept
+            {
+                bump(buckets[HistogramBuckets::index(value)], 1);
+                bump(count, 1);
+                bump(sum, value);
+            }
+
+            void add_to(HistogramSnapshot &snapshot) const noexcept
+            {
+                for (size_t i = 0; i < buckets.size(); ++i)
+                {
+                    snapshot.buckets[i] += buckets[i].load(std::memory_order_relaxed);
+                }
+                snapshot.count += count.load(std::memory_order_relaxed);
+                snapshot.sum += sum.load(std::memory_order_relaxed);
+            }
+        };
+
+        struct alignas(64) ThreadMetrics
+        {
+            std::array<std::atomic<uint64_t>, counter_count> counters{};
+            std::array<ThreadHistogram, stage_count> stages;
+            std::array<ThreadHistogram, distribution_count> distributions;
+            bool in_use = true;
+        };
+
+        struct Registry
+        {
+            std::mutex mutex;
+            // A deque never moves its elements, so threads keep stable pointers to their blocks
+            std::deque<ThreadMetrics> blocks;
+            std::atomic<int> worker{-1};
+        };
+
+        Registry &registry() noexcept
+        {
+            // Never destroyed: threads still running during static destruction may record or exit
+            static Registry *instance = new Registry;
+            return *instance;
+        }
+
+        struct ThreadSlot
+        {
+            ThreadMetrics *block = nullptr;
+
+            ~ThreadSlot()
+            {
+                if (block)
+                {
+                    std::lock_guard lock(registry().mutex);
+                    block->in_use = false;
+                }
+            }
+        };
+
+        ThreadMetrics &thread_metrics() noexcept
+        {
+            thread_local ThreadSlot slot;
+            if (!slot.block)
+            {
+                Registry &shared = registry();
+                std::lock_guard lock(shared.mutex);
+                for (ThreadMetrics &block : shared.blocks)
+                {
+                    if (!block.in_use)
+                    {
+                        block.in_use = true;
+                        slot.block = &block;
+                        break;
+                    }
+                }
+                if (!slot.block)
+                {
+                    slot.block = &shared.blocks.emplace_back();
+                }
+            }
+            return *slot.block;
+        }
+
+        // Prometheus sample values: plain decimal, shortest round-trip form
+        std::string sample(double value)
+        {
+            return std::format("{}", value);
+        }
+
+        std::string format_duration(double nanoseconds)
+        {
+            if (nanoseconds >= 1e9)
+            {
+                return std::format("{:.2f} s", nanoseconds / 1e9);
+            }
+            if (nanoseconds >= 1e6)
+            {
+                return std::format("{:.2f} ms", nanoseconds / 1e6);
+            }
+            return std::format("{:.1f} us", nanoseconds / 1e3);
+        }
+    }
+
+    size_t HistogramBuckets::index(uint64_t value) noexcept
+    {
+        if (value < sub_buckets)
+        {
+            return static_cast<size_t>(value);
+        }
+        const int shift = std::bit_width(value) - 1 - sub_bucket_bits;
+        return static_cast<size_t>(shift + 1) * sub_buckets + static_cast<size_t>((value >> shift) & (sub_buckets - 1));
+    }
+
+    uint64_t HistogramBuckets::lower_bound(size_t bucket) noexcept
+    {
+        if (bucket < sub_buckets)
+        {
+            return bucket;
+        }
+        const size_t shift = bucket / sub_buckets - 1;
+        return (sub_buckets + bucket % sub_buckets) << shift;
+    }
+
+    uint64_t HistogramBuckets::upper_bound(size_t bucket) noexcept
+    {
+        if (bucket < sub_buckets)
+        {
+            return bucket;
+        }
+        const size_t shift = bucket / sub_buckets - 1;
+        return lower_bound(bucket) + ((uint64_t{1} << shift) - 1);
+    }
+
+    double HistogramSnapshot::quantile(double q) const noexcept
+    {
+        uint64_t total = 0;
+        for (uint64_t bucket : buckets)
+        {
+            total += bucket;
+        }
+        if (total == 0)
+        {
+            return 0.0;
+        }
+
+        // The rank of the wanted value, counting from 1
+        const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * static_cast<double>(total))));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets.size(); ++i)
+        {
+            seen += buckets[i];
+            if (seen >= rank)
+            {
+                return (static_cast<double>(HistogramBuckets::lower_bound(i)) + static_cast<double>(HistogramBuckets::upper_bound(i))) / 2.0;
+            }
+        }
+        return static_cast<double>(HistogramBuckets::upper_bound(buckets.size() - 1));
+    }
+
+    MetricsSnapshot MetricsSnapshot::since(const MetricsSnapshot &earlier) const noexcept
+    {
+        auto subtract = [](HistogramSnapshot &later, const HistogramSnapshot &before)
+        {
+            for (size_t i = 0; i < later.buckets.size(); ++i)
+            {
+                later.buckets[i] -= before.buckets[i];
+            }
+            later.count -= before.count;
+            later.sum -= before.sum;
+        };
+
+        MetricsSnapshot delta = *this;
+        for (size_t i = 0; i < counter_count; ++i)
+        {
+            delta.counters[i] -= earlier.counters[i];
+        }
+        for (size_t i = 0; i < stage_count; ++i)
+        {
+            subtract(delta.stages[i], earlier.stages[i]);
+        }
+        for (size_t i = 0; i < distribution_count; ++i)
+        {
+            subtract(delta.distributions[i], earlier.distributions[i]);
+        }
+        return delta;
+    }
+
+    std::string MetricsSnapshot::to_prometheus() const
+    {
+        std::string text;
+        auto out = std::back_inserter(text);
+        // The worker label on its own, and as the first of several
+        const std::string labels = worker >= 0 ? std::format("{{worker=\"{}\"}}", worker) : "";
+        const std::string first_label = worker >= 0 ? std::format("worker=\"{}\",", worker) : "";
+
+        for (size_t i = 0; i < counter_count; ++i)
+        {
+            const auto name = Metrics::name(static_cast<Counter>(i));
+            std::format_to(out, "# TYPE captioning_{}_total counter\ncaptioning_{}_total{} {}\n", name, name, labels, counters[i]);
+        }
+
+        std::format_to(out, "# HELP captioning_stage_seconds Time spent in each captioning stage\n# TYPE captioning_stage_seconds summary\n");
+        for (size_t i = 0; i < stage_count; ++i)
+        {
+            const auto name = Metrics::name(static_cast<Stage>(i));
+            const HistogramSnapshot &histogram = stages[i];
+            for (double q : quantiles)
+            {
+                std::format_to(out, "captioning_stage_seconds{{{}stage=\"{}\",quantile=\"{}\"}} {}\n", first_label, name, q, sample(histogram.quantile(q) / 1e9));
+            }
+            std::format_to(out, "captioning_stage_seconds_sum{{{}stage=\"{}\"}} {}\n", first_label, name, sample(static_cast<double>(histogram.sum) / 1e9));
+            std::format_to(out, "captioning_stage_seconds_count{{{}stage=\"{}\"}} {}\n", first_label, name, histogram.count);
+        }
+
+        for (size_t i = 0; i < distribution_count; ++i)
+        {
+            const auto name = Metrics::name(static_cast<Distribution>(i));
+            const HistogramSnapshot &histogram = distributions[i];
+            std::format_to(out, "# TYPE captioning_{} summary\n", name);
+            for (double q : quantiles)
+            {
+                std::format_to(out, "captioning_{}{{{}quantile=\"{}\"}} {}\n", name, first_label, q, sample(histogram.quantile(q)));
+            }
+            std::format_to(out, "captioning_{}_sum{} {}\ncaptioning_{}_count{} {}\n", name, labels, histogram.sum, name, labels, histogram.count);
+        }
+        return text;
+    }
+
+    std::string MetricsSnapshot::to_table(double wall_seconds) const
+    {
+        std::string text;
+        auto out = std::back_inserter(text);
+
+        std::format_to(out, "{:<18} {:>10} {:>10} {:>10} {:>10} {:>10}\n", "stage", "count", "mean", "p50", "p99", "total");
+        for (size_t i = 0; i < stage_count; ++i)
+        {
+            const HistogramSnapshot &histogram = stages[i];
+            if (histogram.count == 0)
+            {
+                continue;
+            }
+            std::format_to(out, "{:<18} {:>10} {:>10} {:>10} {:>10} {:>10}\n", Metrics::name(static_cast<Stage>(i)), histogram.count,
+                           format_duration(histogram.mean()), format_duration(histogram.quantile(0.5)), format_duration(histogram.quantile(0.99)),
+                           format_duration(static_cast<double>(histogram.sum)));
+        }
+
+        const uint64_t tokens = counter(Counter::generated_tokens);
+        std::format_to(out, "{} token(s), {:.1f} tokens/s; {:.1f} steps and {:.1f} tokens per caption; {} beam candidate(s) pruned",
+                       tokens, wall_seconds > 0.0 ? static_cast<double>(tokens) / wall_seconds : 0.0,
+                       distribution(Distribution::steps_per_caption).mean(), distribution(Distribution::tokens_per_caption).mean(),
+                       counter(Counter::beams_pruned));
+        return text;
+    }
+
+    void Metrics::add(Counter counter, uint64_t amount) noexcept
+    {
+        bump(thread_metrics().counters[static_cast<size_t>(counter)], amount);
+    }
+
+    void Metrics::record(Stage stage, std::chrono::nanoseconds elapsed) noexcept
+    {
+        thread_metrics().stages[static_cast<size_t>(stage)].record(static_cast<uint64_t>(std::max<int64_t>(0, elapsed.count())));
+    }
+
+    void Metrics::record(Distribution distribution, uint64_t value) noexcept
+    {
+        thread_metrics().distributions[static_cast<size_t>(distribution)].record(value);
+    }
+
+    MetricsSnapshot Metrics::snapshot() noexcept
+    {
+        MetricsSnapshot snapshot;
+        Registry &shared = registry();
+        snapshot.worker = shared.worker.load(std::memory_order_relaxed);
+        // Blocks of exited threads still count; the lock only keeps the deque from growing under the loop
+        std::lock_guard lock(shared.mutex);
+        for (const ThreadMetrics &block : shared.blocks)
+        {
+            for (size_t i = 0; i < counter_count; ++i)
+            {
+                snapshot.counters[i] += block.counters[i].load(std::memory_order_relaxed);
+            }
+            for (size_t i = 0; i < stage_count; ++i)
+            {
+                block.stages[i].add_to(snapshot.stages[i]);
+            }
+            for (size_t i = 0; i < distribution_count; ++i)
+            {
+                block.distributions[i].add_to(snapshot.distributions[i]);
+            }
+        }
+        return snapshot;
+    }
+
+    void Metrics::set_worker(int worker) noexcept
+    {
+        registry().worker.store(worker, std::memory_order_relaxed);
+    }
+
+    std::string_view Metrics::name(Stage stage) noexcept
+    {
+        switch (stage)
+        {
+        case Stage::image_decode:
+            return "image_decode";
+        case Stage::resize:
+            return "resize";
+        case Stage::normalize:
+            return "normalize";
+        case Stage::hwc_to_chw:
+            return "hwc_to_chw";
+        case Stage::session_step:
+            return "session_step";
+        case Stage::candidate_scoring:
+            return "candidate_scoring";
+        case Stage::top_k:
+            return "top_k";
+        case Stage::beam_update:
+            return "beam_update";
+        case Stage::detokenize:
+            return "detokenize";
+        default:
+            return "unknown";
+        }
+    }
+
+    std::string_view Metrics::name(Counter counter) noexcept
+    {
+        switch (counter)
+        {
+        case Counter::images:
+            return "images";
+        case Counter::captions:
+            return "captions";
+        case Counter::decode_failures:
+            return "decode_failures";
+        case Counter::truncated:
+            return "truncated_captions";
+        case Counter::decode_steps:
+            return "decode_steps";
+        case Counter::generated_tokens:
+            return "generated_tokens";
+        case Counter::beams_pruned:
+            return "beams_pruned";
+        default:
+            return "unknown";
+        }
+    }
+
+    std::string_view Metrics::name(Distribution distribution) noexcept
+    {
+        switch (distribution)
+        {
+        case Distribution::steps_per_caption:
+            return "steps_per_caption";
+        case Distribution::tokens_per_caption:
+            return "tokens_per_caption";
+        default:
+            return "unknown";
+        }
+    }
+}
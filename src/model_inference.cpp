@@ -1,27 +1,120 @@
 #include <algorithm>
-#include <queue>
+#include <iterator>
 #include <stdexcept>
 #include <ranges>
+#include <filesystem>
+#include <limits>
+#include <numeric>
+#include <cmath>
 
 #include "model_inference.hpp"
+#include "session_resources.hpp"
 #include "expected.hpp"
 #include "logger.hpp"
+#include "metrics.hpp"
 
 namespace captioning
 {
-    tl::expected<ModelInference, std::string> ModelInference::create(const std::string &model_path, std::vector<int64_t> input_shape) noexcept
+    namespace
     {
-        auto logger = Logger::get_logger();
+        void log_softmax(std::span<float> scores) noexcept
+        {
+            float max_score = -std::numeric_limits<float>::infinity();
+            for (float score : scores)
+            {
+                max_score = std::max(max_score, score);
+            }
+            float sum = 0.0f;
+            for (float score : scores)
+            {
+                sum += std::exp(score - max_score);
+            }
+            const float log_normalizer = max_score + std::log(sum);
+            for (float &score : scores)
+            {
+                score -= log_normalizer;
+            }
+        }
 
-        Ort::Env env(ORT_LOGGING_LEVEL_WARNING, "image_captioning");
-        Ort::SessionOptions session_options;
-        session_options.SetIntraOpNumThreads(1);
-        session_options.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+        std::string element_type_name(ONNXTensorElementDataType type) noexcept
+        {
+            switch (type)
+            {
+            case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT:
+                return "float32";
+            case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16:
+                return "float16";
+            case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT8:
+                return "int8";
+            case ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT8:
+                return "uint8";
+            case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT32:
+                return "int32";
+            case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64:
+                return "int64";
+            default:
+                return "type " + std::to_string(static_cast<int>(type));
+            }
+        }
+    }
 
+    tl::expected<ModelInference, std::string> ModelInference::create(const Config &config, std::vector<MappedFile> mappings) noexcept
+    {
+        auto logger = Logger::get_logger();
+        const std::string model_path = config.model_path();
+
+        std::unique_ptr<Ort::PrepackedWeightsContainer> prepacked;
         std::unique_ptr<Ort::Session> session;
         try
         {
-            session = std::make_unique<Ort::Session>(env, model_path.c_str(), session_options);
+            Ort::Env &env = SessionResources::env();
+            Ort::SessionOptions session_options;
+            session_options.SetIntraOpNumThreads(1);
+            session_options.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+            if (config.model_quantized())
+            {
+                // Keep QDQ node units as int8 kernels on x86 instead of falling back to float
+                session_options.AddConfigEntry("session.qdqisint8allowed", "1");
+            }
+            if (const std::string profile_prefix = Tracing::onnxruntime_profile_prefix(); !profile_prefix.empty())
+            {
+                session_options.EnableProfiling(profile_prefix.c_str());
+            }
+            if (config.use_shared_allocator())
+            {
+                SessionResources::register_shared_allocator();
+                session_options.AddConfigEntry("session.use_env_allocators", "1");
+            }
+
+            const void *model_data = nullptr;
+            size_t model_size = 0;
+            if (config.model_load_mode() == "mmap")
+            {
+                if (mappings.empty())
+                {
+                    auto mapped = map_model_files(config);
+                    if (!mapped)
+                    {
+                        return tl::unexpected(mapped.error());
+                    }
+                    mappings = std::move(*mapped);
+                }
+                use_mapped_model(config, mappings, session_options);
+                model_data = mappings.front().data();
+                model_size = mappings.front().size();
+            }
+
+            if (config.share_prepacked_weights())
+            {
+                prepacked = std::make_unique<Ort::PrepackedWeightsContainer>();
+                session = model_data ? std::make_unique<Ort::Session>(env, model_data, model_size, session_options, *prepacked)
+                                     : std::make_unique<Ort::Session>(env, model_path.c_str(), session_options, *prepacked);
+            }
+            else
+            {
+                session = model_data ? std::make_unique<Ort::Session>(env, model_data, model_size, session_options)
+                                     : std::make_unique<Ort::Session>(env, model_path.c_str(), session_options);
+            }
         }
         catch (const Ort::Exception &ex)
         {
@@ -29,134 +122,571 @@ namespace captioning
             return tl::unexpected("Failed to load ONNX model: " + std::string(ex.what()));
         }
 
+        if (auto error = verify_signature(*session, config); !error.empty())
+        {
+            logger->error("Model {} ({} variant) rejected: {}", model_path, config.model_variant(), error);
+            return tl::unexpected("Model " + model_path + " rejected: " + error);
+        }
+
+        std::optional<OutputProjection> projection;
+        if (const auto &settings = config.output_projection())
+        {
+            if (auto error = attach_projection(*session, *settings, projection); !error.empty())
+            {
+                logger->error("Failed to set up output projection: {}", error);
+                return tl::unexpected("Failed to set up output projection: " + error);
+            }
+        }
+
         Ort::AllocatorWithDefaultOptions allocator;
         Ort::AllocatedStringPtr input_name_ptr = session->GetInputNameAllocated(0, allocator);
         std::string input_name = input_name_ptr.get();
+        // verify_signature checked the rank, so the batch dimension is there
+        const bool supports_batching = session->GetInputTypeInfo(0).GetTensorTypeAndShapeInfo().GetShape()[0] <= 0;
 
         Ort::AllocatedStringPtr output_name_ptr = session->GetOutputNameAllocated(0, allocator);
-        std::string output_name = output_name_ptr.get();
+        std::string output_name = projection ? config.output_projection()->hidden_output : output_name_ptr.get();
 
-        logger->info("Model loaded successfully: {}", model_path);
-        return ModelInference(std::move(session), std::move(input_name), std::move(output_name), std::move(input_shape));
+        logger->info("Model loaded successfully: {} ({} variant, {})", model_path, config.model_variant(), config.model_precision());
+        ModelInference model(std::move(prepacked), std::move(session), std::move(input_name), std::move(output_name), config.input_shape(), std::move(mappings));
+        model.supports_batching_ = supports_batching;
+        if (Tracing::enabled() && !Tracing::onnxruntime_profile_prefix().empty())
+        {
+            model.profiled_session_ = ProfiledSession(*model.session_);
+        }
+        if (projection)
+        {
+            const auto &settings = *config.output_projection();
+            int frequent = std::min(settings.frequent_tokens, static_cast<int>(projection->vocab_size()));
+            model.frequent_ids_.resize(frequent);
+            std::iota(model.frequent_ids_.begin(), model.frequent_ids_.end(), 0);
+            model.shortlist_size_ = settings.shortlist_size;
+            model.projection_ = std::move(projection);
+        }
+        return model;
     }
 
-    ModelInference::ModelInference(std::unique_ptr<Ort::Session> session, std::string input_name, std::string output_name, std::vector<int64_t> input_shape) noexcept
-        : session_(std::move(session)), input_name_(std::move(input_name)), output_name_(std::move(output_name)), input_shape_(std::move(input_shape)) {}
+    ModelInference::ModelInference(std::unique_ptr<Ort::PrepackedWeightsContainer> prepacked_weights, std::unique_ptr<Ort::Session> session, std::string input_name, std::string output_name, std::vector<int64_t> input_shape, std::vector<MappedFile> mappings) noexcept
+        : mappings_(std::move(mappings)), prepacked_weights_(std::move(prepacked_weights)), session_(std::move(session)), input_name_(std::move(input_name)), output_name_(std::move(output_name)), input_shape_(std::move(input_shape)) {}
 
-    tl::expected<std::vector<int>, std::string> ModelInference::run(Ort::Value &input_tensor, int max_length, int beam_width, const Vocabulary &vocab) noexcept
+    tl::expected<std::vector<MappedFile>, std::string> ModelInference::map_model_files(const Config &config) noexcept
     {
         auto logger = Logger::get_logger();
+        const std::filesystem::path model_path = config.model_path();
+
+        std::vector<MappedFile> mappings;
+        auto model_file = MappedFile::open(model_path);
+        if (!model_file)
+        {
+            return tl::unexpected("Failed to load ONNX model: " + model_file.error());
+        }
+        model_file->prefetch();
+        mappings.push_back(std::move(*model_file));
+
+        for (const auto &file_name : config.model_external_data())
+        {
+            auto data_file = MappedFile::open(model_path.parent_path() / file_name);
+            if (!data_file)
+            {
+                return tl::unexpected("Failed to load external initializers: " + data_file.error());
+            }
+            data_file->prefetch();
+            mappings.push_back(std::move(*data_file));
+        }
+
+        logger->info("Mapped model {} with {} external initializer file(s)", model_path.string(), mappings.size() - 1);
+        return mappings;
+    }
+
+    void ModelInference::use_mapped_model(const Config &config, const std::vector<MappedFile> &mappings, Ort::SessionOptions &session_options)
+    {
+        if (std::filesystem::path(config.model_path()).extension() == ".ort")
+        {
+            // ORT-format models can run straight off the mapped bytes, initializers included, so the weights
+            // stay in shared page cache instead of being copied into each process's heap.
+            session_options.AddConfigEntry("session.use_ort_model_bytes_directly", "1");
+            session_options.AddConfigEntry("session.use_ort_model_bytes_for_initializers", "1");
+        }
+
+        // mappings hold the model, then model_external_data in order
+        const auto external_data = config.model_external_data();
+        std::vector<std::string> file_names;
+        std::vector<char *> buffers;
+        std::vector<size_t> lengths;
+        for (size_t i = 0; i < external_data.size() && i + 1 < mappings.size(); ++i)
+        {
+            file_names.push_back(external_data[i]);
+            // ORT only reads through these pointers; the C API just isn't const-correct
+            buffers.push_back(const_cast<char *>(mappings[i + 1].data()));
+            lengths.push_back(mappings[i + 1].size());
+        }
+        if (!file_names.empty())
+        {
+            session_options.AddExternalInitializersFromFilesInMemory(file_names, buffers, lengths);
+        }
+    }
+
+    std::string ModelInference::attach_projection(const Ort::Session &session, const OutputProjectionSettings &settings, std::optional<OutputProjection> &projection) noexcept
+    {
         try
         {
-            auto token_ids = beam_search(input_tensor, max_length, beam_width, vocab);
-            if (token_ids.empty())
+            Ort::AllocatorWithDefaultOptions allocator;
+            for (size_t i = 0; i < session.GetOutputCount(); ++i)
             {
-                logger->warn("No valid caption generated");
-                return tl::unexpected("No valid caption generated");
+                if (settings.hidden_output != session.GetOutputNameAllocated(i, allocator).get())
+                {
+                    continue;
+                }
+
+                auto loaded = OutputProjection::load(settings.weights_path);
+                if (!loaded)
+                {
+                    return loaded.error();
+                }
+                auto hidden_dims = session.GetOutputTypeInfo(i).GetTensorTypeAndShapeInfo().GetShape();
+                if (!hidden_dims.empty() && hidden_dims.back() > 0 && static_cast<size_t>(hidden_dims.back()) != loaded->hidden_size())
+                {
+                    return "hidden output " + settings.hidden_output + " has size " + std::to_string(hidden_dims.back()) +
+                           ", projection weights expect " + std::to_string(loaded->hidden_size());
+                }
+                projection = std::move(*loaded);
+                return {};
             }
-            return token_ids;
+            return "model has no output named " + settings.hidden_output;
         }
-        catch (const std::exception &ex)
+        catch (const Ort::Exception &ex)
+        {
+            return ex.what();
+        }
+    }
+
+    std::string ModelInference::check_vocabulary(const Vocabulary &vocab) const noexcept
+    {
+        if (projection_ && projection_->vocab_size() != vocab.size())
+        {
+            return "Output projection covers " + std::to_string(projection_->vocab_size()) + " tokens but the vocabulary has " + std::to_string(vocab.size());
+        }
+        return {};
+    }
+
+    std::string ModelInference::verify_signature(const Ort::Session &session, const Config &config) noexcept
+    {
+        try
+        {
+            if (session.GetInputCount() < 1 || session.GetOutputCount() < 1)
+            {
+                return "model must have at least one input and one output";
+            }
+
+            // Quantized variants must keep the float interface of the fp32 model (dynamic quantization and
+            // QDQ exports do), otherwise preprocessing and beam search would silently read garbage.
+            auto input_info = session.GetInputTypeInfo(0).GetTensorTypeAndShapeInfo();
+            if (input_info.GetElementType() != ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT)
+            {
+                return "image input must be float32, got " + element_type_name(input_info.GetElementType());
+            }
+            auto output_info = session.GetOutputTypeInfo(0).GetTensorTypeAndShapeInfo();
+            if (output_info.GetElementType() != ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT)
+            {
+                return "output scores must be float32, got " + element_type_name(output_info.GetElementType()) +
+                       (config.model_quantized() ? " (re-export the quantized model with float inputs/outputs)" : "");
+            }
+
+            auto input_dims = input_info.GetShape();
+            auto expected_dims = config.input_shape();
+            if (input_dims.size() != expected_dims.size())
+            {
+                return "image input has rank " + std::to_string(input_dims.size()) + ", config expects " + std::to_string(expected_dims.size());
+            }
+            for (size_t i = 1; i < input_dims.size(); ++i)
+            {
+                if (input_dims[i] > 0 && input_dims[i] != expected_dims[i])
+                {
+                    return "image input dimension " + std::to_string(i) + " is " + std::to_string(input_dims[i]) +
+                           ", config expects " + std::to_string(expected_dims[i]);
+                }
+            }
+            return {};
+        }
+        catch (const Ort::Exception &ex)
+        {
+            return "failed to inspect model signature: " + std::string(ex.what());
+        }
+    }
+
+    tl::expected<DecodeResult, std::string> ModelInference::run(Ort::Value &input_tensor, const DecodeOptions &options, const Vocabulary &vocab, const DecodingConstraints &constraints, const CancellationToken &cancel, const CommitCallback &on_commit) const noexcept
+    {
+        auto results = run_batch(input_tensor, options, vocab, constraints, cancel, on_commit);
+        if (results.empty())
         {
-            logger->error("Failed to run model inference: {}", ex.what());
-            return tl::unexpected("Failed to run model inference: " + std::string(ex.what()));
+            return tl::unexpected("Failed to run model inference: empty input tensor");
         }
+        return std::move(results.front());
     }
 
-    std::vector<int> ModelInference::beam_search(Ort::Value &input_tensor, int max_length, int beam_width, const Vocabulary &vocab) noexcept
+    std::vector<tl::expected<DecodeResult, std::string>> ModelInference::run_batch(Ort::Value &batch_tensor, const DecodeOptions &options, const Vocabulary &vocab, const DecodingConstraints &constraints, const CancellationToken &cancel, const CommitCallback &on_commit) const noexcept
     {
         auto logger = Logger::get_logger();
+        TraceSpan span("decode", "decode");
 
-        auto beam_compare = [](const BeamState &a, const BeamState &b)
-        { return a.score < b.score; };
-        std::priority_queue<BeamState, std::vector<BeamState>, decltype(beam_compare)> beam(beam_compare);
+        // One scratch per thread; a decode nested inside another on the same thread gets its own
+        thread_local DecodeScratch thread_scratch;
+        thread_local bool thread_scratch_busy = false;
+        std::optional<DecodeScratch> own_scratch;
+        DecodeScratch &scratch = thread_scratch_busy ? own_scratch.emplace() : thread_scratch;
+        const bool leased = &scratch == &thread_scratch;
+        thread_scratch_busy = true;
+        struct ScratchLease
+        {
+            bool leased;
+            ~ScratchLease()
+            {
+                if (leased)
+                {
+                    thread_scratch_busy = false;
+                }
+            }
+        } lease{leased};
 
-        // Initialize beam with start token
-        BeamState initial_state{{vocab.token_to_id(vocab.get_start_token())}, 0.0f, false};
-        beam.push(initial_state);
+        std::vector<tl::expected<DecodeResult, std::string>> results;
+        size_t batch_size = 1;
+        try
+        {
+            batch_size = static_cast<size_t>(batch_tensor.GetTensorTypeAndShapeInfo().GetShape()[0]);
+            auto decoded = beam_search(batch_tensor, batch_size, options, vocab, constraints, cancel, on_commit, scratch);
+            results.reserve(decoded.size());
+            for (auto &result : decoded)
+            {
+                if (result.tokens.empty() && result.truncated)
+                {
+                    results.push_back(tl::unexpected(std::string(cancel.deadline_exceeded() ? "Deadline exceeded" : "Caption request cancelled")));
+                }
+                else if (result.tokens.empty())
+                {
+                    Metrics::add(Counter::decode_failures);
+                    results.push_back(tl::unexpected(std::string("No valid caption generated")));
+                }
+                else
+                {
+                    Metrics::add(Counter::captions);
+                    Metrics::add(Counter::generated_tokens, result.tokens.size() - 1);
+                    Metrics::record(Distribution::tokens_per_caption, result.tokens.size() - 1);
+                    if (result.truncated)
+                    {
+                        Metrics::add(Counter::truncated);
+                    }
+                    results.push_back(std::move(result));
+                }
+            }
+            return results;
+        }
+        catch (const std::exception &ex)
+        {
+            // A failed session run has no per-image result, so every image of the batch gets the error
+            CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::err, Logger::request_errors_per_second, "Failed to run model inference: {}", ex.what());
+            Metrics::add(Counter::decode_failures, batch_size);
+            results.assign(batch_size, tl::unexpected("Failed to run model inference: " + std::string(ex.what())));
+            return results;
+        }
+    }
+
+    std::vector<DecodeResult> ModelInference::beam_search(Ort::Value &batch_tensor, size_t batch_size, const DecodeOptions &options, const Vocabulary &vocab, const DecodingConstraints &constraints, const CancellationToken &cancel, const CommitCallback &on_commit, DecodeScratch &scratch) const
+    {
+        auto logger = Logger::get_logger();
+        TraceSpan span("decode", "beam_search");
+        const TokenMask &banned_tokens = constraints.banned_tokens();
+        const int ngram_size = constraints.no_repeat_ngram_size();
+        const int end_id = vocab.end_id();
+        const int beam_width = options.beam_width;
 
-        std::vector<BeamState> finished_sequences;
+        // Initialize every image's beam with the start token
+        std::vector<ImageBeams> images(batch_size);
+        for (auto &image : images)
+        {
+            image.beam.push_back(BeamState{{vocab.start_id()}, 0.0f, false, {}});
+        }
 
-        for (int step = 0; step < max_length; ++step)
+        std::vector<BeamState> &candidates = scratch.candidates;
+        bool truncated = false;
+        for (int step = 0; step < options.max_length; ++step)
         {
-            std::vector<BeamState> candidates;
+            if (std::ranges::all_of(images, [](const ImageBeams &image)
+                                    { return image.beam.empty(); }))
+            {
+                break;
+            }
 
-            while (!beam.empty())
+            if (!run_session_step(batch_tensor, batch_size, cancel, scratch.output))
             {
-                BeamState state = beam.top();
-                beam.pop();
+                CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::warn, Logger::request_errors_per_second, "Decoding stopped after {} step(s): {}", step, cancel.deadline_exceeded() ? "deadline exceeded" : "cancelled");
+                truncated = true;
+                break;
+            }
+            const std::vector<float> &output = scratch.output;
+            const size_t row_size = output.size() / batch_size;
 
-                if (state.finished)
+            for (size_t i = 0; i < batch_size; ++i)
+            {
+                ImageBeams &image = images[i];
+                if (image.beam.empty())
                 {
-                    finished_sequences.push_back(state);
                     continue;
                 }
+                ++image.steps;
 
-                std::vector<float> scores = run_single_step(input_tensor, state.sequence);
-                // auto sorted_scores = std::ranges::zip_view(std::views::iota(0, static_cast<int>(scores.size())), scores) | std::ranges::to<std::vector<std::pair<int, float>>>();
+                StageTimer scoring_timer(Stage::candidate_scoring);
+                score_candidates(std::span<const float>(output).subspan(i * row_size, row_size), image, banned_tokens, end_id, scratch);
+                scoring_timer.stop();
+                std::vector<std::pair<int, float>> &sorted_scores = scratch.scored;
+                // The step scores depend only on the image, so every beam shares one partial sort. Live sequences all have
+                // step + 1 tokens and each recorded n-gram can block at most one candidate, so that many extras are enough.
+                StageTimer top_k_timer(Stage::top_k);
+                size_t keep = std::min(sorted_scores.size(), static_cast<size_t>(beam_width) + (ngram_size > 0 ? static_cast<size_t>(step) + 1 : 0));
+                select_top_k(sorted_scores, keep);
+                top_k_timer.stop();
 
-                std::vector<std::pair<int, float>> sorted_scores;
-                for (size_t i = 0; i < scores.size(); ++i)
+                StageTimer beam_timer(Stage::beam_update);
+                Metrics::add(Counter::beams_pruned, update_beams(image, std::span<const std::pair<int, float>>(sorted_scores).first(keep), beam_width, ngram_size, end_id, candidates));
+                beam_timer.stop();
+                if (on_commit)
                 {
-                    sorted_scores.emplace_back(i, scores[i]);
-                };
+                    commit_stable_prefix(i, image, on_commit);
+                }
+            }
+        }
 
-                std::ranges::sort(sorted_scores, std::ranges::greater{}, &std::pair<int, float>::second);
+        std::vector<DecodeResult> results;
+        results.reserve(batch_size);
+        for (auto &image : images)
+        {
+            Metrics::record(Distribution::steps_per_caption, static_cast<uint64_t>(image.steps));
+            // Stopped before the first step: the beam holds only the start token, which is no caption at all
+            if (truncated && image.steps == 0)
+            {
+                results.push_back(DecodeResult{{}, true, {}});
+                continue;
+            }
+            std::ranges::move(image.beam, std::back_inserter(image.finished));
+            if (image.finished.empty())
+            {
+                CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::warn, Logger::request_errors_per_second, "No valid caption generated");
+                results.emplace_back();
+                continue;
+            }
+            results.push_back(select_hypotheses(image, options, truncated));
+        }
+        return results;
+    }
 
-                for (const auto &[token_id, score] : sorted_scores | std::views::take(beam_width))
+    void ModelInference::select_top_k(std::span<std::pair<int, float>> scored, size_t keep) noexcept
+    {
+        std::ranges::partial_sort(scored, scored.begin() + keep, std::ranges::greater{}, &std::pair<int, float>::second);
+    }
+
+    size_t ModelInference::update_beams(ImageBeams &image, std::span<const std::pair<int, float>> top, int beam_width, int ngram_size, int end_id, std::vector<BeamState> &candidates)
+    {
+        candidates.clear();
+        for (BeamState &state : image.beam)
+        {
+            if (state.finished)
+            {
+                image.finished.push_back(std::move(state));
+                continue;
+            }
+
+            int accepted = 0;
+            for (const auto &[token_id, score] : top)
+            {
+                if (accepted == beam_width || score == -std::numeric_limits<float>::infinity())
+                {
+                    break;
+                }
+                if (state.ngrams.repeats(state.sequence, token_id, ngram_size))
                 {
-                    std::vector<int> new_sequence = state.sequence;
-                    new_sequence.push_back(token_id);
-                    float new_score = state.score + score;
-                    bool finished = token_id == vocab.token_to_id(vocab.get_end_token());
-                    candidates.push_back(BeamState{std::move(new_sequence), new_score, finished});
+                    continue;
                 }
+
+                std::vector<int> new_sequence = state.sequence;
+                new_sequence.push_back(token_id);
+                float new_score = state.score + score;
+                bool finished = token_id == end_id;
+                NGramHistory ngrams = state.ngrams;
+                ngrams.record(new_sequence, ngram_size);
+                candidates.push_back(BeamState{std::move(new_sequence), new_score, finished, std::move(ngrams)});
+                ++accepted;
             }
+        }
 
-            // Keep top beam_width candidates
-            std::ranges::sort(candidates, std::ranges::greater{}, &BeamState::score);
-            for (const auto &candidate : candidates | std::views::take(beam_width))
+        // Keep top beam_width candidates
+        std::ranges::sort(candidates, std::ranges::greater{}, &BeamState::score);
+        image.beam.clear();
+        std::ranges::move(candidates | std::views::take(beam_width), std::back_inserter(image.beam));
+        return candidates.size() - image.beam.size();
+    }
+
+    DecodeResult ModelInference::select_hypotheses(ImageBeams &image, const DecodeOptions &options, bool truncated)
+    {
+        auto ranking = [&](const BeamState &state)
+        {
+            if (options.length_penalty == 0.0f)
             {
-                beam.push(candidate);
+                return state.score;
             }
+            // Length of the generated part; the start token is the same for every hypothesis
+            float length = static_cast<float>(state.sequence.size() - 1);
+            return state.score / std::pow((5.0f + length) / 6.0f, options.length_penalty);
+        };
 
-            if (beam.empty())
-                break;
+        std::vector<BeamState> &hypotheses = image.finished;
+        size_t count = std::min(hypotheses.size(), static_cast<size_t>(options.n_best));
+        std::ranges::partial_sort(hypotheses, hypotheses.begin() + count, std::ranges::greater{}, ranking);
+
+        DecodeResult result{std::move(hypotheses.front().sequence), truncated, {}};
+        for (size_t i = 1; i < count; ++i)
+        {
+            result.alternatives.push_back(std::move(hypotheses[i].sequence));
         }
+        return result;
+    }
 
-        while (!beam.empty())
+    void ModelInference::commit_stable_prefix(size_t index, ImageBeams &image, const CommitCallback &on_commit)
+    {
+        // Whichever beam wins in the end, it is one of these, so their common prefix is final
+        const std::vector<int> *reference = nullptr;
+        size_t stable = 0;
+        for (const auto *states : {&image.beam, &image.finished})
         {
-            finished_sequences.push_back(beam.top());
-            beam.pop();
+            for (const BeamState &state : *states)
+            {
+                if (!reference)
+                {
+                    reference = &state.sequence;
+                    stable = state.sequence.size();
+                    continue;
+                }
+                size_t length = std::min(stable, state.sequence.size());
+                stable = std::mismatch(reference->begin(), reference->begin() + length, state.sequence.begin()).first - reference->begin();
+            }
         }
 
-        if (finished_sequences.empty())
+        if (reference && stable > image.committed)
         {
-            logger->warn("No valid caption generated");
-            return {};
+            on_commit(index, std::span<const int>(*reference).subspan(image.committed, stable - image.committed));
+            image.committed = stable;
+        }
+    }
+
+    void ModelInference::score_candidates(std::span<const float> output_row, ImageBeams &image, const TokenMask &banned_tokens, int end_id, DecodeScratch &scratch) const
+    {
+        std::vector<std::pair<int, float>> &scored = scratch.scored;
+        std::vector<float> &scores = scratch.scores;
+        scored.clear();
+        if (image.shortlist.empty())
+        {
+            if (projection_)
+            {
+                scores.resize(projection_->vocab_size());
+                projection_->project_all(output_row, scores);
+                log_softmax(scores);
+            }
+            else
+            {
+                scores.assign(output_row.begin(), output_row.end());
+            }
+            banned_tokens.apply(scores);
+
+            scored.reserve(scores.size());
+            for (size_t i = 0; i < scores.size(); ++i)
+            {
+                scored.emplace_back(i, scores[i]);
+            }
+            if (projection_)
+            {
+                image.shortlist = build_shortlist(scores, end_id);
+            }
+            return;
         }
 
-        std::ranges::sort(finished_sequences, std::ranges::greater{}, &BeamState::score);
-        return finished_sequences.front().sequence;
+        // Scores (log-probabilities renormalized over the shortlist) for the shortlisted token ids only
+        scores.resize(image.shortlist.size());
+        projection_->project(output_row, image.shortlist, scores);
+        log_softmax(scores);
+        scored.reserve(scores.size());
+        for (size_t i = 0; i < image.shortlist.size(); ++i)
+        {
+            if (!banned_tokens.is_banned(image.shortlist[i]))
+            {
+                scored.emplace_back(image.shortlist[i], scores[i]);
+            }
+        }
     }
 
-    // std::vector<float> ModelInference::run_single_step(Ort::Value &input_tensor, std::span<const int> current_sequence) noexcept
-    std::vector<float> ModelInference::run_single_step(Ort::Value &input_tensor, const std::vector<int> &current_sequence) noexcept
+    bool ModelInference::run_session_step(Ort::Value &batch_tensor, size_t batch_size, const CancellationToken &cancel, std::vector<float> &output) const
     {
         // Placeholder for running the model on a single step. In a real model, this would involve:
-        // 1. Feeding the image tensor and current sequence to the model.
+        // 1. Feeding the image tensor and the current sequences to the model.
         // 2. Getting the softmax scores for the next token.
-        // For simplicity, we assume the model handles this internally.
+        // For simplicity, we assume the model handles this internally, so the graph only sees the images and
+        // all beams of an image share its output row.
 
         const char *input_names[] = {input_name_.c_str()};
         const char *output_names[] = {output_name_.c_str()};
 
-        std::vector<Ort::Value> output_tensors = session_->Run(
-            Ort::RunOptions{nullptr}, input_names, &input_tensor, 1, output_names, 1);
+        Ort::RunOptions run_options = cancel.can_stop() ? Ort::RunOptions() : Ort::RunOptions(nullptr);
+        if (!cancel.attach(run_options))
+        {
+            return false;
+        }
+        std::vector<Ort::Value> output_tensors;
+        try
+        {
+            StageTimer timer(Stage::session_step);
+            output_tensors = session_->Run(run_options, input_names, &batch_tensor, 1, output_names, 1);
+            timer.stop();
+            Metrics::add(Counter::decode_steps);
+            cancel.detach();
+        }
+        catch (const Ort::Exception &)
+        {
+            cancel.detach();
+            // A terminated run fails like any other; the token tells the two apart
+            if (cancel.stop_requested())
+            {
+                return false;
+            }
+            throw;
+        }
 
-        float *output_data = output_tensors[0].GetTensorMutableData<float>();
+        const float *output_data = output_tensors[0].GetTensorData<float>();
         auto output_shape = output_tensors[0].GetTensorTypeAndShapeInfo().GetShape();
-        return std::vector<float>(output_data, output_data + output_shape[1]);
+        if (output_shape.size() != 2 || static_cast<size_t>(output_shape[0]) != batch_size)
+        {
+            throw std::runtime_error("Model output must be [batch, scores] with " + std::to_string(batch_size) + " row(s)");
+        }
+        if (projection_ && static_cast<size_t>(output_shape[1]) != projection_->hidden_size())
+        {
+            throw std::runtime_error("Decoder hidden state has size " + std::to_string(output_shape[1]) + ", projection expects " + std::to_string(projection_->hidden_size()));
+        }
+        output.assign(output_data, output_data + batch_size * output_shape[1]);
+        return true;
+    }
+
+    std::vector<int> ModelInference::build_shortlist(std::span<const float> first_step_scores, int end_id) const
+    {
+        std::vector<int> ids(first_step_scores.size());
+        std::iota(ids.begin(), ids.end(), 0);
+        size_t top = std::min(ids.size(), static_cast<size_t>(shortlist_size_));
+        std::ranges::nth_element(ids, ids.begin() + top, std::ranges::greater{}, [&](int id)
+                                 { return first_step_scores[id]; });
+        ids.resize(top);
+
+        ids.insert(ids.end(), frequent_ids_.begin(), frequent_ids_.end());
+        ids.push_back(end_id);
+        // Id order walks the projection rows sequentially
+        std::ranges::sort(ids);
+        auto duplicates = std::ranges::unique(ids);
+        ids.erase(duplicates.begin(), duplicates.end());
+        return ids;
     }
 
 } // namespace captioning
\ No newline at end of file
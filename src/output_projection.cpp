@@ -0,0 +1,184 @@
+#include <cstring>
+#include <format>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CAPTIONING_X86_KERNELS 1
+#endif
+
+#include "output_projection.hpp"
+#include "logger.hpp"
+#include "expected.hpp"
+
+namespace captioning
+{
+    namespace
+    {
+        constexpr size_t header_size = 16;
+
+        using DotKernel = float (*)(const float *, const float *, size_t) noexcept;
+
+        float dot_scalar(const float *a, const float *b, size_t n) noexcept
+        {
+            float sum = 0.0f;
+            for (size_t i = 0; i < n; ++i)
+            {
+                sum += a[i] * b[i];
+            }
+            return sum;
+        }
+
+#ifdef CAPTIONING_X86_KERNELS
+        __attribute__((target("avx2,fma"))) float dot_avx2(const float *a, const float *b, size_t n) noexcept
+        {
+            // Two accumulators hide the FMA latency
+            __m256 acc0 = _mm256_setzero_ps();
+            __m256 acc1 = _mm256_setzero_ps();
+            size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+                acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+            }
+            for (; i + 8 <= n; i += 8)
+            {
+                acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+            }
+            __m256 acc = _mm256_add_ps(acc0, acc1);
+            __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+            sum4 = _mm_hadd_ps(sum4, sum4);
+            sum4 = _mm_hadd_ps(sum4, sum4);
+            float sum = _mm_cvtss_f32(sum4);
+            for (; i < n; ++i)
+            {
+                sum += a[i] * b[i];
+            }
+            return sum;
+        }
+
+        __attribute__((target("avx512f"))) float dot_avx512(const float *a, const float *b, size_t n) noexcept
+        {
+            __m512 acc0 = _mm512_setzero_ps();
+            __m512 acc1 = _mm512_setzero_ps();
+            size_t i = 0;
+            for (; i + 32 <= n; i += 32)
+            {
+                acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+                acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+            }
+            for (; i + 16 <= n; i += 16)
+            {
+                acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+            }
+            if (i < n)
+            {
+                __mmask16 tail = static_cast<__mmask16>((1u << (n - i)) - 1);
+                acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, a + i), _mm512_maskz_loadu_ps(tail, b + i), acc1);
+            }
+            alignas(64) float lanes[16];
+            _mm512_store_ps(lanes, _mm512_add_ps(acc0, acc1));
+            float sum = 0.0f;
+            for (float lane : lanes)
+            {
+                sum += lane;
+            }
+            return sum;
+        }
+#endif
+
+        struct Kernel
+        {
+            DotKernel dot;
+            const char *name;
+        };
+
+        Kernel select_kernel() noexcept
+        {
+#ifdef CAPTIONING_X86_KERNELS
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f"))
+            {
+                return {dot_avx512, "avx512"};
+            }
+            if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            {
+                return {dot_avx2, "avx2"};
+            }
+#endif
+            return {dot_scalar, "scalar"};
+        }
+
+        const Kernel &kernel() noexcept
+        {
+            static const Kernel selected = select_kernel();
+            return selected;
+        }
+    }
+
+    tl::expected<OutputProjection, std::string> OutputProjection::load(const std::filesystem::path &weights_path) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        auto file = MappedFile::open(weights_path);
+        if (!file)
+        {
+            return tl::unexpected("Failed to load output projection: " + file.error());
+        }
+        if (file->size() < header_size || std::memcmp(file->data(), "CPRJ", 4) != 0)
+        {
+            logger->error("Invalid output projection file: {}", weights_path.string());
+            return tl::unexpected("Invalid output projection file: " + weights_path.string());
+        }
+
+        uint32_t header[3];
+        std::memcpy(header, file->data() + 4, sizeof(header));
+        const auto [version, vocab_size, hidden_size] = header;
+        if (version != 1 || vocab_size == 0 || hidden_size == 0)
+        {
+            logger->error("Unsupported output projection file {} (version {}, {}x{})", weights_path.string(), version, vocab_size, hidden_size);
+            return tl::unexpected("Unsupported output projection file: " + weights_path.string());
+        }
+        const size_t expected_size = header_size + sizeof(float) * (static_cast<size_t>(vocab_size) * hidden_size + vocab_size);
+        if (file->size() != expected_size)
+        {
+            logger->error("Output projection file {} is {} bytes, expected {}", weights_path.string(), file->size(), expected_size);
+            return tl::unexpected("Truncated output projection file: " + weights_path.string());
+        }
+
+        file->prefetch();
+        logger->info("Output projection loaded: {} tokens x {} hidden, {} kernel", vocab_size, hidden_size, kernel_name());
+        return OutputProjection(std::move(*file), vocab_size, hidden_size);
+    }
+
+    OutputProjection::OutputProjection(MappedFile file, size_t vocab_size, size_t hidden_size) noexcept
+        : file_(std::move(file)), vocab_size_(vocab_size), hidden_size_(hidden_size)
+    {
+        // The header keeps the payload 16-byte aligned within the page-aligned mapping
+        weights_ = reinterpret_cast<const float *>(file_.data() + header_size);
+        bias_ = weights_ + vocab_size_ * hidden_size_;
+    }
+
+    void OutputProjection::project(std::span<const float> hidden, std::span<const int> token_ids, std::span<float> scores) const noexcept
+    {
+        const DotKernel dot = kernel().dot;
+        for (size_t i = 0; i < token_ids.size(); ++i)
+        {
+            const size_t row = static_cast<size_t>(token_ids[i]);
+            scores[i] = dot(weights_ + row * hidden_size_, hidden.data(), hidden_size_) + bias_[row];
+        }
+    }
+
+    void OutputProjection::project_all(std::span<const float> hidden, std::span<float> scores) const noexcept
+    {
+        const DotKernel dot = kernel().dot;
+        for (size_t row = 0; row < vocab_size_; ++row)
+        {
+            scores[row] = dot(weights_ + row * hidden_size_, hidden.data(), hidden_size_) + bias_[row];
+        }
+    }
+
+    const char *OutputProjection::kernel_name() noexcept
+    {
+        return kernel().name;
+    }
+}
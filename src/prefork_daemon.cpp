@@ -0,0 +1,479 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/prctl.h>
+#endif
+
+#include "prefork_daemon.hpp"
+#include "caption_server.hpp"
+#include "sidecar_server.hpp"
+#include "reloadable_generator.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "tracing.hpp"
+
+namespace captioning
+{
+    namespace
+    {
+        sigset_t control_signals() noexcept
+        {
+            sigset_t signals;
+            sigemptyset(&signals);
+            sigaddset(&signals, SIGINT);
+            sigaddset(&signals, SIGTERM);
+            sigaddset(&signals, SIGHUP);
+            sigaddset(&signals, SIGUSR1);
+            return signals;
+        }
+
+        // sigtimedwait, which macOS lacks; -1 on timeout
+        int wait_for_signal(const sigset_t &signals, std::chrono::nanoseconds timeout) noexcept
+        {
+#ifdef __linux__
+            timespec limit{static_cast<time_t>(timeout.count() / 1'000'000'000), static_cast<long>(timeout.count() % 1'000'000'000)};
+            return ::sigtimedwait(&signals, nullptr, &limit);
+#else
+            // Polls for a pending signal, which sigwait then takes without blocking
+            constexpr std::chrono::milliseconds poll_interval{10};
+            const auto deadline = std::chrono::steady_clock::now() + timeout;
+            while (true)
+            {
+                sigset_t pending;
+                sigemptyset(&pending);
+                ::sigpending(&pending);
+                for (int signal = 1; signal < NSIG; ++signal)
+                {
+                    if (sigismember(&signals, signal) == 1 && sigismember(&pending, signal) == 1)
+                    {
+                        sigset_t one;
+                        sigemptyset(&one);
+                        sigaddset(&one, signal);
+                        int taken = 0;
+                        return ::sigwait(&one, &taken) == 0 ? taken : -1;
+                    }
+                }
+                const auto now = std::chrono::steady_clock::now();
+                if (now >= deadline)
+                {
+                    return -1;
+                }
+                std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(poll_interval, deadline - now));
+            }
+#endif
+        }
+    }
+
+    int PreforkDaemon::run(const Config &config, const DaemonOptions &options) noexcept
+    {
+        // Stops the background log writer: the master forks, so it must not run any thread
+        Logger::set_mode(Logger::Mode::synchronous);
+        auto logger = Logger::get_logger();
+        using Clock = std::chrono::steady_clock;
+
+        if (options.workers <= 0)
+        {
+            logger->error("The daemon needs at least one worker");
+            return 1;
+        }
+        if (config.model_load_mode() != "mmap")
+        {
+            logger->warn("model_load_mode is not mmap, so every worker reads its own copy of the model");
+        }
+#ifndef __linux__
+        if (options.pin_workers)
+        {
+            logger->warn("Pinning workers to CPUs is only supported on Linux, so they are not pinned");
+        }
+#endif
+
+        // Blocked here so that forked workers inherit the mask too and take their control signals with sigwait
+        sigset_t signals = control_signals();
+        sigaddset(&signals, SIGCHLD);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+        auto assets = GeneratorAssets::load(config);
+        if (!assets)
+        {
+            logger->error("Daemon failed to load: {}", assets.error());
+            return 1;
+        }
+        auto listener = options.sidecar ? SidecarServer::open_listener(options.socket_path) : HttpServer::open_listener(options.http.host, options.http.port);
+        if (!listener)
+        {
+            logger->error("{}", listener.error());
+            return 1;
+        }
+
+        std::vector<WorkerSlot> slots(static_cast<size_t>(options.workers));
+        bool stopping = false;
+        int exit_code = 0;
+        auto stop_workers = [&]
+        {
+            stopping = true;
+            for (const auto &slot : slots)
+            {
+                if (slot.pid > 0)
+                {
+                    ::kill(slot.pid, SIGTERM);
+                }
+            }
+        };
+        // Replaces workers still running old assets one at a time, so all but one keep serving during a reload
+        auto retire_next = [&]
+        {
+            if (stopping || std::ranges::any_of(slots, &WorkerSlot::retiring))
+            {
+                return;
+            }
+            auto stale = std::ranges::find_if(slots, [](const WorkerSlot &slot)
+                                              { return slot.stale && slot.pid > 0; });
+            if (stale != slots.end())
+            {
+                stale->retiring = true;
+                ::kill(stale->pid, SIGTERM);
+            }
+        };
+
+        logger->info("Prefork daemon starting {} worker(s)", options.workers);
+        while (true)
+        {
+            const auto now = Clock::now();
+            auto next_restart = Clock::time_point::max();
+            for (size_t i = 0; i < slots.size(); ++i)
+            {
+                WorkerSlot &slot = slots[i];
+                if (stopping || slot.pid > 0)
+                {
+                    continue;
+                }
+                if (slot.restart_at <= now)
+                {
+                    slot.started = now;
+                    slot.stale = false;
+                    slot.pid = spawn_worker(*assets, options, *listener, static_cast<int>(i));
+                    // A failed fork is retried like a crash
+                    slot.restart_at = now + min_restart_interval;
+                }
+                if (slot.pid < 0)
+                {
+                    next_restart = std::min(next_restart, slot.restart_at);
+                }
+            }
+            retire_next();
+            if (stopping && std::ranges::none_of(slots, [](const WorkerSlot &slot)
+                                                 { return slot.pid > 0; }))
+            {
+                break;
+            }
+
+            auto wait = next_restart == Clock::time_point::max() ? std::chrono::nanoseconds(std::chrono::seconds(1)) : std::max(std::chrono::nanoseconds(0), next_restart - now);
+            int signal = wait_for_signal(signals, wait);
+            if (signal == SIGINT || signal == SIGTERM)
+            {
+                if (!stopping)
+                {
+                    logger->info("Prefork daemon stopping workers");
+                    stop_workers();
+                }
+                continue;
+            }
+            if (signal == SIGHUP && !stopping)
+            {
+                auto reloaded = probe_reload(options);
+                if (!reloaded)
+                {
+                    logger->error("Reload rejected, workers keep the current model: {}", reloaded.error());
+                    continue;
+                }
+                // Workers are forked anew from exactly the assets that passed, rather than each reloading on its own
+                *assets = std::move(*reloaded);
+                for (auto &slot : slots)
+                {
+                    slot.stale = slot.pid > 0;
+                }
+                logger->info("Reload passed its probe, replacing the workers");
+                retire_next();
+                continue;
+            }
+            if (signal == SIGUSR1)
+            {
+                // The master runs no pipeline; each worker writes its own trace
+                for (const auto &slot : slots)
+                {
+                    if (slot.pid > 0)
+                    {
+                        ::kill(slot.pid, SIGUSR1);
+                    }
+                }
+                continue;
+            }
+            if (signal != SIGCHLD)
+            {
+                continue;
+            }
+
+            int status = 0;
+            for (pid_t pid; (pid = ::waitpid(-1, &status, WNOHANG)) > 0;)
+            {
+                auto slot = std::ranges::find(slots, pid, &WorkerSlot::pid);
+                if (slot == slots.end())
+                {
+                    continue;
+                }
+                slot->pid = -1;
+                if (stopping)
+                {
+                    continue;
+                }
+                if (slot->retiring)
+                {
+                    logger->info("Worker {} (pid {}) retired, starting its replacement", slot - slots.begin(), pid);
+                    slot->retiring = false;
+                    slot->restart_at = Clock::time_point::min();
+                    continue;
+                }
+                if (WIFEXITED(status) && WEXITSTATUS(status) == startup_failure_exit_code)
+                {
+                    logger->error("Worker {} (pid {}) failed to start, stopping the daemon", slot - slots.begin(), pid);
+                    exit_code = 1;
+                    stop_workers();
+                    continue;
+                }
+                if (WIFSIGNALED(status))
+                {
+                    logger->error("Worker {} (pid {}) killed by signal {}, restarting", slot - slots.begin(), pid, WTERMSIG(status));
+                }
+                else
+                {
+                    logger->warn("Worker {} (pid {}) exited with status {}, restarting", slot - slots.begin(), pid, WEXITSTATUS(status));
+                }
+                // A worker that keeps crashing right after start is restarted at most once per interval
+                slot->restart_at = slot->started + min_restart_interval;
+            }
+        }
+
+        ::close(*listener);
+        if (options.sidecar)
+        {
+            ::unlink(options.socket_path.c_str());
+        }
+        logger->info("Prefork daemon stopped");
+        return exit_code;
+    }
+
+    pid_t PreforkDaemon::spawn_worker(GeneratorAssets &assets, const DaemonOptions &options, int listen_fd, int index) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        const pid_t master = ::getpid();
+        const pid_t pid = ::fork();
+        if (pid < 0)
+        {
+            logger->error("Failed to fork worker {}: {}", index, std::strerror(errno));
+            return -1;
+        }
+        if (pid == 0)
+        {
+            Logger::use_process_file();
+            Logger::set_mode(Logger::Mode::asynchronous);
+            Metrics::set_worker(index);
+            int exit_code = run_worker(std::move(assets), options, listen_fd, index, master);
+            if (Tracing::enabled())
+            {
+                if (auto error = Tracing::write(); !error.empty())
+                {
+                    Logger::get_logger()->error("Worker {}: {}", index, error);
+                }
+            }
+            Logger::shutdown();
+            // Skips the master's atexit handlers and static destructors, which are not the worker's to run
+            ::_exit(exit_code);
+        }
+
+        logger->info("Started worker {} (pid {})", index, pid);
+        return pid;
+    }
+
+    int PreforkDaemon::run_worker(GeneratorAssets assets, const DaemonOptions &options, int listen_fd, int index, pid_t master) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        // Don't outlive the master. The getppid check catches a master that died before the death signal was set;
+        // other systems have no death signal, so there it is the only check.
+#ifdef __linux__
+        ::prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+        if (::getppid() != master)
+        {
+            return 0;
+        }
+#ifdef __linux__
+        if (options.pin_workers)
+        {
+            pin_to_cpu(index);
+        }
+#endif
+
+        const Config config = assets.config;
+        auto generator = CaptionGenerator::create(std::move(assets));
+        if (!generator)
+        {
+            logger->error("Worker {} failed to create the generator: {}", index, generator.error());
+            return startup_failure_exit_code;
+        }
+        if (auto error = generator->warm_up(); !error.empty())
+        {
+            logger->error("Worker {} failed to warm up: {}", index, error);
+            return startup_failure_exit_code;
+        }
+        auto generators = ReloadableGenerator::create(options.config_path, std::move(*generator));
+        if (!generators)
+        {
+            logger->error("Worker {}: {}", index, generators.error());
+            return startup_failure_exit_code;
+        }
+
+        std::unique_ptr<CaptionServer> http_server;
+        std::unique_ptr<SidecarServer> sidecar_server;
+        if (options.sidecar)
+        {
+            auto started = SidecarServer::start(**generators, options.socket_path, options.max_image_bytes, listen_fd);
+            if (!started)
+            {
+                logger->error("Worker {} failed to start the sidecar: {}", index, started.error());
+                return startup_failure_exit_code;
+            }
+            sidecar_server = std::move(*started);
+        }
+        else
+        {
+            HttpServerOptions http = options.http;
+            http.listen_fd = listen_fd;
+            // Reloads are driven by the master, which probes them first, so workers don't take them over HTTP
+            auto started = CaptionServer::start(**generators, config, http, false);
+            if (!started)
+            {
+                logger->error("Worker {} failed to start the server: {}", index, started.error());
+                return startup_failure_exit_code;
+            }
+            http_server = std::move(*started);
+        }
+        logger->info("Worker {} ready", index);
+
+        const sigset_t signals = control_signals();
+        int signal = 0;
+        while (::sigwait(&signals, &signal) == 0 && (signal == SIGHUP || signal == SIGUSR1))
+        {
+            // SIGHUP is the master's: it reloads by replacing the workers, so a worker never loads a model on its own
+            if (signal == SIGUSR1)
+            {
+                if (auto error = Tracing::write(); !error.empty())
+                {
+                    logger->error("Worker {}: {}", index, error);
+                }
+            }
+        }
+        if (http_server)
+        {
+            http_server->stop();
+        }
+        if (sidecar_server)
+        {
+            sidecar_server->stop();
+        }
+        logger->info("Worker {} stopped", index);
+        return 0;
+    }
+
+    tl::expected<GeneratorAssets, std::string> PreforkDaemon::probe_reload(const DaemonOptions &options) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        logger->info("Reloading {}", options.config_path.string());
+        auto config = Config::from_file(options.config_path);
+        if (!config)
+        {
+            return tl::unexpected(config.error());
+        }
+        auto assets = GeneratorAssets::load(*config);
+        if (!assets)
+        {
+            return tl::unexpected(assets.error());
+        }
+
+        // The master must stay free of ONNX Runtime state, so the generator is tried out in a child
+        const pid_t probe = ::fork();
+        if (probe < 0)
+        {
+            return tl::unexpected("Failed to fork the reload probe: " + std::string(std::strerror(errno)));
+        }
+        if (probe == 0)
+        {
+#ifdef __linux__
+            ::prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+            int exit_code = startup_failure_exit_code;
+            if (auto generator = CaptionGenerator::create(std::move(*assets)); !generator)
+            {
+                logger->error("Reload probe failed to create the generator: {}", generator.error());
+            }
+            else if (auto error = generator->warm_up(); !error.empty())
+            {
+                logger->error("Reload probe failed to warm up: {}", error);
+            }
+            else
+            {
+                exit_code = 0;
+            }
+            logger->flush();
+            ::_exit(exit_code);
+        }
+
+        int status = 0;
+        pid_t waited;
+        while ((waited = ::waitpid(probe, &status, 0)) < 0 && errno == EINTR)
+        {
+        }
+        if (waited != probe || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            return tl::unexpected(std::string("the new model failed its probe (see the log above)"));
+        }
+        return std::move(*assets);
+    }
+
+#ifdef __linux__
+    void PreforkDaemon::pin_to_cpu(int index) noexcept
+    {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (::sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0)
+        {
+            return;
+        }
+
+        // The (index mod count)-th CPU this process may run on
+        int target = index % CPU_COUNT(&allowed);
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (!CPU_ISSET(cpu, &allowed) || target-- > 0)
+            {
+                continue;
+            }
+            cpu_set_t pinned;
+            CPU_ZERO(&pinned);
+            CPU_SET(cpu, &pinned);
+            if (::sched_setaffinity(0, sizeof(pinned), &pinned) != 0)
+            {
+                Logger::get_logger()->warn("Failed to pin worker {} to CPU {}: {}", index, cpu, std::strerror(errno));
+            }
+            return;
+        }
+    }
+#endif
+}
@@ -0,0 +1,95 @@
+#include "reloadable_generator.hpp"
+#include "logger.hpp"
+
+namespace captioning
+{
+    tl::expected<std::unique_ptr<ReloadableGenerator>, std::string> ReloadableGenerator::create(const std::filesystem::path &config_path) noexcept
+    {
+        auto generator = build(config_path, 0);
+        if (!generator)
+        {
+            return tl::unexpected(generator.error());
+        }
+        return std::unique_ptr<ReloadableGenerator>(new ReloadableGenerator(config_path, std::move(*generator)));
+    }
+
+    tl::expected<std::unique_ptr<ReloadableGenerator>, std::string> ReloadableGenerator::create(const std::filesystem::path &config_path, CaptionGenerator generator) noexcept
+    {
+        try
+        {
+            return std::unique_ptr<ReloadableGenerator>(new ReloadableGenerator(config_path, share(std::move(generator), 0)));
+        }
+        catch (const std::exception &ex)
+        {
+            return tl::unexpected("Failed to set up the generator: " + std::string(ex.what()));
+        }
+    }
+
+    ReloadableGenerator::ReloadableGenerator(std::filesystem::path config_path, std::shared_ptr<const CaptionGenerator> generator) noexcept
+        : config_path_(std::move(config_path)), current_(std::move(generator)) {}
+
+    std::shared_ptr<const CaptionGenerator> ReloadableGenerator::current() const noexcept
+    {
+        std::lock_guard lock(current_mutex_);
+        return current_;
+    }
+
+    std::string ReloadableGenerator::reload() noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        std::lock_guard lock(reload_mutex_);
+        logger->info("Reloading the generator from {}", config_path_.string());
+        auto generator = build(config_path_, generation_ + 1);
+        if (!generator)
+        {
+            logger->error("Reload rejected, the current generator keeps serving: {}", generator.error());
+            return generator.error();
+        }
+
+        ++generation_;
+        // Requests already running keep their reference; the old generator goes once the last of them is done
+        std::shared_ptr<const CaptionGenerator> previous = std::move(*generator);
+        {
+            std::lock_guard swap_lock(current_mutex_);
+            current_.swap(previous);
+        }
+        logger->info("Generator {} is serving new requests", generation_);
+        return {};
+    }
+
+    tl::expected<std::shared_ptr<const CaptionGenerator>, std::string> ReloadableGenerator::build(const std::filesystem::path &config_path, unsigned generation) noexcept
+    {
+        auto config = Config::from_file(config_path);
+        if (!config)
+        {
+            return tl::unexpected(config.error());
+        }
+        auto generator = CaptionGenerator::create(*config);
+        if (!generator)
+        {
+            return tl::unexpected(generator.error());
+        }
+        if (auto error = generator->warm_up(); !error.empty())
+        {
+            return tl::unexpected(error);
+        }
+
+        try
+        {
+            return share(std::move(*generator), generation);
+        }
+        catch (const std::exception &ex)
+        {
+            return tl::unexpected("Failed to set up the generator: " + std::string(ex.what()));
+        }
+    }
+
+    std::shared_ptr<const CaptionGenerator> ReloadableGenerator::share(CaptionGenerator generator, unsigned generation)
+    {
+        return std::shared_ptr<const CaptionGenerator>(new CaptionGenerator(std::move(generator)), [generation](const CaptionGenerator *retired)
+                                                       {
+                                                           delete retired;
+                                                           Logger::get_logger()->info("Generator {} retired", generation); });
+    }
+}
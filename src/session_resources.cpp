@@ -0,0 +1,27 @@
+#include "session_resources.hpp"
+#include "logger.hpp"
+
+namespace captioning
+{
+    std::once_flag SessionResources::env_once_;
+    std::once_flag SessionResources::allocator_once_;
+    std::unique_ptr<Ort::Env> SessionResources::env_ = nullptr;
+
+    Ort::Env &SessionResources::env()
+    {
+        std::call_once(env_once_, []
+                       { env_ = std::make_unique<Ort::Env>(ORT_LOGGING_LEVEL_WARNING, "image_captioning"); });
+        return *env_;
+    }
+
+    void SessionResources::register_shared_allocator()
+    {
+        std::call_once(allocator_once_, []
+                       {
+                           Ort::MemoryInfo memory_info = Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
+                           // -1/0 keep ONNX Runtime's default arena settings
+                           Ort::ArenaCfg arena_cfg(0, -1, -1, -1);
+                           env().CreateAndRegisterAllocator(memory_info, arena_cfg);
+                           Logger::get_logger()->info("Registered shared CPU arena allocator"); });
+    }
+}
@@ -0,0 +1,602 @@
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <format>
+#include <system_error>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "sidecar_server.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "sockets.hpp"
+
+namespace captioning
+{
+    namespace
+    {
+        constexpr int accept_poll_ms = 200;
+        constexpr int write_timeout_seconds = 10;
+
+        template <typename T>
+        T load_le(const unsigned char *bytes) noexcept
+        {
+            T value = 0;
+            for (size_t i = 0; i < sizeof(T); ++i)
+            {
+                value |= static_cast<T>(bytes[i]) << (8 * i);
+            }
+            return value;
+        }
+
+        template <typename T>
+        void append_le(std::string &out, T value)
+        {
+            for (size_t i = 0; i < sizeof(T); ++i)
+            {
+                out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+            }
+        }
+
+        // Closes a descriptor received with a frame on every path out of the read loop
+        struct PassedFd
+        {
+            int fd = -1;
+
+            ~PassedFd() { reset(); }
+
+            void reset() noexcept
+            {
+                if (fd >= 0)
+                {
+                    ::close(fd);
+                    fd = -1;
+                }
+            }
+        };
+
+        // False on end of stream, error, or shutdown. With passed_fd, a descriptor sent along with these bytes is
+        // kept there (later extra ones are closed); a plain recv would silently drop it.
+        bool read_exact(int fd, unsigned char *data, size_t size, PassedFd *passed_fd = nullptr) noexcept
+        {
+            while (size > 0)
+            {
+                ssize_t received;
+                if (passed_fd)
+                {
+                    iovec chunk{data, size};
+                    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 4)];
+                    msghdr message{};
+                    message.msg_iov = &chunk;
+                    message.msg_iovlen = 1;
+                    message.msg_control = control;
+                    message.msg_controllen = sizeof(control);
+#ifdef MSG_CMSG_CLOEXEC
+                    received = ::recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+#else
+                    received = ::recvmsg(fd, &message, 0);
+#endif
+                    for (cmsghdr *header = received > 0 ? CMSG_FIRSTHDR(&message) : nullptr; header; header = CMSG_NXTHDR(&message, header))
+                    {
+                        if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+                        {
+                            continue;
+                        }
+                        size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                        for (size_t i = 0; i < count; ++i)
+                        {
+                            int received_fd;
+                            std::memcpy(&received_fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+#ifndef MSG_CMSG_CLOEXEC
+                            (void)Sockets::set_close_on_exec(received_fd);
+#endif
+                            if (passed_fd->fd < 0)
+                            {
+                                passed_fd->fd = received_fd;
+                            }
+                            else
+                            {
+                                ::close(received_fd);
+                            }
+                        }
+                    }
+                }
+                else
+                {
+                    received = ::recv(fd, data, size, 0);
+                }
+                if (received < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (received <= 0)
+                {
+                    return false;
+                }
+                data += received;
+                size -= static_cast<size_t>(received);
+            }
+            return true;
+        }
+    }
+
+    SidecarServer::Connection::~Connection()
+    {
+        ::close(fd);
+    }
+
+    tl::expected<std::unique_ptr<SidecarServer>, std::string> SidecarServer::start(const ReloadableGenerator &generators, const std::string &socket_path, size_t max_image_bytes, int listen_fd) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        std::unique_ptr<SidecarServer> server(new SidecarServer(generators, socket_path, max_image_bytes));
+        if (listen_fd >= 0)
+        {
+            server->listen_fd_ = listen_fd;
+        }
+        else
+        {
+            auto listener = open_listener(socket_path);
+            if (!listener)
+            {
+                logger->error("{}", listener.error());
+                return tl::unexpected(listener.error());
+            }
+            server->listen_fd_ = *listener;
+            server->owns_socket_path_ = true;
+        }
+
+        try
+        {
+            server->accept_thread_ = std::thread(&SidecarServer::accept_loop, server.get());
+        }
+        catch (const std::system_error &ex)
+        {
+            logger->error("Failed to start sidecar accept thread: {}", ex.what());
+            return tl::unexpected("Failed to start sidecar accept thread: " + std::string(ex.what()));
+        }
+
+        logger->info("Sidecar listening on {}", socket_path);
+        return server;
+    }
+
+    SidecarServer::SidecarServer(const ReloadableGenerator &generators, const std::string &socket_path, size_t max_image_bytes) noexcept
+        : generators_(generators), socket_path_(socket_path), max_image_bytes_(max_image_bytes) {}
+
+    SidecarServer::~SidecarServer()
+    {
+        stop();
+    }
+
+    tl::expected<int, std::string> SidecarServer::open_listener(const std::string &socket_path) noexcept
+    {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (socket_path.empty() || socket_path.size() >= sizeof(address.sun_path))
+        {
+            return tl::unexpected(std::format("Socket path must be 1 to {} characters: {}", sizeof(address.sun_path) - 1, socket_path));
+        }
+        std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+        // A socket left behind by a previous run would make bind fail; anything that is not a socket is left alone
+        struct stat existing{};
+        if (::lstat(socket_path.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode))
+        {
+            ::unlink(socket_path.c_str());
+        }
+
+        // Non-blocking: with several acceptors on one socket, the ones losing the race must not block in accept
+        int fd = Sockets::open(AF_UNIX, SOCK_STREAM, 0, true);
+        if (fd < 0)
+        {
+            return tl::unexpected(std::format("Failed to create socket: {}", std::strerror(errno)));
+        }
+        if (::bind(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 || ::listen(fd, SOMAXCONN) != 0)
+        {
+            std::string error = std::format("Failed to listen on {}: {}", socket_path, std::strerror(errno));
+            ::close(fd);
+            return tl::unexpected(error);
+        }
+        return fd;
+    }
+
+    void SidecarServer::stop() noexcept
+    {
+        if (stopping_.exchange(true))
+        {
+            return;
+        }
+
+        if (accept_thread_.joinable())
+        {
+            accept_thread_.join();
+        }
+        reap_readers(true);
+        if (listen_fd_ >= 0)
+        {
+            ::close(listen_fd_);
+            if (owns_socket_path_)
+            {
+                ::unlink(socket_path_.c_str());
+            }
+            listen_fd_ = -1;
+        }
+        Logger::get_logger()->info("Sidecar stopped");
+    }
+
+    void SidecarServer::accept_loop() noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        const timeval write_timeout{write_timeout_seconds, 0};
+        while (!stopping_)
+        {
+            reap_readers(false);
+
+            pollfd listener{listen_fd_, POLLIN, 0};
+            if (::poll(&listener, 1, accept_poll_ms) <= 0)
+            {
+                continue;
+            }
+            int fd = Sockets::accept(listen_fd_);
+            if (fd < 0)
+            {
+                if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+                {
+                    CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::warn, Logger::request_errors_per_second, "Failed to accept a sidecar connection: {}", std::strerror(errno));
+                }
+                continue;
+            }
+            // Responses are written from inference threads, which must not hang on a client that stopped reading
+            ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &write_timeout, sizeof(write_timeout));
+
+            try
+            {
+                auto connection = std::make_shared<Connection>(fd);
+                std::lock_guard lock(readers_mutex_);
+                // Reserved first so the push cannot throw with a running thread in hand
+                readers_.reserve(readers_.size() + 1);
+                readers_.push_back(Reader{std::thread(&SidecarServer::read_loop, this, connection), connection});
+            }
+            catch (const std::exception &ex)
+            {
+                // The connection (and its socket) goes away with the failed Reader
+                logger->error("Failed to start a sidecar connection: {}", ex.what());
+            }
+        }
+    }
+
+    void SidecarServer::reap_readers(bool all) noexcept
+    {
+        std::vector<Reader> finished;
+        {
+            std::lock_guard lock(readers_mutex_);
+            for (auto it = readers_.begin(); it != readers_.end();)
+            {
+                if (all || it->connection->reader_done)
+                {
+                    if (all)
+                    {
+                        // Ends the read loop; requests already submitted still get their responses
+                        ::shutdown(it->connection->fd, SHUT_RD);
+                    }
+                    finished.push_back(std::move(*it));
+                    it = readers_.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+        for (auto &reader : finished)
+        {
+            reader.thread.join();
+        }
+    }
+
+    void SidecarServer::read_loop(std::shared_ptr<Connection> connection) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        unsigned char header[4 + request_header_size];
+        PassedFd passed_fd;
+        while (!stopping_ && read_exact(connection->fd, header, 4, &passed_fd))
+        {
+            uint32_t length = load_le<uint32_t>(header);
+            if (length < request_header_size || length - request_header_size > max_image_bytes_)
+            {
+                // The stream cannot be resynchronised after a bad length, so the connection is dropped
+                CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::warn, Logger::request_errors_per_second, "Closing sidecar connection after a frame of {} bytes", length);
+                respond(*connection, protocol_error_id, tl::unexpected(std::format("Frame length {} is outside 24..{}", length, max_image_bytes_ + request_header_size)));
+                break;
+            }
+            if (!read_exact(connection->fd, header + 4, request_header_size))
+            {
+                break;
+            }
+
+            try
+            {
+                std::vector<unsigned char> payload(length - request_header_size);
+                if (!read_exact(connection->fd, payload.data(), payload.size()))
+                {
+                    break;
+                }
+                submit(connection, parse_request_header(header + 4), std::move(payload), passed_fd.fd);
+            }
+            catch (const std::exception &ex)
+            {
+                logger->error("Failed to read a sidecar request: {}", ex.what());
+                break;
+            }
+            passed_fd.reset();
+        }
+        connection->reader_done = true;
+    }
+
+    SidecarServer::RequestHeader SidecarServer::parse_request_header(const unsigned char *header) noexcept
+    {
+        RequestHeader parsed;
+        parsed.request_id = load_le<uint64_t>(header);
+        parsed.payload_type = header[8];
+        parsed.beam_width = load_le<uint16_t>(header + 10);
+        parsed.max_length = load_le<uint16_t>(header + 12);
+        parsed.n_best = load_le<uint16_t>(header + 14);
+        parsed.length_penalty = std::bit_cast<float>(load_le<uint32_t>(header + 16));
+        parsed.timeout_ms = load_le<uint32_t>(header + 20);
+        return parsed;
+    }
+
+    void SidecarServer::submit(const std::shared_ptr<Connection> &connection, const RequestHeader &header, std::vector<unsigned char> payload, int passed_fd) noexcept
+    {
+        const auto type = static_cast<PayloadType>(header.payload_type);
+        if (type == PayloadType::attach_region)
+        {
+#ifdef __linux__
+            auto error = attach_region(*connection, payload, passed_fd);
+            respond(*connection, header.request_id, error.empty() ? tl::expected<CaptionResult, std::string>(CaptionResult{}) : tl::unexpected(error));
+#else
+            // Only sealed memfds are safe to map, and file sealing is Linux-only
+            respond(*connection, header.request_id, tl::unexpected(std::format("Unsupported payload type {}", header.payload_type)));
+#endif
+            return;
+        }
+        if (passed_fd >= 0)
+        {
+            respond(*connection, header.request_id, tl::unexpected(std::string("Only attach requests may carry a descriptor")));
+            return;
+        }
+
+        if (type == PayloadType::metrics)
+        {
+            try
+            {
+                respond(*connection, header.request_id, CaptionResult{Metrics::snapshot().to_prometheus(), false, {}});
+            }
+            catch (const std::exception &ex)
+            {
+                respond(*connection, header.request_id, tl::unexpected("Failed to export metrics: " + std::string(ex.what())));
+            }
+            return;
+        }
+
+        ImageInput image;
+        std::shared_ptr<const MappedFile> region;
+        if (type == PayloadType::image)
+        {
+            image = std::move(payload);
+        }
+        else if (type == PayloadType::region_image || type == PayloadType::region_rgb || type == PayloadType::detach_region)
+        {
+            const size_t expected_size = type == PayloadType::region_image ? 20 : type == PayloadType::region_rgb ? 24 : 4;
+            if (payload.size() != expected_size)
+            {
+                respond(*connection, header.request_id, tl::unexpected(std::format("Payload type {} needs {} bytes, got {}", header.payload_type, expected_size, payload.size())));
+                return;
+            }
+            uint32_t region_id = load_le<uint32_t>(payload.data());
+            auto it = connection->regions.find(region_id);
+            if (it == connection->regions.end())
+            {
+                respond(*connection, header.request_id, tl::unexpected(std::format("No shared region {} is attached", region_id)));
+                return;
+            }
+            if (type == PayloadType::detach_region)
+            {
+                connection->regions.erase(it);
+                respond(*connection, header.request_id, CaptionResult{});
+                return;
+            }
+            region = it->second;
+
+            uint64_t offset = load_le<uint64_t>(payload.data() + 4);
+            const auto *bytes = reinterpret_cast<const unsigned char *>(region->data());
+            if (offset > region->size())
+            {
+                respond(*connection, header.request_id, tl::unexpected(std::format("Offset {} is past the end of shared region {}", offset, region_id)));
+                return;
+            }
+            // Read in place: the image is decoded (or converted) straight from the client's pages
+            std::span<const unsigned char> available(bytes + offset, region->size() - offset);
+            if (type == PayloadType::region_image)
+            {
+                uint64_t size = load_le<uint64_t>(payload.data() + 12);
+                if (size > available.size())
+                {
+                    respond(*connection, header.request_id, tl::unexpected(std::format("Image of {} bytes at {} overruns shared region {}", size, offset, region_id)));
+                    return;
+                }
+                image = ImageBuffer(available.first(size));
+            }
+            else
+            {
+                RawImage raw;
+                raw.width = static_cast<int>(load_le<uint32_t>(payload.data() + 12));
+                raw.height = static_cast<int>(load_le<uint32_t>(payload.data() + 16));
+                raw.stride = load_le<uint32_t>(payload.data() + 20);
+                if (raw.stride == 0)
+                {
+                    raw.stride = static_cast<size_t>(raw.width) * 3;
+                }
+                // load_rgb checks the frame fits
+                raw.pixels = available;
+                image = raw;
+            }
+        }
+        else
+        {
+            respond(*connection, header.request_id, tl::unexpected(std::format("Unsupported payload type {}", header.payload_type)));
+            return;
+        }
+
+        // Queued on the current generator's executor; if a reload retires it meanwhile, it finishes this request first
+        const auto generator = generators_.current();
+        DecodeOptions options = generator->decode_options();
+        if (header.beam_width != 0)
+        {
+            options.beam_width = header.beam_width;
+        }
+        if (header.max_length != 0)
+        {
+            options.max_length = header.max_length;
+        }
+        if (header.n_best != 0)
+        {
+            options.n_best = header.n_best;
+        }
+        if (header.length_penalty >= 0.0f)
+        {
+            options.length_penalty = header.length_penalty;
+        }
+
+        CancellationToken cancel;
+        try
+        {
+            if (header.timeout_ms != 0)
+            {
+                cancel = CancellationToken::with_timeout(std::chrono::milliseconds(header.timeout_ms));
+            }
+        }
+        catch (const std::exception &ex)
+        {
+            respond(*connection, header.request_id, tl::unexpected("Failed to set up the request deadline: " + std::string(ex.what())));
+            return;
+        }
+
+        // The callback keeps the region mapped until the request is done with it, even if it is detached meanwhile
+        generator->generate_async(std::move(image), options, std::move(cancel), [connection, region, request_id = header.request_id](tl::expected<CaptionResult, std::string> result)
+                                  { respond(*connection, request_id, result); });
+    }
+
+#ifdef __linux__
+    std::string SidecarServer::attach_region(Connection &connection, std::span<const unsigned char> payload, int passed_fd) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        if (payload.size() != 4 || passed_fd < 0)
+        {
+            return "An attach request needs a 4-byte region id and a descriptor sent with SCM_RIGHTS";
+        }
+        // A client shrinking the file under the mapping would crash the server with SIGBUS on the next read
+        int seals = ::fcntl(passed_fd, F_GET_SEALS);
+        if (seals < 0 || !(seals & F_SEAL_SHRINK))
+        {
+            return "Shared region must be a memfd sealed with F_SEAL_SHRINK";
+        }
+
+        auto mapped = MappedFile::from_fd(passed_fd);
+        if (!mapped)
+        {
+            logger->warn("Failed to map shared region: {}", mapped.error());
+            return "Failed to map shared region: " + mapped.error();
+        }
+
+        try
+        {
+            uint32_t region_id = load_le<uint32_t>(payload.data());
+            logger->info("Attached shared region {} ({} bytes)", region_id, mapped->size());
+            connection.regions[region_id] = std::make_shared<const MappedFile>(std::move(*mapped));
+        }
+        catch (const std::exception &ex)
+        {
+            return "Failed to attach shared region: " + std::string(ex.what());
+        }
+        return {};
+    }
+#endif
+
+    std::string SidecarServer::encode_response(uint64_t request_id, const tl::expected<CaptionResult, std::string> &result)
+    {
+        std::vector<std::string_view> texts;
+        if (result)
+        {
+            texts.push_back(result->caption);
+            texts.insert(texts.end(), result->alternatives.begin(), result->alternatives.end());
+        }
+        else
+        {
+            texts.push_back(result.error());
+        }
+
+        std::string frame;
+        append_le<uint32_t>(frame, 0);
+        append_le<uint64_t>(frame, request_id);
+        frame.push_back(static_cast<char>(result ? 0 : 1));
+        frame.push_back(static_cast<char>(result && result->truncated ? 1 : 0));
+        append_le<uint16_t>(frame, static_cast<uint16_t>(texts.size()));
+        for (std::string_view text : texts)
+        {
+            append_le<uint32_t>(frame, static_cast<uint32_t>(text.size()));
+            frame.append(text);
+        }
+
+        uint32_t length = static_cast<uint32_t>(frame.size() - 4);
+        for (size_t i = 0; i < 4; ++i)
+        {
+            frame[i] = static_cast<char>((length >> (8 * i)) & 0xFF);
+        }
+        return frame;
+    }
+
+    void SidecarServer::respond(Connection &connection, uint64_t request_id, const tl::expected<CaptionResult, std::string> &result) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        try
+        {
+            std::string frame = encode_response(request_id, result);
+            std::lock_guard lock(connection.write_mutex);
+            if (connection.broken)
+            {
+                return;
+            }
+            std::string_view remaining = frame;
+            while (!remaining.empty())
+            {
+                ssize_t sent = Sockets::send(connection.fd, remaining.data(), remaining.size());
+                if (sent < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (sent <= 0)
+                {
+                    // A partial frame leaves the stream unusable, so nothing more is sent on it
+                    CAPTIONING_LOG_RATE_LIMITED(logger, spdlog::level::warn, Logger::request_errors_per_second, "Failed to send sidecar response {}: {}", request_id, std::strerror(errno));
+                    connection.broken = true;
+                    ::shutdown(connection.fd, SHUT_RDWR);
+                    return;
+                }
+                remaining.remove_prefix(static_cast<size_t>(sent));
+            }
+        }
+        catch (const std::exception &ex)
+        {
+            logger->error("Failed to encode sidecar response {}: {}", request_id, ex.what());
+        }
+    }
+}
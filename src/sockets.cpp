@@ -0,0 +1,85 @@
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "sockets.hpp"
+
+namespace captioning
+{
+    int Sockets::open(int domain, int type, int protocol, bool nonblocking) noexcept
+    {
+        int fd = ::socket(domain, type, protocol);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        if (!configure(fd, nonblocking))
+        {
+            const int error = errno;
+            ::close(fd);
+            errno = error;
+            return -1;
+        }
+        return fd;
+    }
+
+    int Sockets::accept(int listen_fd) noexcept
+    {
+        int fd = ::accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        if (!configure(fd, false))
+        {
+            const int error = errno;
+            ::close(fd);
+            errno = error;
+            return -1;
+        }
+        return fd;
+    }
+
+    ssize_t Sockets::send(int fd, const void *data, size_t size) noexcept
+    {
+#ifdef MSG_NOSIGNAL
+        return ::send(fd, data, size, MSG_NOSIGNAL);
+#else
+        // configure() set SO_NOSIGPIPE instead
+        return ::send(fd, data, size, 0);
+#endif
+    }
+
+    bool Sockets::set_close_on_exec(int fd) noexcept
+    {
+        int flags = ::fcntl(fd, F_GETFD);
+        return flags >= 0 && ::fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == 0;
+    }
+
+    bool Sockets::configure(int fd, bool nonblocking) noexcept
+    {
+        if (!set_close_on_exec(fd))
+        {
+            return false;
+        }
+        int flags = ::fcntl(fd, F_GETFL);
+        if (flags < 0)
+        {
+            return false;
+        }
+        int wanted = nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+        if (wanted != flags && ::fcntl(fd, F_SETFL, wanted) != 0)
+        {
+            return false;
+        }
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+        int on = 1;
+        if (::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) != 0)
+        {
+            return false;
+        }
+#endif
+        return true;
+    }
+}
@@ -0,0 +1,392 @@
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <pthread.h>
+#endif
+#include <onnxruntime_cxx_api.h>
+#include <nlohmann/json.hpp>
+
+#include "tracing.hpp"
+#include "logger.hpp"
+
+namespace captioning
+{
+    std::atomic<bool> Tracing::enabled_ = false;
+
+    namespace
+    {
+        struct TraceEvent
+        {
+            std::string_view category;
+            std::string_view name;
+            int64_t start_ns;
+            int64_t duration_ns;
+        };
+
+        constexpr size_t chunk_events = 4096;
+
+        // Written by one thread only: an event is filled in before size is raised past it (release), so a reader
+        // that loads size (acquire) sees complete events, and published events never change. Once next is set the
+        // writer has moved on from the chunk for good.
+        struct TraceChunk
+        {
+            std::array<TraceEvent, chunk_events> events;
+            // Of the thread that recorded the events; set before the chunk is published
+            int tid = 0;
+            std::atomic<size_t> size = 0;
+            std::atomic<TraceChunk *> next = nullptr;
+        };
+
+        // A thread's buffer; once the thread exits, the next new thread takes it over
+        struct ThreadTrace
+        {
+            // Of the thread using the buffer; set under the state mutex when a thread takes it over
+            int tid = 0;
+            // Oldest chunk not written out yet, and how many of its events were; write() only. write() frees the
+            // chunks before head once it has written them.
+            std::unique_ptr<TraceChunk> head = std::make_unique<TraceChunk>();
+            size_t written = 0;
+            // Owner only
+            TraceChunk *tail = head.get();
+            // Chunks from head to tail; the owner adds them and write() frees them
+            std::atomic<size_t> chunks = 1;
+            std::atomic<uint64_t> dropped = 0;
+            // Under the state mutex
+            bool in_use = true;
+
+            ~ThreadTrace()
+            {
+                // The chunks after head are owned through the next links
+                for (TraceChunk *chunk = head->next.load(); chunk;)
+                {
+                    delete std::exchange(chunk, chunk->next.load());
+                }
+            }
+        };
+
+        struct OnnxRuntimeProfile
+        {
+            std::string path;
+            uint64_t start_ns; // system clock
+        };
+
+        struct TraceState
+        {
+            std::mutex mutex;
+            std::string output_path;
+            std::string profile_prefix;
+            std::chrono::steady_clock::time_point epoch;
+            int64_t epoch_system_ns = 0;
+            // A deque never moves its elements, so threads keep stable pointers to their buffers
+            std::deque<ThreadTrace> threads;
+            size_t traced_threads = 0;
+            std::vector<Ort::Session *> sessions;
+            std::vector<OnnxRuntimeProfile> profiles;
+        };
+
+        TraceState &state() noexcept
+        {
+            // Never destroyed: threads still running during static destruction may record
+            static TraceState *instance = new TraceState;
+            return *instance;
+        }
+
+        // The id perf and top show, where the system has one; otherwise the order in which threads first traced
+        int thread_id([[maybe_unused]] size_t traced_threads) noexcept
+        {
+#if defined(__linux__)
+            return static_cast<int>(::gettid());
+#elif defined(__APPLE__)
+            uint64_t id = 0;
+            ::pthread_threadid_np(nullptr, &id);
+            return static_cast<int>(id);
+#else
+            return static_cast<int>(traced_threads);
+#endif
+        }
+
+        struct ThreadSlot
+        {
+            ThreadTrace *trace = nullptr;
+
+            ~ThreadSlot()
+            {
+                if (trace)
+                {
+                    std::lock_guard lock(state().mutex);
+                    trace->in_use = false;
+                }
+            }
+        };
+
+        ThreadTrace &thread_trace()
+        {
+            thread_local ThreadSlot slot;
+            if (!slot.trace)
+            {
+                TraceState &shared = state();
+                std::lock_guard lock(shared.mutex);
+                ThreadTrace *trace = nullptr;
+                for (ThreadTrace &released : shared.threads)
+                {
+                    if (!released.in_use)
+                    {
+                        trace = &released;
+                        break;
+                    }
+                }
+                if (!trace)
+                {
+                    trace = &shared.threads.emplace_back();
+                }
+                trace->tid = thread_id(++shared.traced_threads);
+                // Otherwise record() starts a new chunk, so spans of the previous owner keep their tid
+                if (trace->tail->size.load(std::memory_order_relaxed) == 0)
+                {
+                    trace->tail->tid = trace->tid;
+                }
+                trace->in_use = true;
+                slot.trace = trace;
+            }
+            return *slot.trace;
+        }
+
+        // Must be called with the state locked
+        void end_profiling(TraceState &shared, Ort::Session &session)
+        {
+            const uint64_t start_ns = session.GetProfilingStartTimeNs();
+            Ort::AllocatorWithDefaultOptions allocator;
+            Ort::AllocatedStringPtr path = session.EndProfilingAllocated(allocator);
+            shared.profiles.push_back(OnnxRuntimeProfile{path.get(), start_ns});
+        }
+
+        std::string expand_pid(std::string path)
+        {
+            const std::string pid = std::to_string(::getpid());
+            for (size_t at = path.find("{pid}"); at != std::string::npos; at = path.find("{pid}", at + pid.size()))
+            {
+                path.replace(at, 5, pid);
+            }
+            return path;
+        }
+    }
+
+    void Tracing::enable(const std::string &output_path, bool onnxruntime_profiling) noexcept
+    {
+        TraceState &shared = state();
+        std::lock_guard lock(shared.mutex);
+        if (enabled_.load(std::memory_order_relaxed) || output_path.empty())
+        {
+            return;
+        }
+        try
+        {
+            shared.output_path = output_path;
+            if (onnxruntime_profiling)
+            {
+                shared.profile_prefix = output_path + ".onnxruntime";
+            }
+            shared.epoch = std::chrono::steady_clock::now();
+            shared.epoch_system_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            enabled_.store(true, std::memory_order_release);
+            Logger::get_logger()->info("Tracing to {}{}", output_path, onnxruntime_profiling ? " with ONNX Runtime profiling" : "");
+        }
+        catch (const std::exception &ex)
+        {
+            Logger::get_logger()->error("Failed to enable tracing: {}", ex.what());
+        }
+    }
+
+    std::string Tracing::onnxruntime_profile_prefix() noexcept
+    {
+        TraceState &shared = state();
+        std::lock_guard lock(shared.mutex);
+        return shared.profile_prefix.empty() ? std::string() : expand_pid(shared.profile_prefix);
+    }
+
+    void Tracing::record(std::string_view category, std::string_view name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) noexcept
+    {
+        try
+        {
+            ThreadTrace &trace = thread_trace();
+            TraceChunk *chunk = trace.tail;
+            size_t size = chunk->size.load(std::memory_order_relaxed);
+            if (size == chunk_events || chunk->tid != trace.tid)
+            {
+                if (trace.chunks.load(std::memory_order_relaxed) * chunk_events >= max_events_per_thread)
+                {
+                    trace.dropped.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                auto *next = new TraceChunk;
+                next->tid = trace.tid;
+                chunk->next.store(next, std::memory_order_release);
+                trace.tail = chunk = next;
+                trace.chunks.fetch_add(1, std::memory_order_relaxed);
+                size = 0;
+            }
+
+            const auto epoch = state().epoch;
+            chunk->events[size] = TraceEvent{category, name, std::chrono::duration_cast<std::chrono::nanoseconds>(start - epoch).count(), std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()};
+            chunk->size.store(size + 1, std::memory_order_release);
+        }
+        catch (const std::exception &)
+        {
+            // Tracing must never fail the traced work; an event that can't be stored is lost
+        }
+    }
+
+    void Tracing::watch_session(Ort::Session &session) noexcept
+    {
+        TraceState &shared = state();
+        std::lock_guard lock(shared.mutex);
+        try
+        {
+            shared.sessions.push_back(&session);
+        }
+        catch (const std::exception &ex)
+        {
+            Logger::get_logger()->warn("Failed to watch a profiling session: {}", ex.what());
+        }
+    }
+
+    void Tracing::release_session(Ort::Session &session) noexcept
+    {
+        TraceState &shared = state();
+        std::lock_guard lock(shared.mutex);
+        auto it = std::ranges::find(shared.sessions, &session);
+        if (it == shared.sessions.end())
+        {
+            return;
+        }
+        shared.sessions.erase(it);
+        try
+        {
+            end_profiling(shared, session);
+        }
+        catch (const std::exception &ex)
+        {
+            Logger::get_logger()->warn("Failed to collect an ONNX Runtime profile: {}", ex.what());
+        }
+    }
+
+    std::string Tracing::write() noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        if (!enabled())
+        {
+            return "Tracing is not enabled";
+        }
+
+        TraceState &shared = state();
+        std::lock_guard lock(shared.mutex);
+        const int pid = static_cast<int>(::getpid());
+        try
+        {
+            for (Ort::Session *session : shared.sessions)
+            {
+                end_profiling(shared, *session);
+            }
+            shared.sessions.clear();
+
+            const std::filesystem::path path = expand_pid(shared.output_path);
+            const std::filesystem::path partial = path.string() + ".partial";
+            std::ofstream out(partial, std::ios::trunc);
+            if (!out.is_open())
+            {
+                return "Failed to open " + partial.string();
+            }
+
+            std::string line;
+            bool first = true;
+            auto emit = [&](const std::string &event)
+            {
+                out << (first ? "\n" : ",\n") << event;
+                first = false;
+            };
+
+            out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+            emit(std::format(R"({{"name":"process_name","ph":"M","pid":{},"args":{{"name":"image_captioning"}}}})", pid));
+            // Each write takes the spans recorded since the previous one and frees them, so the buffers never fill up
+            // for good in a long-running process
+            size_t events = 0;
+            for (ThreadTrace &trace : shared.threads)
+            {
+                while (true)
+                {
+                    // next first: once it is set, size is final
+                    TraceChunk *next = trace.head->next.load(std::memory_order_acquire);
+                    const size_t size = trace.head->size.load(std::memory_order_acquire);
+                    for (size_t i = trace.written; i < size; ++i)
+                    {
+                        const TraceEvent &event = trace.head->events[i];
+                        line.clear();
+                        std::format_to(std::back_inserter(line), R"({{"name":"{}","cat":"{}","ph":"X","ts":{:.3f},"dur":{:.3f},"pid":{},"tid":{}}})",
+                                       event.name, event.category, static_cast<double>(event.start_ns) / 1e3, static_cast<double>(event.duration_ns) / 1e3, pid, trace.head->tid);
+                        emit(line);
+                    }
+                    events += size - trace.written;
+                    trace.written = size;
+                    if (!next)
+                    {
+                        break;
+                    }
+                    trace.head.reset(next);
+                    trace.written = 0;
+                    trace.chunks.fetch_sub(1, std::memory_order_relaxed);
+                }
+                if (const uint64_t dropped = trace.dropped.exchange(0, std::memory_order_relaxed); dropped > 0)
+                {
+                    emit(std::format(R"({{"name":"dropped_spans","ph":"i","s":"t","ts":0,"pid":{},"tid":{},"args":{{"count":{}}}}})", pid, trace.head->tid, dropped));
+                }
+            }
+
+            // ONNX Runtime timestamps are microseconds from the session's profiling start
+            for (const OnnxRuntimeProfile &profile : shared.profiles)
+            {
+                std::ifstream in(profile.path);
+                nlohmann::json ort_events = nlohmann::json::parse(in, nullptr, false);
+                if (!ort_events.is_array())
+                {
+                    logger->warn("Skipping unreadable ONNX Runtime profile {}", profile.path);
+                    continue;
+                }
+                const double offset_us = static_cast<double>(static_cast<int64_t>(profile.start_ns) - shared.epoch_system_ns) / 1e3;
+                for (auto &event : ort_events)
+                {
+                    if (!event.is_object() || !event.contains("ts") || !event["ts"].is_number())
+                    {
+                        continue;
+                    }
+                    event["ts"] = event["ts"].get<double>() + offset_us;
+                    event["pid"] = pid;
+                    emit(event.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace));
+                    ++events;
+                }
+            }
+            shared.profiles.clear();
+            out << "\n]}\n";
+            out.close();
+            if (!out)
+            {
+                return "Failed to write " + partial.string();
+            }
+            std::filesystem::rename(partial, path);
+            logger->info("Wrote {} trace event(s) to {}", events, path.string());
+            return {};
+        }
+        catch (const std::exception &ex)
+        {
+            return "Failed to write the trace: " + std::string(ex.what());
+        }
+    }
+}
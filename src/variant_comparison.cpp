@@ -0,0 +1,190 @@
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <sstream>
+#include <unordered_map>
+
+#include "variant_comparison.hpp"
+#include "caption_generator.hpp"
+#include "logger.hpp"
+#include "expected.hpp"
+
+namespace captioning
+{
+    namespace
+    {
+        double percentile(std::vector<double> &sorted_ms, double p) noexcept
+        {
+            if (sorted_ms.empty())
+            {
+                return 0.0;
+            }
+            size_t rank = static_cast<size_t>(p * static_cast<double>(sorted_ms.size() - 1) + 0.5);
+            return sorted_ms[std::min(rank, sorted_ms.size() - 1)];
+        }
+
+        std::string format_stats(const VariantStats &stats)
+        {
+            return std::format("{:<10} {:<6} {:>7.2f} img/s  mean {:>8.2f} ms  p50 {:>8.2f} ms  p90 {:>8.2f} ms  p99 {:>8.2f} ms  failures {}",
+                               stats.variant, stats.precision, stats.images_per_second, stats.mean_ms, stats.p50_ms, stats.p90_ms, stats.p99_ms, stats.failures);
+        }
+    }
+
+    std::string ComparisonReport::to_string() const noexcept
+    {
+        double speedup = baseline.images_per_second > 0.0 ? candidate.images_per_second / baseline.images_per_second : 0.0;
+        double exact_rate = compared > 0 ? 100.0 * static_cast<double>(exact_matches) / static_cast<double>(compared) : 0.0;
+
+        std::string report;
+        report += format_stats(baseline) + "\n";
+        report += format_stats(candidate) + "\n";
+        report += std::format("speedup {:.2f}x, exact caption match {}/{} ({:.1f}%), mean word F1 {:.3f}",
+                              speedup, exact_matches, compared, exact_rate, mean_word_f1);
+        return report;
+    }
+
+    tl::expected<ComparisonReport, std::string> VariantComparison::run(const Config &config, const std::string &baseline_variant, const std::string &candidate_variant, std::span<const std::string> image_paths) noexcept
+    {
+        if (image_paths.empty())
+        {
+            return tl::unexpected("No images to compare");
+        }
+
+        auto baseline = run_variant(config, baseline_variant, image_paths);
+        if (!baseline)
+        {
+            return tl::unexpected(baseline.error());
+        }
+        auto candidate = run_variant(config, candidate_variant, image_paths);
+        if (!candidate)
+        {
+            return tl::unexpected(candidate.error());
+        }
+
+        ComparisonReport report;
+        report.baseline = baseline->stats;
+        report.candidate = candidate->stats;
+
+        double f1_sum = 0.0;
+        for (size_t i = 0; i < image_paths.size(); ++i)
+        {
+            const auto &a = baseline->captions[i];
+            const auto &b = candidate->captions[i];
+            if (!a || !b)
+            {
+                continue;
+            }
+            ++report.compared;
+            if (*a == *b)
+            {
+                ++report.exact_matches;
+            }
+            else
+            {
+                SPDLOG_LOGGER_DEBUG(Logger::get_logger(), "Caption mismatch for {}: '{}' vs '{}'", image_paths[i], *a, *b);
+            }
+            f1_sum += word_f1(*a, *b);
+        }
+        report.mean_word_f1 = report.compared > 0 ? f1_sum / static_cast<double>(report.compared) : 0.0;
+        return report;
+    }
+
+    tl::expected<VariantComparison::VariantRun, std::string> VariantComparison::run_variant(const Config &config, const std::string &variant, std::span<const std::string> image_paths) noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        auto variant_config = config.with_model_variant(variant);
+        if (!variant_config)
+        {
+            return tl::unexpected(variant_config.error());
+        }
+        auto generator = CaptionGenerator::create(*variant_config);
+        if (!generator)
+        {
+            return tl::unexpected(generator.error());
+        }
+
+        // One untimed call so session warm-up (allocator arenas, prepacking) doesn't land in the percentiles
+        (void)generator->generate(image_paths.front());
+
+        VariantRun result;
+        result.stats.variant = variant_config->model_variant();
+        result.stats.precision = variant_config->model_precision();
+        result.stats.images = image_paths.size();
+        result.captions.reserve(image_paths.size());
+
+        std::vector<double> latencies_ms;
+        latencies_ms.reserve(image_paths.size());
+
+        auto wall_start = std::chrono::steady_clock::now();
+        for (const auto &image_path : image_paths)
+        {
+            auto start = std::chrono::steady_clock::now();
+            auto caption = generator->generate(image_path);
+            latencies_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            if (!caption)
+            {
+                ++result.stats.failures;
+            }
+            result.captions.push_back(std::move(caption));
+        }
+        result.stats.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+
+        std::ranges::sort(latencies_ms);
+        double total_ms = 0.0;
+        for (double ms : latencies_ms)
+        {
+            total_ms += ms;
+        }
+        result.stats.mean_ms = total_ms / static_cast<double>(latencies_ms.size());
+        result.stats.p50_ms = percentile(latencies_ms, 0.50);
+        result.stats.p90_ms = percentile(latencies_ms, 0.90);
+        result.stats.p99_ms = percentile(latencies_ms, 0.99);
+        result.stats.images_per_second = result.stats.wall_seconds > 0.0 ? static_cast<double>(image_paths.size()) / result.stats.wall_seconds : 0.0;
+
+        logger->info("Variant {} ({}): {:.2f} img/s, p50 {:.2f} ms, p99 {:.2f} ms", result.stats.variant, result.stats.precision,
+                     result.stats.images_per_second, result.stats.p50_ms, result.stats.p99_ms);
+        return result;
+    }
+
+    double VariantComparison::word_f1(const std::string &a, const std::string &b) noexcept
+    {
+        auto count_words = [](const std::string &text)
+        {
+            std::unordered_map<std::string, int> counts;
+            std::istringstream stream(text);
+            for (std::string word; stream >> word;)
+            {
+                ++counts[word];
+            }
+            return counts;
+        };
+
+        auto counts_a = count_words(a);
+        auto counts_b = count_words(b);
+        int total_a = 0, total_b = 0, overlap = 0;
+        for (const auto &[word, count] : counts_a)
+        {
+            total_a += count;
+            if (auto it = counts_b.find(word); it != counts_b.end())
+            {
+                overlap += std::min(count, it->second);
+            }
+        }
+        for (const auto &[word, count] : counts_b)
+        {
+            total_b += count;
+        }
+        if (total_a == 0 && total_b == 0)
+        {
+            return 1.0;
+        }
+        if (overlap == 0)
+        {
+            return 0.0;
+        }
+        double precision = static_cast<double>(overlap) / total_b;
+        double recall = static_cast<double>(overlap) / total_a;
+        return 2.0 * precision * recall / (precision + recall);
+    }
+}
@@ -1,4 +1,9 @@
 #include <fstream>
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <numeric>
+#include <unordered_map>
 #include <nlohmann/json.hpp>
 
 #include "vocabulary.hpp"
@@ -7,6 +12,60 @@
 
 namespace captioning
 {
+    namespace
+    {
+        constexpr char magic[4] = {'C', 'V', 'O', 'C'};
+        constexpr uint32_t format_version = 1;
+        constexpr size_t header_size = 24;
+        constexpr uint32_t empty_slot = 0xFFFFFFFFu;
+        // Average keys per hash bucket; larger builds a smaller table but takes longer to find seeds
+        constexpr uint32_t keys_per_bucket = 4;
+        constexpr int32_t max_seed = 1 << 24;
+
+        uint64_t hash_token(std::string_view token) noexcept
+        {
+            // FNV-1a
+            uint64_t h = 14695981039346656037ull;
+            for (unsigned char c : token)
+            {
+                h ^= c;
+                h *= 1099511628211ull;
+            }
+            return h;
+        }
+
+        uint64_t mix(uint64_t x) noexcept
+        {
+            // splitmix64 finalizer
+            x ^= x >> 30;
+            x *= 0xbf58476d1ce4e5b9ull;
+            x ^= x >> 27;
+            x *= 0x94d049bb133111ebull;
+            x ^= x >> 31;
+            return x;
+        }
+
+        uint32_t bucket_of(uint64_t h, uint32_t bucket_count) noexcept
+        {
+            return static_cast<uint32_t>(mix(h) % bucket_count);
+        }
+
+        uint32_t slot_of(uint64_t h, int32_t seed, uint32_t slot_count) noexcept
+        {
+            return static_cast<uint32_t>(mix(h ^ (static_cast<uint64_t>(seed) * 0x9e3779b97f4a7c15ull)) % slot_count);
+        }
+
+        // The image is written and mapped in host byte order, which the format fixes as little-endian
+        static_assert(std::endian::native == std::endian::little, "binary vocabularies are read in place and need a little-endian host");
+
+        template <typename T>
+        void append(std::vector<char> &image, const T &value)
+        {
+            const char *bytes = reinterpret_cast<const char *>(&value);
+            image.insert(image.end(), bytes, bytes + sizeof(T));
+        }
+    }
+
     tl::expected<Vocabulary, std::string> Vocabulary::from_file(const std::filesystem::path &vocab_path) noexcept
     {
         Vocabulary vocab;
@@ -21,25 +80,63 @@ namespace captioning
     {
         auto logger = Logger::get_logger();
 
-        std::ifstream vocab_file(vocab_path);
+        std::ifstream vocab_file(vocab_path, std::ios::binary);
         if (!vocab_file.is_open())
         {
             logger->error("Failed to open vocabulary file: {}", vocab_path.string());
             return "Failed to open vocabulary file: " + vocab_path.string();
         }
 
+        char file_magic[sizeof(magic)] = {};
+        vocab_file.read(file_magic, sizeof(file_magic));
+        if (vocab_file.gcount() == sizeof(magic) && std::memcmp(file_magic, magic, sizeof(magic)) == 0)
+        {
+            vocab_file.close();
+            auto mapping = MappedFile::open(vocab_path);
+            if (!mapping)
+            {
+                return "Failed to load vocabulary file: " + mapping.error();
+            }
+            if (auto error = attach({mapping->data(), mapping->size()}); !error.empty())
+            {
+                logger->error("Invalid binary vocabulary {}: {}", vocab_path.string(), error);
+                return "Invalid binary vocabulary " + vocab_path.string() + ": " + error;
+            }
+            mapping_ = std::move(*mapping);
+            if (auto error = resolve_special_tokens(); !error.empty())
+            {
+                logger->error("Invalid vocabulary {}: {}", vocab_path.string(), error);
+                return "Invalid vocabulary " + vocab_path.string() + ": " + error;
+            }
+            logger->info("Binary vocabulary mapped successfully with {} tokens", size());
+            return {};
+        }
+
         try
         {
+            vocab_file.clear();
+            vocab_file.seekg(0);
             nlohmann::json vocab_json;
             vocab_file >> vocab_json;
 
-            id_to_token_ = vocab_json.get<std::vector<std::string>>();
-            for (int i = 0; i < static_cast<int>(id_to_token_.size()); ++i)
+            auto image = build_image(vocab_json.get<std::vector<std::string>>());
+            if (!image)
+            {
+                logger->error("Failed to index vocabulary file {}: {}", vocab_path.string(), image.error());
+                return "Failed to index vocabulary file: " + image.error();
+            }
+            image_ = std::move(*image);
+            if (auto error = attach(image_); !error.empty())
             {
-                token_to_id_[id_to_token_[i]] = i;
+                return "Failed to index vocabulary file: " + error;
+            }
+            if (auto error = resolve_special_tokens(); !error.empty())
+            {
+                logger->error("Invalid vocabulary {}: {}", vocab_path.string(), error);
+                return "Invalid vocabulary " + vocab_path.string() + ": " + error;
             }
 
-            logger->info("Vocabulary loaded successfully with {} tokens", id_to_token_.size());
+            logger->info("Vocabulary loaded successfully with {} tokens", size());
             return {};
         }
         catch (const std::exception &ex)
@@ -49,22 +146,250 @@ namespace captioning
         }
     }
 
-    std::string Vocabulary::id_to_token(int id) const noexcept
+    std::string Vocabulary::attach(std::span<const char> image) noexcept
     {
-        if (id < 0 || id >= static_cast<int>(id_to_token_.size()))
+        if (image.size() < header_size || std::memcmp(image.data(), magic, sizeof(magic)) != 0)
+        {
+            return "bad header";
+        }
+        uint32_t header[5];
+        std::memcpy(header, image.data() + sizeof(magic), sizeof(header));
+        const auto [version, token_count, bucket_count, blob_size, reserved] = header;
+        (void)reserved;
+        if (version != format_version)
+        {
+            return "unsupported version " + std::to_string(version);
+        }
+        if (token_count == 0 || bucket_count == 0)
+        {
+            return "empty vocabulary";
+        }
+
+        const size_t offsets_size = sizeof(uint32_t) * (static_cast<size_t>(token_count) + 1);
+        const size_t seeds_size = sizeof(int32_t) * bucket_count;
+        const size_t slots_size = sizeof(uint32_t) * token_count;
+        if (image.size() != header_size + offsets_size + seeds_size + slots_size + blob_size)
+        {
+            return "size mismatch";
+        }
+
+        // Every array starts 4-byte aligned: the header is 24 bytes and the arrays hold 4-byte elements
+        const char *cursor = image.data() + header_size;
+        offsets_ = {reinterpret_cast<const uint32_t *>(cursor), static_cast<size_t>(token_count) + 1};
+        cursor += offsets_size;
+        seeds_ = {reinterpret_cast<const int32_t *>(cursor), bucket_count};
+        cursor += seeds_size;
+        slots_ = {reinterpret_cast<const uint32_t *>(cursor), token_count};
+        cursor += slots_size;
+        blob_ = {cursor, blob_size};
+
+        if (offsets_.front() != 0 || offsets_.back() != blob_size || !std::ranges::is_sorted(offsets_))
+        {
+            return "corrupt token offsets";
+        }
+        // lookup indexes slots_ with single-key seeds and tokens with slot values unchecked, so both are bounded here
+        if (std::ranges::any_of(seeds_, [&](int32_t seed)
+                                { return seed < 0 && static_cast<uint32_t>(-(static_cast<int64_t>(seed) + 1)) >= token_count; }))
+        {
+            return "corrupt hash seeds";
+        }
+        if (std::ranges::any_of(slots_, [&](uint32_t id)
+                                { return id != empty_slot && id >= token_count; }))
         {
-            return "<unk>";
+            return "corrupt hash slots";
         }
-        return id_to_token_[id];
+        return {};
     }
 
-    int Vocabulary::token_to_id(std::string_view token) const noexcept
+    std::string Vocabulary::resolve_special_tokens() noexcept
     {
-        auto it = token_to_id_.find(std::string(token));
-        if (it == token_to_id_.end())
+        start_id_ = lookup(get_start_token());
+        end_id_ = lookup(get_end_token());
+        pad_id_ = lookup(get_pad_token());
+        unk_id_ = lookup(get_unk_token());
+        if (start_id_ < 0 || end_id_ < 0)
         {
-            return token_to_id_.at("<unk>");
+            return "missing " + std::string(start_id_ < 0 ? get_start_token() : get_end_token()) + " token";
         }
-        return it->second;
+        return {};
+    }
+
+    tl::expected<std::vector<char>, std::string> Vocabulary::build_image(const std::vector<std::string> &tokens) noexcept
+    {
+        try
+        {
+            const uint32_t token_count = static_cast<uint32_t>(tokens.size());
+            if (token_count == 0)
+            {
+                return tl::unexpected("empty vocabulary");
+            }
+            const uint32_t bucket_count = std::max<uint32_t>(1, token_count / keys_per_bucket);
+
+            // A token listed twice resolves to its last id, as a map insert would
+            std::unordered_map<std::string_view, uint32_t> unique_ids;
+            for (uint32_t id = 0; id < token_count; ++id)
+            {
+                unique_ids[tokens[id]] = id;
+            }
+
+            std::vector<std::vector<uint32_t>> buckets(bucket_count);
+            for (const auto &[token, id] : unique_ids)
+            {
+                buckets[bucket_of(hash_token(token), bucket_count)].push_back(id);
+            }
+            std::vector<uint32_t> order(bucket_count);
+            std::iota(order.begin(), order.end(), 0);
+            std::ranges::stable_sort(order, std::ranges::greater{}, [&](uint32_t b)
+                                     { return buckets[b].size(); });
+
+            // Place the largest buckets first while the table is empty; single-key buckets take leftover slots directly
+            std::vector<int32_t> seeds(bucket_count, 0);
+            std::vector<uint32_t> slots(token_count, empty_slot);
+            std::vector<uint32_t> placed;
+            uint32_t next_free = 0;
+            for (uint32_t b : order)
+            {
+                const auto &bucket = buckets[b];
+                if (bucket.empty())
+                {
+                    break;
+                }
+                if (bucket.size() == 1)
+                {
+                    while (slots[next_free] != empty_slot)
+                    {
+                        ++next_free;
+                    }
+                    slots[next_free] = bucket.front();
+                    seeds[b] = -static_cast<int32_t>(next_free) - 1;
+                    continue;
+                }
+
+                int32_t seed = 1;
+                for (; seed < max_seed; ++seed)
+                {
+                    placed.clear();
+                    for (uint32_t id : bucket)
+                    {
+                        uint32_t slot = slot_of(hash_token(tokens[id]), seed, token_count);
+                        if (slots[slot] != empty_slot || std::ranges::find(placed, slot) != placed.end())
+                        {
+                            break;
+                        }
+                        placed.push_back(slot);
+                    }
+                    if (placed.size() == bucket.size())
+                    {
+                        break;
+                    }
+                }
+                if (seed == max_seed)
+                {
+                    return tl::unexpected("no perfect hash seed found");
+                }
+                for (size_t i = 0; i < bucket.size(); ++i)
+                {
+                    slots[placed[i]] = bucket[i];
+                }
+                seeds[b] = seed;
+            }
+
+            size_t blob_size = 0;
+            for (const auto &token : tokens)
+            {
+                blob_size += token.size();
+            }
+            if (blob_size > UINT32_MAX)
+            {
+                return tl::unexpected("token bytes exceed 4 GiB");
+            }
+
+            std::vector<char> image;
+            image.reserve(header_size + sizeof(uint32_t) * (2 * static_cast<size_t>(token_count) + 1 + bucket_count) + blob_size);
+            image.insert(image.end(), magic, magic + sizeof(magic));
+            append(image, format_version);
+            append(image, token_count);
+            append(image, bucket_count);
+            append(image, static_cast<uint32_t>(blob_size));
+            append(image, uint32_t{0});
+            uint32_t offset = 0;
+            append(image, offset);
+            for (const auto &token : tokens)
+            {
+                offset += static_cast<uint32_t>(token.size());
+                append(image, offset);
+            }
+            for (int32_t seed : seeds)
+            {
+                append(image, seed);
+            }
+            for (uint32_t slot : slots)
+            {
+                append(image, slot);
+            }
+            for (const auto &token : tokens)
+            {
+                image.insert(image.end(), token.begin(), token.end());
+            }
+            return image;
+        }
+        catch (const std::exception &ex)
+        {
+            return tl::unexpected(std::string(ex.what()));
+        }
+    }
+
+    std::string Vocabulary::write_binary(const std::filesystem::path &binary_path) const noexcept
+    {
+        auto logger = Logger::get_logger();
+
+        std::span<const char> image = mapping_ ? std::span<const char>(mapping_->data(), mapping_->size()) : std::span<const char>(image_);
+        std::ofstream binary_file(binary_path, std::ios::binary | std::ios::trunc);
+        if (!binary_file.is_open() || !binary_file.write(image.data(), static_cast<std::streamsize>(image.size())))
+        {
+            logger->error("Failed to write binary vocabulary: {}", binary_path.string());
+            return "Failed to write binary vocabulary: " + binary_path.string();
+        }
+
+        logger->info("Binary vocabulary written to {} ({} tokens, {} bytes)", binary_path.string(), size(), image.size());
+        return {};
+    }
+
+    int Vocabulary::lookup(std::string_view token) const noexcept
+    {
+        if (seeds_.empty())
+        {
+            return -1;
+        }
+        const uint64_t h = hash_token(token);
+        const int32_t seed = seeds_[bucket_of(h, static_cast<uint32_t>(seeds_.size()))];
+        const uint32_t slot = seed < 0 ? static_cast<uint32_t>(-(seed + 1)) : slot_of(h, seed, static_cast<uint32_t>(slots_.size()));
+        const uint32_t id = slots_[slot];
+        // The hash is only perfect for tokens in the table; anything else lands on an arbitrary slot
+        if (id == empty_slot || id_to_token(static_cast<int>(id)) != token)
+        {
+            return -1;
+        }
+        return static_cast<int>(id);
+    }
+
+    std::string_view Vocabulary::id_to_token(int id) const noexcept
+    {
+        if (id < 0 || id >= static_cast<int>(size()))
+        {
+            return get_unk_token();
+        }
+        return blob_.substr(offsets_[id], offsets_[id + 1] - offsets_[id]);
+    }
+
+    int Vocabulary::token_to_id(std::string_view token) const noexcept
+    {
+        int id = lookup(token);
+        return id < 0 ? unk_id_ : id;
+    }
+
+    bool Vocabulary::contains(std::string_view token) const noexcept
+    {
+        return lookup(token) >= 0;
     }
-}
\ No newline at end of file
+}
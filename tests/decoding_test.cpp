@@ -0,0 +1,118 @@
+#include <gtest/gtest.h>
+#include <utility>
+#include <vector>
+
+#include "model_inference.hpp"
+
+namespace captioning
+{
+    struct DecodingTest
+    {
+        using BeamState = ModelInference::BeamState;
+        using ImageBeams = ModelInference::ImageBeams;
+
+        static DecodeResult select_hypotheses(ImageBeams &image, const DecodeOptions &options, bool truncated = false)
+        {
+            return ModelInference::select_hypotheses(image, options, truncated);
+        }
+    };
+
+    namespace
+    {
+        using BeamState = DecodingTest::BeamState;
+        using ImageBeams = DecodingTest::ImageBeams;
+
+        constexpr int start_id = 1;
+        constexpr int end_id = 2;
+
+        // A finished hypothesis of generated_tokens tokens after the start token, the last being the end token
+        BeamState finished(int generated_tokens, float score, int filler = 5)
+        {
+            std::vector<int> sequence{start_id};
+            for (int i = 1; i < generated_tokens; ++i)
+            {
+                sequence.push_back(filler);
+            }
+            sequence.push_back(end_id);
+            return BeamState{std::move(sequence), score, true, {}};
+        }
+
+        DecodeOptions options(float length_penalty, int n_best = 1)
+        {
+            DecodeOptions decode;
+            decode.beam_width = 5;
+            decode.length_penalty = length_penalty;
+            decode.n_best = n_best;
+            return decode;
+        }
+
+        TEST(SelectHypotheses, RanksByLogProbabilityWithoutPenalty)
+        {
+            ImageBeams image;
+            image.finished = {finished(5, -2.5f), finished(2, -2.0f)};
+
+            DecodeResult result = DecodingTest::select_hypotheses(image, options(0.0f));
+
+            EXPECT_EQ(result.tokens.size(), 3u);
+            EXPECT_TRUE(result.alternatives.empty());
+            EXPECT_FALSE(result.truncated);
+        }
+
+        TEST(SelectHypotheses, LengthPenaltyFavoursLongerHypotheses)
+        {
+            // ((5 + 2) / 6)^1 = 1.17 and ((5 + 5) / 6)^1 = 1.67: -2.0 / 1.17 = -1.71 loses to -2.5 / 1.67 = -1.5
+            ImageBeams image;
+            image.finished = {finished(2, -2.0f), finished(5, -2.5f)};
+
+            DecodeResult result = DecodingTest::select_hypotheses(image, options(1.0f));
+
+            EXPECT_EQ(result.tokens.size(), 6u);
+        }
+
+        TEST(SelectHypotheses, PenaltyCountsOnlyGeneratedTokens)
+        {
+            // With alpha 1: -1.0 / (6 / 6) = -1.0 loses to -1.3 / (8 / 6) = -0.975. Counting the start token as well
+            // would turn it around: -1.0 / (7 / 6) = -0.857 against -1.3 / (9 / 6) = -0.867.
+            ImageBeams image;
+            image.finished = {finished(1, -1.0f), finished(3, -1.3f, 8)};
+
+            DecodeResult result = DecodingTest::select_hypotheses(image, options(1.0f));
+
+            ASSERT_EQ(result.tokens.size(), 4u);
+            EXPECT_EQ(result.tokens[1], 8);
+        }
+
+        TEST(SelectHypotheses, NBestReturnsRunnersUpBestFirst)
+        {
+            ImageBeams image;
+            image.finished = {finished(3, -3.0f, 10), finished(3, -1.0f, 11), finished(3, -2.0f, 12), finished(3, -4.0f, 13)};
+
+            DecodeResult result = DecodingTest::select_hypotheses(image, options(0.0f, 3));
+
+            ASSERT_EQ(result.alternatives.size(), 2u);
+            EXPECT_EQ(result.tokens[1], 11);
+            EXPECT_EQ(result.alternatives[0][1], 12);
+            EXPECT_EQ(result.alternatives[1][1], 10);
+        }
+
+        TEST(SelectHypotheses, NBestIsCappedByTheHypothesesAvailable)
+        {
+            ImageBeams image;
+            image.finished = {finished(3, -1.0f, 10), finished(3, -2.0f, 11)};
+
+            DecodeResult result = DecodingTest::select_hypotheses(image, options(0.0f, 5));
+
+            EXPECT_EQ(result.tokens[1], 10);
+            ASSERT_EQ(result.alternatives.size(), 1u);
+            EXPECT_EQ(result.alternatives[0][1], 11);
+        }
+
+        TEST(SelectHypotheses, KeepsTheTruncatedFlag)
+        {
+            ImageBeams image;
+            image.finished = {finished(3, -1.0f)};
+
+            EXPECT_TRUE(DecodingTest::select_hypotheses(image, options(0.0f), true).truncated);
+        }
+    }
+}
@@ -0,0 +1,267 @@
+#include <gtest/gtest.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <charconv>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "http_server.hpp"
+
+namespace captioning
+{
+    namespace
+    {
+        struct Response
+        {
+            int status = 0;
+            std::string head;
+            std::string body;
+        };
+
+        // One client connection; reads are bounded by a timeout so a server that stalls fails the test
+        class Client
+        {
+        public:
+            explicit Client(int port)
+            {
+                fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+                timeval timeout{5, 0};
+                ::setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                sockaddr_in address{};
+                address.sin_family = AF_INET;
+                address.sin_port = htons(static_cast<uint16_t>(port));
+                address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                connected_ = ::connect(fd_, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0;
+            }
+
+            ~Client() { ::close(fd_); }
+
+            Client(const Client &) = delete;
+            Client &operator=(const Client &) = delete;
+
+            [[nodiscard]] bool connected() const noexcept { return connected_; }
+
+            bool send(std::string_view data)
+            {
+                while (!data.empty())
+                {
+                    ssize_t sent = ::send(fd_, data.data(), data.size(), 0);
+                    if (sent <= 0)
+                    {
+                        return false;
+                    }
+                    data.remove_prefix(static_cast<size_t>(sent));
+                }
+                return true;
+            }
+
+            // The head up to and including the blank line, or empty if the connection ended first
+            std::string read_head()
+            {
+                size_t end;
+                while ((end = buffer_.find("\r\n\r\n")) == std::string::npos)
+                {
+                    if (!receive())
+                    {
+                        return {};
+                    }
+                }
+                std::string head = buffer_.substr(0, end + 4);
+                buffer_.erase(0, end + 4);
+                return head;
+            }
+
+            std::optional<Response> read_response()
+            {
+                Response response;
+                response.head = read_head();
+                if (response.head.size() < 12)
+                {
+                    return std::nullopt;
+                }
+                std::from_chars(response.head.data() + 9, response.head.data() + 12, response.status);
+                size_t length = 0;
+                if (size_t at = response.head.find("Content-Length: "); at != std::string::npos)
+                {
+                    std::from_chars(response.head.data() + at + 16, response.head.data() + response.head.size(), length);
+                }
+                while (buffer_.size() < length)
+                {
+                    if (!receive())
+                    {
+                        return std::nullopt;
+                    }
+                }
+                response.body = buffer_.substr(0, length);
+                buffer_.erase(0, length);
+                return response;
+            }
+
+            // True once the server has closed its end and nothing more is buffered
+            bool closed_by_server()
+            {
+                return buffer_.empty() && !receive();
+            }
+
+        private:
+            int fd_ = -1;
+            bool connected_ = false;
+            std::string buffer_;
+
+            bool receive()
+            {
+                char chunk[4096];
+                ssize_t received = ::recv(fd_, chunk, sizeof(chunk), 0);
+                if (received <= 0)
+                {
+                    return false;
+                }
+                buffer_.append(chunk, static_cast<size_t>(received));
+                return true;
+            }
+        };
+
+        // A server on a free loopback port answering every request with "<method> <path> <body>"
+        class HttpServerTest : public ::testing::Test
+        {
+        protected:
+            std::unique_ptr<HttpServer> server_;
+
+            void SetUp() override
+            {
+                HttpServerOptions options;
+                options.port = 0;
+                options.threads = 2;
+                options.max_body_bytes = 1024;
+                auto started = HttpServer::start(options, [](const HttpRequest &request)
+                                                 { return HttpResponse{200, "text/plain", request.method + " " + request.path + " " + request.body, {}}; });
+                ASSERT_TRUE(started) << started.error();
+                server_ = std::move(*started);
+            }
+
+            void TearDown() override
+            {
+                if (server_)
+                {
+                    server_->stop();
+                }
+            }
+        };
+
+        TEST_F(HttpServerTest, KeepAliveServesSeveralRequestsOnOneConnection)
+        {
+            Client client(server_->port());
+            ASSERT_TRUE(client.connected());
+
+            ASSERT_TRUE(client.send("POST /a HTTP/1.1\r\nContent-Length: 3\r\n\r\none"));
+            auto first = client.read_response();
+            ASSERT_TRUE(first);
+            EXPECT_EQ(first->status, 200);
+            EXPECT_EQ(first->body, "POST /a one");
+            EXPECT_NE(first->head.find("Connection: keep-alive"), std::string::npos);
+
+            ASSERT_TRUE(client.send("GET /b?x=1 HTTP/1.1\r\n\r\n"));
+            auto second = client.read_response();
+            ASSERT_TRUE(second);
+            EXPECT_EQ(second->body, "GET /b ");
+        }
+
+        TEST_F(HttpServerTest, PipelinedRequestsAreAnsweredInOrder)
+        {
+            Client client(server_->port());
+            ASSERT_TRUE(client.connected());
+
+            ASSERT_TRUE(client.send("POST /1 HTTP/1.1\r\nContent-Length: 1\r\n\r\naPOST /2 HTTP/1.1\r\nContent-Length: 1\r\n\r\nb"));
+            auto first = client.read_response();
+            auto second = client.read_response();
+            ASSERT_TRUE(first && second);
+            EXPECT_EQ(first->body, "POST /1 a");
+            EXPECT_EQ(second->body, "POST /2 b");
+        }
+
+        TEST_F(HttpServerTest, ConnectionCloseEndsTheConnection)
+        {
+            Client client(server_->port());
+            ASSERT_TRUE(client.connected());
+
+            ASSERT_TRUE(client.send("GET / HTTP/1.1\r\nConnection: close\r\n\r\n"));
+            auto response = client.read_response();
+            ASSERT_TRUE(response);
+            EXPECT_NE(response->head.find("Connection: close"), std::string::npos);
+            EXPECT_TRUE(client.closed_by_server());
+        }
+
+        TEST_F(HttpServerTest, Http10ClosesUnlessAskedToKeepAlive)
+        {
+            {
+                Client client(server_->port());
+                ASSERT_TRUE(client.send("GET / HTTP/1.0\r\n\r\n"));
+                ASSERT_TRUE(client.read_response());
+                EXPECT_TRUE(client.closed_by_server());
+            }
+            {
+                Client client(server_->port());
+                ASSERT_TRUE(client.send("GET / HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n"));
+                auto response = client.read_response();
+                ASSERT_TRUE(response);
+                EXPECT_NE(response->head.find("Connection: keep-alive"), std::string::npos);
+            }
+        }
+
+        TEST_F(HttpServerTest, ExpectContinueGetsAnInterimResponseBeforeTheBody)
+        {
+            Client client(server_->port());
+            ASSERT_TRUE(client.connected());
+
+            ASSERT_TRUE(client.send("POST /upload HTTP/1.1\r\nContent-Length: 5\r\nExpect: 100-continue\r\n\r\n"));
+            EXPECT_EQ(client.read_head(), "HTTP/1.1 100 Continue\r\n\r\n");
+
+            ASSERT_TRUE(client.send("hello"));
+            auto response = client.read_response();
+            ASSERT_TRUE(response);
+            EXPECT_EQ(response->status, 200);
+            EXPECT_EQ(response->body, "POST /upload hello");
+        }
+
+        TEST_F(HttpServerTest, NoInterimResponseWhenTheBodyCameWithTheHead)
+        {
+            Client client(server_->port());
+            ASSERT_TRUE(client.send("POST /upload HTTP/1.1\r\nContent-Length: 2\r\nExpect: 100-continue\r\n\r\nhi"));
+            auto response = client.read_response();
+            ASSERT_TRUE(response);
+            EXPECT_EQ(response->status, 200);
+            EXPECT_EQ(response->body, "POST /upload hi");
+        }
+
+        TEST_F(HttpServerTest, RejectsChunkedAndOversizedBodies)
+        {
+            {
+                Client client(server_->port());
+                ASSERT_TRUE(client.send("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"));
+                auto response = client.read_response();
+                ASSERT_TRUE(response);
+                EXPECT_EQ(response->status, 411);
+                EXPECT_TRUE(client.closed_by_server());
+            }
+            {
+                Client client(server_->port());
+                ASSERT_TRUE(client.send("POST / HTTP/1.1\r\nContent-Length: 4096\r\n\r\n"));
+                auto response = client.read_response();
+                ASSERT_TRUE(response);
+                EXPECT_EQ(response->status, 413);
+            }
+            {
+                Client client(server_->port());
+                ASSERT_TRUE(client.send("POST / HTTP/1.1\r\nContent-Length: 12x\r\n\r\n"));
+                auto response = client.read_response();
+                ASSERT_TRUE(response);
+                EXPECT_EQ(response->status, 400);
+            }
+        }
+    }
+}
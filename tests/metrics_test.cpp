@@ -0,0 +1,110 @@
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "metrics.hpp"
+
+namespace captioning
+{
+    namespace
+    {
+        TEST(HistogramBuckets, SmallValuesAreExact)
+        {
+            for (uint64_t value = 0; value < HistogramBuckets::sub_buckets; ++value)
+            {
+                const size_t bucket = HistogramBuckets::index(value);
+                EXPECT_EQ(bucket, value);
+                EXPECT_EQ(HistogramBuckets::lower_bound(bucket), value);
+                EXPECT_EQ(HistogramBuckets::upper_bound(bucket), value);
+            }
+        }
+
+        TEST(HistogramBuckets, EveryValueFallsWithinItsBucket)
+        {
+            std::vector<uint64_t> values{8, 9, 15, 16, 17, 31, 32, 1000, 123456789, uint64_t{1} << 40, (uint64_t{1} << 40) - 1};
+            for (int bits = 3; bits < 64; ++bits)
+            {
+                values.push_back(uint64_t{1} << bits);
+                values.push_back((uint64_t{1} << bits) - 1);
+                values.push_back((uint64_t{1} << bits) + 1);
+            }
+            values.push_back(std::numeric_limits<uint64_t>::max());
+
+            for (uint64_t value : values)
+            {
+                const size_t bucket = HistogramBuckets::index(value);
+                ASSERT_LT(bucket, HistogramBuckets::bucket_count) << value;
+                EXPECT_LE(HistogramBuckets::lower_bound(bucket), value) << value;
+                EXPECT_GE(HistogramBuckets::upper_bound(bucket), value) << value;
+            }
+        }
+
+        TEST(HistogramBuckets, BucketsTileTheRangeWithinOneEighth)
+        {
+            for (size_t bucket = 1; bucket < HistogramBuckets::bucket_count; ++bucket)
+            {
+                const uint64_t lower = HistogramBuckets::lower_bound(bucket);
+                const uint64_t upper = HistogramBuckets::upper_bound(bucket);
+                // No gaps or overlaps between neighbours, and no bucket wider than 12.5% of its values
+                EXPECT_EQ(lower, HistogramBuckets::upper_bound(bucket - 1) + 1) << bucket;
+                EXPECT_EQ(HistogramBuckets::index(lower), bucket);
+                EXPECT_EQ(HistogramBuckets::index(upper), bucket);
+                EXPECT_LE(static_cast<double>(upper - lower), static_cast<double>(lower) / 8.0) << bucket;
+            }
+            EXPECT_EQ(HistogramBuckets::upper_bound(HistogramBuckets::bucket_count - 1), std::numeric_limits<uint64_t>::max());
+        }
+
+        TEST(HistogramSnapshot, QuantilesAreBucketMidpoints)
+        {
+            HistogramSnapshot histogram;
+            EXPECT_EQ(histogram.quantile(0.5), 0.0);
+
+            // 90 values of 3 and 10 of 1000
+            histogram.buckets[HistogramBuckets::index(3)] = 90;
+            const size_t high = HistogramBuckets::index(1000);
+            histogram.buckets[high] = 10;
+            histogram.count = 100;
+            histogram.sum = 90 * 3 + 10 * 1000;
+
+            EXPECT_EQ(histogram.quantile(0.5), 3.0);
+            EXPECT_EQ(histogram.quantile(0.9), 3.0);
+            const double midpoint = (static_cast<double>(HistogramBuckets::lower_bound(high)) + static_cast<double>(HistogramBuckets::upper_bound(high))) / 2.0;
+            EXPECT_EQ(histogram.quantile(0.91), midpoint);
+            EXPECT_EQ(histogram.quantile(1.0), midpoint);
+            EXPECT_NEAR(midpoint, 1000.0, 1000.0 / 16.0);
+            EXPECT_DOUBLE_EQ(histogram.mean(), 102.7);
+        }
+
+        TEST(MetricsSnapshot, PrometheusSeriesCarryTheWorkerLabel)
+        {
+            MetricsSnapshot snapshot;
+            snapshot.counters[static_cast<size_t>(Counter::captions)] = 5;
+
+            const std::string plain = snapshot.to_prometheus();
+            EXPECT_NE(plain.find("captioning_captions_total 5\n"), std::string::npos);
+            EXPECT_NE(plain.find("captioning_stage_seconds_count{stage=\"resize\"} 0\n"), std::string::npos);
+            EXPECT_EQ(plain.find("worker="), std::string::npos);
+
+            snapshot.worker = 3;
+            const std::string labelled = snapshot.to_prometheus();
+            EXPECT_NE(labelled.find("captioning_captions_total{worker=\"3\"} 5\n"), std::string::npos);
+            EXPECT_NE(labelled.find("captioning_stage_seconds_count{worker=\"3\",stage=\"resize\"} 0\n"), std::string::npos);
+            EXPECT_NE(labelled.find("captioning_steps_per_caption{worker=\"3\",quantile=\"0.5\"} 0\n"), std::string::npos);
+            EXPECT_NE(labelled.find("captioning_steps_per_caption_sum{worker=\"3\"} 0\n"), std::string::npos);
+        }
+
+        TEST(MetricsSnapshot, SinceSubtractsAnEarlierSnapshot)
+        {
+            const MetricsSnapshot before = Metrics::snapshot();
+            Metrics::add(Counter::generated_tokens, 7);
+            Metrics::record(Distribution::tokens_per_caption, 7);
+
+            const MetricsSnapshot delta = Metrics::snapshot().since(before);
+            EXPECT_EQ(delta.counter(Counter::generated_tokens), 7u);
+            EXPECT_EQ(delta.distribution(Distribution::tokens_per_caption).count, 1u);
+            EXPECT_EQ(delta.distribution(Distribution::tokens_per_caption).sum, 7u);
+        }
+    }
+}
@@ -0,0 +1,71 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+#include "reorder_buffer.hpp"
+
+namespace captioning
+{
+    namespace
+    {
+        TEST(ReorderBuffer, ReleasesInOrderAsSoonAsTheGapCloses)
+        {
+            ReorderBuffer<std::string> buffer;
+            std::vector<std::string> released;
+            auto release = [&](const std::string &item)
+            {
+                released.push_back(item);
+            };
+
+            EXPECT_EQ(buffer.push(2, "c", release), 0u);
+            EXPECT_EQ(buffer.push(1, "b", release), 0u);
+            EXPECT_EQ(buffer.held(), 2u);
+            EXPECT_TRUE(released.empty());
+
+            EXPECT_EQ(buffer.push(0, "a", release), 3u);
+            EXPECT_EQ(released, (std::vector<std::string>{"a", "b", "c"}));
+            EXPECT_EQ(buffer.held(), 0u);
+            EXPECT_EQ(buffer.next(), 3u);
+
+            EXPECT_EQ(buffer.push(4, "e", release), 0u);
+            EXPECT_EQ(buffer.push(3, "d", release), 2u);
+            EXPECT_EQ(released, (std::vector<std::string>{"a", "b", "c", "d", "e"}));
+        }
+
+        TEST(ReorderBuffer, InOrderItemsPassStraightThrough)
+        {
+            ReorderBuffer<int> buffer;
+            std::vector<int> released;
+            for (int i = 0; i < 5; ++i)
+            {
+                EXPECT_EQ(buffer.push(static_cast<size_t>(i), i * 10, [&](int item)
+                                      { released.push_back(item); }),
+                          1u);
+                EXPECT_EQ(buffer.held(), 0u);
+            }
+            EXPECT_EQ(released, (std::vector<int>{0, 10, 20, 30, 40}));
+        }
+
+        TEST(ReorderBuffer, ReverseOrderIsHeldUntilTheFirstArrives)
+        {
+            constexpr size_t count = 100;
+            ReorderBuffer<size_t> buffer;
+            std::vector<size_t> released;
+            for (size_t i = count; i-- > 1;)
+            {
+                buffer.push(i, i, [&](size_t item)
+                            { released.push_back(item); });
+            }
+            EXPECT_TRUE(released.empty());
+            EXPECT_EQ(buffer.held(), count - 1);
+
+            buffer.push(0, 0, [&](size_t item)
+                        { released.push_back(item); });
+            ASSERT_EQ(released.size(), count);
+            for (size_t i = 0; i < count; ++i)
+            {
+                EXPECT_EQ(released[i], i);
+            }
+        }
+    }
+}
@@ -0,0 +1,112 @@
+#include <gtest/gtest.h>
+#include <bit>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "sidecar_server.hpp"
+
+namespace captioning
+{
+    namespace
+    {
+        template <typename T>
+        void put_le(std::vector<unsigned char> &bytes, T value)
+        {
+            for (size_t i = 0; i < sizeof(T); ++i)
+            {
+                bytes.push_back(static_cast<unsigned char>((static_cast<uint64_t>(value) >> (8 * i)) & 0xFF));
+            }
+        }
+
+        template <typename T>
+        T get_le(const std::string &bytes, size_t at)
+        {
+            uint64_t value = 0;
+            for (size_t i = 0; i < sizeof(T); ++i)
+            {
+                value |= static_cast<uint64_t>(static_cast<unsigned char>(bytes[at + i])) << (8 * i);
+            }
+            return static_cast<T>(value);
+        }
+
+        // Reads the strings of a response frame after its header
+        std::vector<std::string> strings(const std::string &frame)
+        {
+            std::vector<std::string> texts;
+            size_t at = 4 + SidecarServer::response_header_size;
+            for (uint16_t i = 0; i < get_le<uint16_t>(frame, 14); ++i)
+            {
+                uint32_t length = get_le<uint32_t>(frame, at);
+                texts.push_back(frame.substr(at + 4, length));
+                at += 4 + length;
+            }
+            EXPECT_EQ(at, frame.size());
+            return texts;
+        }
+
+        TEST(SidecarFraming, ParsesTheLittleEndianRequestHeader)
+        {
+            std::vector<unsigned char> header;
+            put_le<uint64_t>(header, 0x0102030405060708ull);
+            header.push_back(static_cast<unsigned char>(SidecarServer::PayloadType::region_image));
+            header.push_back(0);
+            put_le<uint16_t>(header, 7);
+            put_le<uint16_t>(header, 30);
+            put_le<uint16_t>(header, 3);
+            put_le<uint32_t>(header, std::bit_cast<uint32_t>(0.7f));
+            put_le<uint32_t>(header, 2500);
+            ASSERT_EQ(header.size(), SidecarServer::request_header_size);
+
+            SidecarServer::RequestHeader parsed = SidecarServer::parse_request_header(header.data());
+
+            EXPECT_EQ(parsed.request_id, 0x0102030405060708ull);
+            EXPECT_EQ(parsed.payload_type, static_cast<uint8_t>(SidecarServer::PayloadType::region_image));
+            EXPECT_EQ(parsed.beam_width, 7);
+            EXPECT_EQ(parsed.max_length, 30);
+            EXPECT_EQ(parsed.n_best, 3);
+            EXPECT_FLOAT_EQ(parsed.length_penalty, 0.7f);
+            EXPECT_EQ(parsed.timeout_ms, 2500u);
+        }
+
+        TEST(SidecarFraming, EncodesACaptionWithItsAlternatives)
+        {
+            CaptionResult result{"a dog on a beach", true, {"a dog", "a beach"}};
+
+            std::string frame = SidecarServer::encode_response(42, result);
+
+            EXPECT_EQ(get_le<uint32_t>(frame, 0), frame.size() - 4);
+            EXPECT_EQ(get_le<uint64_t>(frame, 4), 42u);
+            EXPECT_EQ(frame[12], 0);
+            EXPECT_EQ(frame[13], 1);
+            EXPECT_EQ(strings(frame), (std::vector<std::string>{"a dog on a beach", "a dog", "a beach"}));
+        }
+
+        TEST(SidecarFraming, EncodesAnErrorAsOneString)
+        {
+            std::string frame = SidecarServer::encode_response(7, tl::unexpected(std::string("Deadline exceeded")));
+
+            EXPECT_EQ(get_le<uint32_t>(frame, 0), frame.size() - 4);
+            EXPECT_EQ(get_le<uint64_t>(frame, 4), 7u);
+            EXPECT_EQ(frame[12], 1);
+            EXPECT_EQ(frame[13], 0);
+            EXPECT_EQ(strings(frame), (std::vector<std::string>{"Deadline exceeded"}));
+        }
+
+        TEST(SidecarFraming, AnEmptyResultStillCarriesOneString)
+        {
+            std::string frame = SidecarServer::encode_response(1, CaptionResult{});
+
+            EXPECT_EQ(frame.size(), 4 + SidecarServer::response_header_size + 4);
+            EXPECT_EQ(strings(frame), (std::vector<std::string>{""}));
+        }
+
+        TEST(SidecarFraming, ProtocolErrorsUseTheReservedId)
+        {
+            std::string frame = SidecarServer::encode_response(SidecarServer::protocol_error_id, tl::unexpected(std::string("bad frame")));
+
+            EXPECT_EQ(SidecarServer::protocol_error_id, UINT64_MAX);
+            EXPECT_EQ(get_le<uint64_t>(frame, 4), UINT64_MAX);
+        }
+    }
+}
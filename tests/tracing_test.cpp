@@ -0,0 +1,134 @@
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+#include "tracing.hpp"
+
+namespace captioning
+{
+    namespace
+    {
+        using Clock = std::chrono::steady_clock;
+
+        // Tracing can be enabled once per process, so every test shares this output and looks only at its own spans
+        class TracingTest : public ::testing::Test
+        {
+        protected:
+            static void SetUpTestSuite()
+            {
+                Tracing::enable(::testing::TempDir() + "captioning_trace_{pid}.json", false);
+            }
+
+            static void TearDownTestSuite()
+            {
+                std::error_code ignored;
+                std::filesystem::remove(path(), ignored);
+            }
+
+            static std::string path()
+            {
+                return ::testing::TempDir() + "captioning_trace_" + std::to_string(::getpid()) + ".json";
+            }
+
+            static nlohmann::json write_and_read()
+            {
+                const std::string error = Tracing::write();
+                EXPECT_EQ(error, "");
+                std::ifstream in(path());
+                return nlohmann::json::parse(in, nullptr, false);
+            }
+
+            static std::vector<nlohmann::json> spans(const nlohmann::json &trace, std::string_view name)
+            {
+                std::vector<nlohmann::json> found;
+                for (const auto &event : trace["traceEvents"])
+                {
+                    if (event["ph"] == "X" && event["name"] == name)
+                    {
+                        found.push_back(event);
+                    }
+                }
+                return found;
+            }
+        };
+
+        TEST_F(TracingTest, WritesChromeTraceEvents)
+        {
+            ASSERT_TRUE(Tracing::enabled());
+            const auto start = Clock::now();
+            Tracing::record("test", "fixed_span", start, start + std::chrono::microseconds(1500));
+
+            const nlohmann::json trace = write_and_read();
+
+            ASSERT_TRUE(trace.is_object());
+            EXPECT_EQ(trace["displayTimeUnit"], "ms");
+            ASSERT_TRUE(trace["traceEvents"].is_array());
+            EXPECT_EQ(trace["traceEvents"][0]["ph"], "M");
+            EXPECT_EQ(trace["traceEvents"][0]["args"]["name"], "image_captioning");
+
+            auto found = spans(trace, "fixed_span");
+            ASSERT_EQ(found.size(), 1u);
+            const nlohmann::json &span = found.front();
+            EXPECT_EQ(span["cat"], "test");
+            EXPECT_EQ(span["pid"], ::getpid());
+            EXPECT_DOUBLE_EQ(span["dur"].get<double>(), 1500.0);
+            EXPECT_GE(span["ts"].get<double>(), 0.0);
+        }
+
+        TEST_F(TracingTest, EachWriteTakesOnlyTheSpansSinceThePreviousOne)
+        {
+            const auto now = Clock::now();
+            Tracing::record("test", "before_write", now, now);
+            const nlohmann::json first = write_and_read();
+            EXPECT_EQ(spans(first, "before_write").size(), 1u);
+
+            Tracing::record("test", "after_write", now, now);
+            const nlohmann::json second = write_and_read();
+            EXPECT_EQ(spans(second, "before_write").size(), 0u);
+            EXPECT_EQ(spans(second, "after_write").size(), 1u);
+        }
+
+        TEST_F(TracingTest, SpansOfALongRunFitAcrossWrites)
+        {
+            // More spans than one buffer holds, but never that many between two writes
+            const auto now = Clock::now();
+            size_t written = 0;
+            for (int round = 0; round < 4; ++round)
+            {
+                for (size_t i = 0; i < Tracing::max_events_per_thread / 2; ++i)
+                {
+                    Tracing::record("test", "bulk_span", now, now);
+                }
+                written += spans(write_and_read(), "bulk_span").size();
+            }
+            EXPECT_EQ(written, 2 * Tracing::max_events_per_thread);
+        }
+
+        TEST_F(TracingTest, ThreadsKeepTheirOwnTracksAcrossReusedBuffers)
+        {
+            // The second thread may take over the first one's buffer before anything is written
+            auto record = []
+            {
+                TraceSpan span("test", "thread_span");
+            };
+            std::thread(record).join();
+            std::thread(record).join();
+
+            std::set<int> tids;
+            for (const auto &span : spans(write_and_read(), "thread_span"))
+            {
+                tids.insert(span["tid"].get<int>());
+            }
+            EXPECT_EQ(tids.size(), 2u);
+        }
+    }
+}